@@ -1,14 +1,21 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/wait.h>
 
 #include "caddx.h"
@@ -23,6 +30,30 @@ int errline = 0, fg;
 static char *notify_proc = NULL;
 static uint32_t part_sirened = 0;
 
+/* Zone names, asked for the first time a zone reports in */
+static char zone_names[256][CADDX_ZN_NAME_LEN + 1];
+static uint8_t zone_name_asked[256];
+
+/* Protocol spoken with the bridge, see CADDX_HELLO */
+static int proto = CADDX_PROTO_LEGACY;
+static int panel = -1;		/* -n, from 0; -1: the bridge's first */
+
+/* Statistics, see stats_defs */
+static struct {
+	uint64_t frames, mcast, mcast_lost, snapshots;
+	uint64_t events, rules, commands, polls, poll_changes;
+	uint64_t poll_ival;	/* gauge, set by stats_update() */
+	struct stat_hist poll_ms;
+	/* Where a frame's time goes, in us */
+	struct stat_hist parse, notify, rule;
+} st;
+static int stats_dump = 0;
+
+static int caddx_send(int fd, uint16_t id, void *msg, uint8_t len);
+static uint16_t caddx_new_id(void);
+static int caddx_pri_fn(int fd, int fn, int part, int pin);
+static int caddx_sec_fn(int fd, int fn, int part);
+
 static void caddx_signal(int signum)
 {
 	int to = 10;
@@ -31,6 +62,8 @@ static void caddx_signal(int signum)
 		while (waitpid(-1, NULL, WNOHANG) >= 0 && --to) {}
 	} else if (signum == SIGINT)
 		quit = 1;
+	else if (signum == SIGUSR1)
+		stats_dump = 1;
 }
 
 static void
@@ -43,11 +76,31 @@ Usage: caddx-mon [options]\n\
         TYPE: zone or part\n\
         ID: zone or partition number\n\
         EVENT: active/inactive or siren\n\
+        NAME: zone name, if known\n\
 -f    : Run in foreground\n\
 -H ...: Host to connect to\n\
+-M ...: Receive multicast on the interface with this IPv4 address\n\
+-m ...: Receive panel messages from multicast GROUP:PORT, resyncing\n\
+        from the host whenever datagrams go missing\n\
+-n ...: Panel to talk to, for a bridge serving several (default 1)\n\
 -P ...: Use PIN for primary function\n\
 -p ...: Partition to poll or perform function on (default 1)\n\
+-R ...: Act on events as the rules in file ... say\n\
+        One rule per line, '#' starts a comment:\n\
+        TYPE ID EVENT ACTION ARG, e.g. zone 3 active log /var/log/door\n\
+        TYPE ID EVENT: as for -e, ID may be * for any zone or partition\n\
+        log FILE: Append a line to FILE\n\
+        socket PATH: Send the line to Unix datagram socket PATH\n\
+        exec PROGRAM: Run PROGRAM with the environment of -e\n\
+        cmd x N [P]: Primary function N (cmd X: secondary) on partition P\n\
+        cmd t Z: Toggle the bypass of zone Z\n\
+-S ...: Run the commands in file ... ('-' for stdin) over one connection\n\
+        One command per line, '#' starts a comment:\n\
+        x N: Primary function N     X N: Secondary function N\n\
+        b Z: Bypass zone Z          B Z: Unbypass zone Z\n\
+        s  : Partition status       p P: Use partition P from here on\n\
 -v    : Increase logging\n\
+-w ...: Serve statistics for Prometheus at HOST:PORT, SIGUSR1 logs them\n\
 -x ...: Primary function\n\
      0: Turn off sounder/alarm\n\
      1: Disarm\n\
@@ -74,19 +127,21 @@ Usage: caddx-mon [options]\n\
     13: Aux function 1\n\
     14: Aux function 2\n\
     15: Start keypad sounder\n\
+-y ...: Show what the host kept for zone zN or partition pN over the\n\
+        last hour, or the last SECS seconds with zN:SECS\n\
 ");
 }
 
 static int
-proc_notify(const char *type, int _id, const char *event)
+proc_notify(const char *prog, const char *type, int _id, const char *event)
 {
 	int pid;
 	char *argv[2], id[16];
 
-	if (!notify_proc)
+	if (!prog)
 		return -1;
 
-	argv[0] = notify_proc;
+	argv[0] = (char *)prog;
 	argv[1] = NULL;
 
 	if ((pid = fork()) < 0) {
@@ -102,6 +157,8 @@ proc_notify(const char *type, int _id, const char *event)
 	setenv("TYPE", type, 1);
 	setenv("ID", id, 1);
 	setenv("EVENT", event, 1);
+	if (!strcmp(type, "zone") && zone_names[_id - 1][0])
+		setenv("NAME", zone_names[_id - 1], 1);
 
 	if (loglevel == 0) {
 		freopen("/dev/null", "r", stdin);
@@ -113,40 +170,365 @@ proc_notify(const char *type, int _id, const char *event)
 	exit(-1);
 }
 
+static const char *
+zone_label(int zone)
+{
+	static char label[64];
+
+	if (zone_names[zone][0])
+		snprintf(label, sizeof(label), "%d (%s)", zone + 1, zone_names[zone]);
+	else
+		snprintf(label, sizeof(label), "%d", zone + 1);
+	return label;
+}
+
+/* Rules (-R).  They are read once into rule_tab, indexed by event and
+ * by zone or partition number with 0 for any, so an event costs two
+ * lookups however many rules there are, and nothing at all if no rule
+ * is about it.
+ */
+enum {
+	EV_ZONE_ACTIVE,
+	EV_ZONE_INACTIVE,
+	EV_PART_SIREN,
+	EV_PART_SIREN_OFF,
+	EV_N
+};
+
+static const struct {
+	const char *type, *event;
+} ev_names[EV_N] = {
+	[EV_ZONE_ACTIVE] = { "zone", "active" },
+	[EV_ZONE_INACTIVE] = { "zone", "inactive" },
+	[EV_PART_SIREN] = { "part", "siren" },
+	[EV_PART_SIREN_OFF] = { "part", "siren_off" },
+};
+
+enum {
+	RULE_LOG,
+	RULE_SOCKET,
+	RULE_EXEC,
+	RULE_CMD,
+};
+
+struct rule {
+	struct rule *next;	/* for the same event and ID */
+	int action;
+	int fd;			/* RULE_LOG */
+	struct sockaddr_un sun;	/* RULE_SOCKET */
+	char *prog;		/* RULE_EXEC */
+	char op;		/* RULE_CMD: x, X or t */
+	int arg, part;
+};
+
+static struct rule *rule_tab[EV_N][1 + 256];
+static int rule_sock = -1, rule_pin = -1;
+
+static int
+rules_load(const char *name, int part)
+{
+	char line[256], type[8], id[8], event[16], action[8], arg[192];
+	struct rule *r = NULL;
+	FILE *f;
+	char *p;
+	int lineno = 0, ev, n;
+
+	errno = 0;
+	if (!(f = fopen(name, "r")))
+		ERR(errno);
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if ((p = strchr(line, '#')))
+			*p = 0;
+		for (p = line + strlen(line); p > line && isspace((unsigned char)p[-1]); p--)
+			;
+		*p = 0;
+		if ((n = sscanf(line, " %7s %7s %15s %7s %191[^\n]", type, id, event, action, arg)) < 1)
+			continue;
+		for (ev = 0; ev < EV_N; ev++)
+			if (!strcmp(type, ev_names[ev].type) && !strcmp(event, ev_names[ev].event))
+				break;
+		if (n < 5 || ev == EV_N)
+			goto bad;
+		if (!(r = calloc(1, sizeof(*r))))
+			ERR(ENOMEM);
+		r->fd = -1;
+
+		if (!strcmp(action, "log")) {
+			r->action = RULE_LOG;
+			if ((r->fd = open(arg, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0)
+				ERR(errno);
+		} else if (!strcmp(action, "socket")) {
+			r->action = RULE_SOCKET;
+			if (strlen(arg) >= sizeof(r->sun.sun_path))
+				goto bad;
+			r->sun.sun_family = AF_UNIX;
+			strcpy(r->sun.sun_path, arg);
+			if (rule_sock < 0 &&
+			    (rule_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+				ERR(errno);
+		} else if (!strcmp(action, "exec")) {
+			r->action = RULE_EXEC;
+			if (!(r->prog = strdup(arg)))
+				ERR(ENOMEM);
+		} else if (!strcmp(action, "cmd")) {
+			r->action = RULE_CMD;
+			r->part = part + 1;
+			if (sscanf(arg, " %c %d %d", &r->op, &r->arg, &r->part) < 2 ||
+			    !strchr("xXt", r->op) || r->part < 1 || r->part > 8 ||
+			    (r->op == 't' && (r->arg < 1 || r->arg > 256)))
+				goto bad;
+		} else
+			goto bad;
+
+		if (!strcmp(id, "*"))
+			n = 0;
+		else if ((n = strtol(id, NULL, 10)) < 1 || n > 256)
+			goto bad;
+		r->next = rule_tab[ev][n];
+		rule_tab[ev][n] = r;
+		r = NULL;
+		continue;
+ bad:
+		err("%s:%d: bad rule\n", name, lineno);
+		ERR(EINVAL);
+	}
+
+	/* FALLTHROUGH */
+ error:
+	if (r) {
+		if (r->fd >= 0) close(r->fd);
+		free(r);
+	}
+	if (f) fclose(f);
+	if (errno)
+		return -1;
+	return 0;
+}
+
+static void
+rule_run(int fd, struct rule *r, int ev, int id, const char *text, int len)
+{
+	uint64_t at = mono_us();
+
+	st.rules++;
+	switch (r->action) {
+	case RULE_LOG:
+		if (write(r->fd, text, len) != len)
+			warn("rule: log: %s\n", strerror(errno));
+		break;
+	case RULE_SOCKET:
+		if (sendto(rule_sock, text, len, MSG_DONTWAIT,
+			   (struct sockaddr *)&r->sun, sizeof(r->sun)) < 0)
+			debug("rule: %s: %s\n", r->sun.sun_path, strerror(errno));
+		break;
+	case RULE_EXEC:
+		proc_notify(r->prog, ev_names[ev].type, id, ev_names[ev].event);
+		break;
+	case RULE_CMD:
+		if (r->op == 'x')
+			caddx_pri_fn(fd, r->arg, r->part - 1, rule_pin);
+		else if (r->op == 'X')
+			caddx_sec_fn(fd, r->arg, r->part - 1);
+		else {
+			struct caddx_bypass_toggle toggle = {{ CADDX_BYPASS_TOGGLE }, r->arg - 1 };
+			caddx_send(fd, caddx_new_id(), &toggle, sizeof(toggle));
+		}
+		break;
+	}
+	stat_hist_add(&st.rule, mono_us() - at);
+	PROBE(mon_rule, ev, id, r->action, mono_us() - at);
+}
+
+/* Zone or partition id (from 1) saw event ev */
+static void
+event_fire(int fd, int ev, int id)
+{
+	struct rule *any = rule_tab[ev][0], *one = rule_tab[ev][id], *r;
+	char text[128], num[16];
+	time_t now;
+	int len;
+
+	st.events++;
+	PROBE(mon_event, ev, id);
+	if (notify_proc) {
+		uint64_t at = mono_us();
+		proc_notify(notify_proc, ev_names[ev].type, id, ev_names[ev].event);
+		stat_hist_add(&st.notify, mono_us() - at);
+		PROBE(mon_notify, ev, id, mono_us() - at);
+	}
+	if (!any && !one)
+		return;
+
+	now = time(NULL);
+	snprintf(num, sizeof(num), "%d", id);
+	len = strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	len += snprintf(text + len, sizeof(text) - len, " %s %s %s\n", ev_names[ev].type,
+			ev <= EV_ZONE_INACTIVE ? zone_label(id - 1) : num, ev_names[ev].event);
+	for (r = one; r; r = r->next)
+		rule_run(fd, r, ev, id, text, len);
+	for (r = any; r; r = r->next)
+		rule_run(fd, r, ev, id, text, len);
+}
+
+/* Partition status polls only catch what transition messages missed.
+ * While transitions keep coming in the link is evidently alive, so the
+ * polls back off up to POLL_MAX; once it has been quiet for the base
+ * interval, the next poll goes right away.  A suspected gap, lost
+ * datagrams or a poll showing a change nobody told us about, and every
+ * command sent from here start a burst of POLL_BURST quick polls.
+ */
+#define POLL_FREQ	30	/* s */
+#define POLL_MAX	240	/* s */
+#define POLL_BURST	3
+#define POLL_BURST_GAP	2	/* s */
+
+static int poll_part = 0, poll_ival = POLL_FREQ, poll_burst = 0;
+static int poll_pending = 0, poll_heard = 0, poll_known = 0;
+static time_t poll_next = 0, poll_heard_at = 0;
+static uint64_t poll_sent = 0;
+static uint16_t poll_id = 0;
+static uint8_t poll_last[CADDX_PART_STATUS_LEN];
+
+static void
+poll_kick(void)
+{
+	poll_burst = POLL_BURST;
+	poll_next = time(NULL);
+}
+
+static void
+poll_tick(int fd)
+{
+	struct caddx_part_status_req req = {{ CADDX_PART_STATUS_REQ }};
+	time_t now = time(NULL);
+
+	/* Gone quiet while backed off, do not wait for the long interval */
+	if (poll_ival > POLL_FREQ && now - poll_heard_at >= POLL_FREQ &&
+	    poll_next > now) {
+		poll_ival = POLL_FREQ;
+		poll_next = now;
+	}
+	if (now < poll_next)
+		return;
+
+	if (poll_burst) {
+		poll_burst--;
+		poll_next = now + POLL_BURST_GAP;
+	} else {
+		if (poll_heard && poll_ival < POLL_MAX)
+			poll_ival = (poll_ival * 2 < POLL_MAX) ? poll_ival * 2 : POLL_MAX;
+		else if (!poll_heard)
+			poll_ival = POLL_FREQ;
+		poll_next = now + poll_ival;
+	}
+	debug("poll: next in %ld s\n", (long)(poll_next - now));
+	poll_heard = 0;
+
+	req.part = poll_part;
+	poll_id = caddx_new_id();
+	poll_sent = mono_ms();
+	st.polls++;
+	if (caddx_send(fd, poll_id, &req, sizeof(req)) == 0)
+		poll_pending = 1;
+}
+
+/* A status message came in; remember it if it is for our partition */
+static void
+poll_seen(uint8_t *buf, uint32_t len)
+{
+	uint8_t type = len ? buf[0] & CADDX_MSG_MASK : 0;
+
+	if (type == CADDX_PART_STATUS && len == sizeof(poll_last) &&
+	    buf[1] == poll_part) {
+		/* Our own polls may come back this way too, they do not count */
+		if (poll_known && !memcmp(poll_last + 1, buf + 1, len - 1))
+			return;
+		memcpy(poll_last + 1, buf + 1, len - 1);
+		poll_known = 1;
+	} else if (type != CADDX_ZONE_STATUS && type != CADDX_PART_STATUS)
+		return;
+	poll_heard = 1;
+	poll_heard_at = time(NULL);
+}
+
+/* Returns 1 if buf answers our poll */
+static int
+poll_reply(uint8_t *buf, uint32_t len, uint16_t id)
+{
+	uint8_t type = len ? buf[0] & CADDX_MSG_MASK : 0;
+
+	if (!poll_pending || !len)
+		return 0;
+	if (proto >= CADDX_PROTO_V1 ? id != poll_id :
+	    type != CADDX_PART_STATUS || len < 2 || buf[1] != poll_part)
+		return 0;
+	poll_pending = 0;
+	stat_hist_add(&st.poll_ms, mono_ms() - poll_sent);
+	if (type != CADDX_PART_STATUS || len != sizeof(poll_last))
+		return 1;
+
+	if (poll_known && memcmp(poll_last + 1, buf + 1, len - 1)) {
+		warn("poll: partition %d changed unannounced\n", poll_part + 1);
+		st.poll_changes++;
+		poll_kick();
+	}
+	memcpy(poll_last + 1, buf + 1, len - 1);
+	poll_known = 1;
+	return 1;
+}
+
 void
 caddx_parse(int fd, uint8_t *buf, uint32_t len)
 {
-	struct caddx_msg *msg = (struct caddx_msg *)buf;
+	struct caddx_view v;
+	uint8_t zone, part;
 
-	switch (msg->type) {
-	case CADDX_ZONE_STATUS: {
-		struct caddx_zone_status *status = (struct caddx_zone_status *)buf;
-		if (len != sizeof(*status))
-			goto error;
-		if (status->faulted || status->tampered || status->trouble) {
-			proc_notify("zone", status->zone + 1, "active");
-			warn("zone %d activity\n", status->zone + 1);
+	if (!len || buf[0] & CADDX_LOCAL)
+		return;
+	if (caddx_decode(&v, buf, len) < 0)
+		goto error;
+
+	switch (caddx_type(&v)) {
+	case CADDX_ZONE_STATUS:
+		zone = caddx_byte(&v, CADDX_ZS_ZONE);
+		if (!zone_name_asked[zone]) {
+			struct caddx_zone_name_req req = {{ CADDX_ZONE_NAME_REQ }, zone };
+			zone_name_asked[zone] = 1;
+			caddx_send(fd, caddx_new_id(), &req, sizeof(req));
+		}
+		if (caddx_bit(&v, CADDX_ZS_FAULTED) || caddx_bit(&v, CADDX_ZS_TAMPERED) ||
+		    caddx_bit(&v, CADDX_ZS_TROUBLE)) {
+			event_fire(fd, EV_ZONE_ACTIVE, zone + 1);
+			warn("zone %s activity\n", zone_label(zone));
 		} else {
-			proc_notify("zone", status->zone + 1, "inactive");
-			warn("zone %d ok\n", status->zone + 1);
+			event_fire(fd, EV_ZONE_INACTIVE, zone + 1);
+			warn("zone %s ok\n", zone_label(zone));
 		}
 		break;
+	case CADDX_ZONE_NAME: {
+		int i;
+		zone = caddx_byte(&v, CADDX_ZN_ZONE);
+		memcpy(zone_names[zone], v.msg + CADDX_ZN_NAME, CADDX_ZN_NAME_LEN);
+		for (i = CADDX_ZN_NAME_LEN; i > 0 && zone_names[zone][i - 1] == ' '; i--)
+			zone_names[zone][i - 1] = 0;
+		break;
 	}
-	case CADDX_PART_STATUS: {
-		struct caddx_part_status *status = (struct caddx_part_status *)buf;
-		if (status->siren_on) {
-			if (!(part_sirened & (1 << status->part))) {
-				proc_notify("part", status->part + 1, "siren");
-				part_sirened |= (1 << status->part);
+	case CADDX_PART_STATUS:
+		part = caddx_byte(&v, CADDX_PS_PART);
+		if (caddx_bit(&v, CADDX_PS_SIREN_ON)) {
+			if (!(part_sirened & (1 << part))) {
+				event_fire(fd, EV_PART_SIREN, part + 1);
+				part_sirened |= (1 << part);
 			}
 		} else {
-			if (part_sirened & (1 << status->part)) {
-				proc_notify("part", status->part + 1, "siren_off");
-				part_sirened &= ~(1 << status->part);
+			if (part_sirened & (1 << part)) {
+				event_fire(fd, EV_PART_SIREN_OFF, part + 1);
+				part_sirened &= ~(1 << part);
 			}
 		}
 		break;
-	}
 	default:
 	error:
 #ifdef HEXDUMP
@@ -157,14 +539,44 @@ caddx_parse(int fd, uint8_t *buf, uint32_t len)
 	}
 }
 
+static uint16_t last_id = 0;
+
+/* caddx_parse(), and all it sets off: names, -e and the rules */
+static void
+caddx_parse_timed(int fd, uint8_t *buf, uint32_t len)
+{
+	uint64_t at = mono_us();
+
+	caddx_parse(fd, buf, len);
+	stat_hist_add(&st.parse, mono_us() - at);
+	PROBE(mon_frame, len ? buf[0] & CADDX_MSG_MASK : 0, len, mono_us() - at);
+}
+
+static uint16_t
+caddx_new_id(void)
+{
+	if (!++last_id)
+		last_id++;
+	return last_id;
+}
+
 static int
-caddx_rx_pkt(int fd, uint8_t *buf, uint8_t *maxlen)
+caddx_rx_pkt(int fd, uint8_t *buf, uint8_t *maxlen, uint16_t *id)
 {
-	uint8_t len = 0;
+	uint8_t len = 0, hdr[CADDX_ID_LEN];
 
 	errno = 0;
 	if (full_read(fd, &len, 1, 1) != 1)
 		ERR(-EIO);
+	if (proto >= CADDX_PROTO_V1) {
+		if (len < CADDX_ID_LEN ||
+		    full_read(fd, hdr, CADDX_ID_LEN, 1) != CADDX_ID_LEN)
+			ERR(-EIO);
+		len -= CADDX_ID_LEN;
+		if (id)
+			*id = (hdr[0] << 8) | hdr[1];
+	} else if (id)
+		*id = 0;
 	if (len > *maxlen)
 		ERR(-EIO);
 	if (full_read(fd, buf, len, 1) != len)
@@ -178,16 +590,101 @@ caddx_rx_pkt(int fd, uint8_t *buf, uint8_t *maxlen)
 	else return 0;
 }
 
+/* Wait for the reply to request id.  Bridges that only speak the legacy
+ * protocol broadcast everything untagged, so there the first frame of the
+ * right type has to do.
+ */
 static int
-caddx_rx_pkt_type(int fd, uint8_t *buf, uint8_t *maxlen, uint8_t type)
+caddx_rx_reply(int fd, uint8_t *buf, uint8_t *maxlen, uint16_t id, uint8_t type)
 {
 	uint32_t _maxlen = *maxlen;
-	struct caddx_msg *msg = (struct caddx_msg *)buf;
-	msg->type = 0x3f;
-	while (!quit && msg->type != type) {
+	uint16_t rx_id = 0;
+
+	buf[0] = CADDX_MSG_MASK;
+	while (!quit) {
 		*maxlen = _maxlen;
-		if (caddx_rx_pkt(fd, buf, maxlen) < 0)
+		if (caddx_rx_pkt(fd, buf, maxlen, &rx_id) < 0)
 			return -1;
+		if (proto >= CADDX_PROTO_V1 ? rx_id == id : (buf[0] & CADDX_MSG_MASK) == type)
+			break;
+	}
+	if (*maxlen && (buf[0] & CADDX_MSG_MASK) != type) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+caddx_send(int fd, uint16_t id, void *msg, uint8_t len)
+{
+	uint8_t buf[1 + CADDX_ID_LEN + 255];
+	uint32_t hlen = 1;
+
+	if (proto >= CADDX_PROTO_V1) {
+		buf[1] = id >> 8;
+		buf[2] = id & 0xff;
+		hlen += CADDX_ID_LEN;
+	}
+	buf[0] = hlen - 1 + len;
+	memcpy(buf + hlen, msg, len);
+	if (full_write(fd, buf, hlen + len, 1) < 0)
+		return -1;
+
+	/* See what the command did */
+	if (len && (buf[hlen] & CADDX_MSG_MASK) >= CADDX_KEYPAD_FUNC0 &&
+	    (buf[hlen] & CADDX_MSG_MASK) <= CADDX_BYPASS_TOGGLE) {
+		st.commands++;
+		poll_kick();
+	}
+	return 0;
+}
+
+/* Ask the bridge for request IDs and the panel of -n.  A bridge that
+ * predates them forwards the hello to the panel, which rejects it, and
+ * never answers; after a short wait we carry on in the legacy protocol.
+ * Such a bridge, or one without the panel, only serves the first.
+ */
+static int
+caddx_hello(int fd)
+{
+	struct caddx_hello hello = { CADDX_HELLO, CADDX_PROTO_V1, panel };
+	time_t deadline = time(NULL) + 2;
+	uint8_t buf[128], len, on = 0;
+	struct timeval tv;
+	fd_set fds;
+	int i;
+
+	if (caddx_send(fd, 0, &hello, sizeof(hello) - (panel < 0)) < 0)
+		return -1;
+
+	while (!quit && time(NULL) < deadline) {
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if ((i = select(fd + 1, &fds, NULL, NULL, &tv)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!i)
+			continue;
+		len = sizeof(buf);
+		if (caddx_rx_pkt(fd, buf, &len, NULL) < 0)
+			return -1;
+		if (buf[0] == CADDX_HELLO && len >= sizeof(hello) - 1) {
+			proto = buf[1];
+			if (len >= sizeof(hello))
+				on = buf[2];
+			info("bridge speaks v%d\n", proto);
+			break;
+		}
+	}
+	if (panel > 0 && on != panel) {
+		err("bridge does not serve panel %d\n", panel + 1);
+		errno = ENODEV;
+		return -1;
 	}
 	return 0;
 }
@@ -195,15 +692,15 @@ caddx_rx_pkt_type(int fd, uint8_t *buf, uint8_t *maxlen, uint8_t type)
 static int
 caddx_zone_status(int fd, int zone, uint8_t *buf, uint8_t *maxlen)
 {
-	struct caddx_zone_status_req *req = (struct caddx_zone_status_req *)&buf[1];
+	struct caddx_zone_status_req req = {{ 0 }};
+	uint16_t id = caddx_new_id();
+
 	errno = 0;
-	buf[0] = sizeof(*req);
-		memset(req, 0, sizeof(*req));
-	req->msg.type = CADDX_ZONE_STATUS_REQ;
-	req->zone = zone;
-	if (full_write(fd, buf, 1 + sizeof(*req), 1) < 0)
+	req.msg.type = CADDX_ZONE_STATUS_REQ;
+	req.zone = zone;
+	if (caddx_send(fd, id, &req, sizeof(req)) < 0)
 		ERR(errno);
-	if (caddx_rx_pkt_type(fd, buf, maxlen, CADDX_ZONE_STATUS) < 0)
+	if (caddx_rx_reply(fd, buf, maxlen, id, CADDX_ZONE_STATUS) < 0)
 		ERR(errno);
 
 	/* FALLTHROUGH */
@@ -213,32 +710,670 @@ caddx_zone_status(int fd, int zone, uint8_t *buf, uint8_t *maxlen)
 	else return 0;
 }
 
+/* Multicast receive mode.  Panel messages arrive as datagrams; the TCP
+ * connection is only used for our own requests and, whenever the sequence
+ * numbers show a gap, for a state snapshot from the bridge.
+ */
+static int mcast_fd = -1, mcast_resync = 0, mcast_started = 0;
+static uint32_t mcast_next = 0;
+static uint16_t mcast_snap_id = 0;
+
+static int
+mcast_open(char *group, char *ifaddr)
+{
+	struct sockaddr_in sin = { 0 };
+	struct ip_mreq mreq;
+	char *port;
+	int on = 1;
+
+	errno = 0;
+	if ((port = rindex(group, ':')) == NULL)
+		ERR(EINVAL);
+	*(port++) = 0;
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(strtol(port, NULL, 0));
+	if (!inet_aton(group, &sin.sin_addr))
+		ERR(EINVAL);
+	mreq.imr_multiaddr = sin.sin_addr;
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (ifaddr && !inet_aton(ifaddr, &mreq.imr_interface))
+		ERR(EINVAL);
+
+	if ((mcast_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		ERR(errno);
+	setsockopt(mcast_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(mcast_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+		ERR(errno);
+	if (setsockopt(mcast_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+		ERR(errno);
+
+	/* FALLTHROUGH */
+ error:
+	if (errno)
+		return -1;
+	return 0;
+}
+
+static int
+mcast_snapshot(int fd)
+{
+	uint8_t req = CADDX_SNAPSHOT;
+
+	if (proto < CADDX_PROTO_V1)
+		return 0;
+	info("mcast: requesting snapshot\n");
+	st.snapshots++;
+	mcast_resync = 1;
+	mcast_snap_id = caddx_new_id();
+	return caddx_send(fd, mcast_snap_id, &req, sizeof(req));
+}
+
+static void
+mcast_snapshot_end(uint8_t *buf, uint32_t len)
+{
+	struct caddx_snapshot_end *end = (struct caddx_snapshot_end *)buf;
+	uint32_t seq;
+
+	if (len < sizeof(*end))
+		return;
+	seq = (end->seq[0] << 24) | (end->seq[1] << 16) | (end->seq[2] << 8) | end->seq[3];
+	/* Datagrams before seq are covered by the snapshot */
+	if (!mcast_started || (int32_t)(seq - mcast_next) > 0)
+		mcast_next = seq;
+	mcast_started = 1;
+	mcast_resync = 0;
+}
+
+static int
+mcast_rx(int fd)
+{
+	uint8_t buf[sizeof(struct caddx_mcast_hdr) + 255];
+	struct caddx_mcast_hdr *hdr = (struct caddx_mcast_hdr *)buf;
+	uint32_t seq;
+	ssize_t n;
+
+	if ((n = recv(mcast_fd, buf, sizeof(buf), 0)) < 0)
+		return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+	if (n < sizeof(*hdr) || hdr->version != CADDX_MCAST_V1 ||
+	    ((hdr->magic[0] << 8) | hdr->magic[1]) != CADDX_MCAST_MAGIC ||
+	    n != sizeof(*hdr) + hdr->len)
+		return 0;
+	/* Each panel of the bridge counts its own */
+	if (hdr->panel != (panel < 0 ? 0 : panel))
+		return 0;
+
+	seq = (hdr->seq[0] << 24) | (hdr->seq[1] << 16) | (hdr->seq[2] << 8) | hdr->seq[3];
+	/* Nothing can have gone missing before the first one */
+	if (!mcast_started) {
+		mcast_started = 1;
+		mcast_next = seq;
+	}
+	if ((int32_t)(seq - mcast_next) < 0)
+		return 0;
+	st.mcast++;
+	if (seq != mcast_next && !mcast_resync) {
+		warn("mcast: lost %u datagrams\n", seq - mcast_next);
+		st.mcast_lost += seq - mcast_next;
+		if (mcast_snapshot(fd) < 0)
+			return -1;
+		poll_kick();
+	}
+	mcast_next = seq + 1;
+
+	poll_seen(buf + sizeof(*hdr), hdr->len);
+	caddx_parse_timed(fd, buf + sizeof(*hdr), hdr->len);
+	return 0;
+}
+
+static int
+caddx_pri_fn(int fd, int fn, int part, int pin)
+{
+	if (pin >= 0) {
+		struct caddx_keypad_func0 func = {{ 0 }};
+		func.msg.type = CADDX_KEYPAD_FUNC0;
+		func.msg.ack = 1;
+		if (pin > 9999) {
+			func.pin1 = (pin / 100000) % 10;
+			func.pin2 = (pin /  10000) % 10;
+			func.pin3 = (pin /   1000) % 10;
+			func.pin4 = (pin /    100) % 10;
+			func.pin5 = (pin /     10) % 10;
+			func.pin6 = (pin /      1) % 10;
+		} else {
+			func.pin1 = (pin / 1000) % 10;
+			func.pin2 = (pin /  100) % 10;
+			func.pin3 = (pin /   10) % 10;
+			func.pin4 = (pin /    1) % 10;
+		}
+		func.function = fn;
+		func.part = (1 << part);
+		return caddx_send(fd, caddx_new_id(), &func, sizeof(func));
+	} else {
+		struct caddx_keypad_func0_nopin func = {{ 0 }};
+		func.msg.type = CADDX_KEYPAD_FUNC0_NOPIN;
+		func.msg.ack = 1;
+		func.function = fn;
+		func.part = (1 << part);
+		return caddx_send(fd, caddx_new_id(), &func, sizeof(func));
+	}
+}
+
+static int
+caddx_sec_fn(int fd, int fn, int part)
+{
+	struct caddx_keypad_func1 func = {{ 0 }};
+	func.msg.type = CADDX_KEYPAD_FUNC1;
+	func.msg.ack = 1;
+	func.function = fn;
+	func.part = (1 << part);
+	return caddx_send(fd, caddx_new_id(), &func, sizeof(func));
+}
+
+static const char *
+part_status_str(const struct caddx_view *v)
+{
+	if (caddx_bit(v, CADDX_PS_EXIT1))
+		return "Arming (exit1).";
+	else if (caddx_bit(v, CADDX_PS_EXIT2))
+		return "Arming (exit2).";
+	else if (caddx_bit(v, CADDX_PS_ENTRYGUARD) && caddx_bit(v, CADDX_PS_ARMED))
+		return "Armed (in stay mode).";
+	else if (caddx_bit(v, CADDX_PS_ARMED))
+		return "Armed.";
+	return "Not armed.";
+}
+
+static const char *
+zone_status_str(const struct caddx_view *v)
+{
+	if (caddx_bit(v, CADDX_ZS_TAMPERED))
+		return "Tampered.";
+	else if (caddx_bit(v, CADDX_ZS_TROUBLE))
+		return "Trouble.";
+	else if (caddx_bit(v, CADDX_ZS_FAULTED))
+		return "Faulted.";
+	else if (caddx_bit(v, CADDX_ZS_BYPASSED))
+		return "Bypassed.";
+	return "OK.";
+}
+
+/* Print the changes the bridge kept for a zone or partition over the
+ * last secs seconds.
+ */
+static int
+caddx_history(int fd, int kind, int idx, uint32_t secs)
+{
+	struct caddx_history req = { CADDX_HISTORY, kind, idx };
+	struct caddx_view v;
+	uint32_t to = time(NULL), from = (secs < to) ? to - secs : 0;
+	uint16_t id = caddx_new_id(), rx_id = 0;
+	uint8_t buf[128], len;
+	char when[32];
+	time_t t;
+
+	req.from[0] = from >> 24;
+	req.from[1] = from >> 16;
+	req.from[2] = from >> 8;
+	req.from[3] = from;
+	req.to[0] = to >> 24;
+	req.to[1] = to >> 16;
+	req.to[2] = to >> 8;
+	req.to[3] = to;
+	if (caddx_send(fd, id, &req, sizeof(req)) < 0)
+		return -1;
+
+	while (!quit) {
+		len = sizeof(buf);
+		if (caddx_rx_pkt(fd, buf, &len, &rx_id) < 0)
+			return -1;
+		if (!len || (proto >= CADDX_PROTO_V1 && rx_id != id))
+			continue;
+		if (buf[0] == CADDX_HISTORY && len >= sizeof(req)) {
+			if (((struct caddx_history *)buf)->more)
+				printf("(older changes left out)\n");
+			return 0;
+		}
+		if (buf[0] != CADDX_HISTORY_EVENT || caddx_decode(&v, buf, len) < 0)
+			continue;
+
+		t = caddx_be32(buf + 1);
+		strftime(when, sizeof(when), "%F %T", localtime(&t));
+		/* The status in there was checked along with the event */
+		caddx_decode(&v, buf + sizeof(struct caddx_history_event),
+			     len - sizeof(struct caddx_history_event));
+		if (kind == CADDX_HIST_ZONE && caddx_type(&v) == CADDX_ZONE_STATUS)
+			printf("%s zone %d: %s\n", when, caddx_byte(&v, CADDX_ZS_ZONE) + 1,
+			       zone_status_str(&v));
+		else if (kind == CADDX_HIST_PART && caddx_type(&v) == CADDX_PART_STATUS)
+			printf("%s partition %d: %s\n", when, caddx_byte(&v, CADDX_PS_PART) + 1,
+			       part_status_str(&v));
+	}
+	errno = EINTR;
+	return -1;
+}
+
+/* Batch mode: a script of commands is run over a single connection.
+ * Runs of bypass and status commands that touch distinct zones and
+ * partitions are independent, so all their requests are written at once
+ * and the replies are matched back to the commands as they arrive.  A
+ * keypad function ends the run: everything before it has completed by
+ * the time it is sent, so "bypass a dozen zones, then arm" behaves.
+ *
+ * Request IDs encode the command's index in its run and what was asked,
+ * so a tagged reply leads straight back to its command.
+ */
+#define BATCH_TIMEOUT	5
+#define BATCH_MAX	256
+#define BATCH_ID(i, kind)	(1 + ((i) << 1 | (kind)))
+#define BATCH_ID_CMD(id)	(((id) - 1) >> 1)
+#define BATCH_ID_STATUS	0
+#define BATCH_ID_TOGGLE	1
+
+enum {
+	BATCH_QUEUED,
+	BATCH_STATUS,		/* waiting for the initial status */
+	BATCH_TOGGLE,		/* waiting for the status after a toggle */
+	BATCH_DONE,
+};
+
+struct batch_cmd {
+	int line;
+	char op;
+	int arg;
+	int part;
+	int state;
+	int failed;
+	const char *result;
+};
+
+static int
+batch_load(const char *name, struct batch_cmd *cmds, int max, int part)
+{
+	FILE *f = stdin;
+	char line[128], op;
+	int n = 0, lineno = 0, arg, i;
+
+	errno = 0;
+	if (strcmp(name, "-") && !(f = fopen(name, "r")))
+		ERR(errno);
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if ((i = sscanf(line, " %c %d", &op, &arg)) < 1 || op == '#')
+			continue;
+		if (op == 'p' && i == 2 && arg >= 1 && arg <= 8) {
+			part = arg - 1;
+			continue;
+		}
+		if (!strchr("xXbBs", op) || (op != 's' && i != 2) ||
+		    ((op == 'b' || op == 'B') && (arg < 1 || arg > 256))) {
+			err("%s:%d: bad command\n", name, lineno);
+			ERR(EINVAL);
+		}
+		if (n == max)
+			ERR(E2BIG);
+		memset(&cmds[n], 0, sizeof(cmds[n]));
+		cmds[n].line = lineno;
+		cmds[n].op = op;
+		cmds[n].arg = (op == 'b' || op == 'B') ? arg - 1 : arg;
+		cmds[n].part = part;
+		n++;
+	}
+
+	/* FALLTHROUGH */
+ error:
+	if (f != stdin) fclose(f);
+	if (errno)
+		return -1;
+	return n;
+}
+
+static int
+batch_add(uint8_t *out, int olen, uint16_t id, void *msg, uint8_t len)
+{
+	out[olen++] = len;
+	if (proto >= CADDX_PROTO_V1) {
+		out[olen - 1] += CADDX_ID_LEN;
+		out[olen++] = id >> 8;
+		out[olen++] = id & 0xff;
+	}
+	memcpy(out + olen, msg, len);
+	return olen + len;
+}
+
+static int
+batch_add_req(uint8_t *out, int olen, uint16_t id, uint8_t type, uint8_t arg)
+{
+	uint8_t req[2] = { type, arg };
+	return batch_add(out, olen, id, req, sizeof(req));
+}
+
+/* Write everything queued in out, then read replies until no command in
+ * the run is left in state.
+ */
+static int
+batch_collect(int fd, uint8_t *out, int olen, struct batch_cmd *cmds, int n,
+	      struct batch_cmd **zones, struct batch_cmd **parts, int state,
+	      int pending)
+{
+	time_t deadline = time(NULL) + BATCH_TIMEOUT;
+	uint8_t buf[128], len, type;
+	struct caddx_view v;
+	struct batch_cmd *cmd;
+	struct timeval tv;
+	uint16_t id;
+	fd_set fds;
+	int i;
+
+	errno = 0;
+	if (olen && full_write(fd, out, olen, 1) < 0)
+		ERR(errno);
+
+	while (pending && !quit && time(NULL) < deadline) {
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if ((i = select(fd + 1, &fds, NULL, NULL, &tv)) < 0) {
+			if (errno == EINTR)
+				continue;
+			ERR(errno);
+		}
+		if (!i)
+			continue;
+
+		len = sizeof(buf);
+		if (caddx_rx_pkt(fd, buf, &len, &id) < 0)
+			ERR(errno);
+		if (!len)
+			continue;
+		/* Anything that does not check out counts as a failure */
+		type = caddx_decode(&v, buf, len) == 0 ? caddx_type(&v) : 0;
+
+		if (proto >= CADDX_PROTO_V1)
+			cmd = (id && BATCH_ID_CMD(id) < n) ? &cmds[BATCH_ID_CMD(id)] : NULL;
+		else if (type == CADDX_ZONE_STATUS)
+			cmd = zones[caddx_byte(&v, CADDX_ZS_ZONE)];
+		else if (type == CADDX_PART_STATUS)
+			cmd = parts[caddx_byte(&v, CADDX_PS_PART)];
+		else continue;
+		if (!cmd || cmd->state != state)
+			continue;
+
+		if (type == CADDX_ZONE_STATUS) {
+			int bypassed = caddx_bit(&v, CADDX_ZS_BYPASSED);
+			if ((cmd->op == 'b') == bypassed) {
+				cmd->result = (state == BATCH_STATUS) ?
+					(bypassed ? "already bypassed" : "already unbypassed") :
+					(bypassed ? "bypassed" : "unbypassed");
+				cmd->state = BATCH_DONE;
+			} else if (state == BATCH_STATUS) {
+				cmd->state = BATCH_TOGGLE;
+			} else {
+				cmd->result = "could not (un)bypass";
+				cmd->failed = 1;
+				cmd->state = BATCH_DONE;
+			}
+		} else if (type == CADDX_PART_STATUS) {
+			cmd->result = part_status_str(&v);
+			cmd->state = BATCH_DONE;
+		} else if (type == CADDX_ACK) {
+			/* The toggle went through, its status follows */
+			continue;
+		} else {
+			cmd->result = "failed";
+			cmd->failed = 1;
+			cmd->state = BATCH_DONE;
+		}
+		pending--;
+	}
+	if (pending)
+		ERR(ETIMEDOUT);
+
+	/* FALLTHROUGH */
+ error:
+	if (errno)
+		return -1;
+	return 0;
+}
+
+static int
+batch_window(int fd, struct batch_cmd *cmds, int n)
+{
+	struct batch_cmd *zones[256] = { NULL }, *parts[256] = { NULL };
+	uint8_t out[BATCH_MAX * 2 * (1 + CADDX_ID_LEN + 2)];
+	int i, olen = 0, pending = 0, ret;
+
+	for (i = 0; i < n; i++) {
+		struct batch_cmd *cmd = &cmds[i];
+		if (cmd->op == 's') {
+			parts[cmd->part & 0xff] = cmd;
+			olen = batch_add_req(out, olen, BATCH_ID(i, BATCH_ID_STATUS),
+					     CADDX_PART_STATUS_REQ, cmd->part);
+		} else {
+			zones[cmd->arg & 0xff] = cmd;
+			olen = batch_add_req(out, olen, BATCH_ID(i, BATCH_ID_STATUS),
+					     CADDX_ZONE_STATUS_REQ, cmd->arg);
+		}
+		cmd->state = BATCH_STATUS;
+		pending++;
+	}
+	ret = batch_collect(fd, out, olen, cmds, n, zones, parts, BATCH_STATUS, pending);
+
+	for (i = olen = pending = 0; !ret && i < n; i++) {
+		struct caddx_bypass_toggle toggle = {{ 0 }};
+		if (cmds[i].state != BATCH_TOGGLE)
+			continue;
+		toggle.msg.type = CADDX_BYPASS_TOGGLE;
+		toggle.zone = cmds[i].arg;
+		olen = batch_add(out, olen, BATCH_ID(i, BATCH_ID_TOGGLE),
+				 &toggle, sizeof(toggle));
+		olen = batch_add_req(out, olen, BATCH_ID(i, BATCH_ID_STATUS),
+				     CADDX_ZONE_STATUS_REQ, cmds[i].arg);
+		pending++;
+	}
+	if (!ret && pending)
+		ret = batch_collect(fd, out, olen, cmds, n, zones, parts, BATCH_TOGGLE, pending);
+
+	for (i = 0; i < n; i++) {
+		if (cmds[i].state == BATCH_DONE)
+			continue;
+		cmds[i].result = strerror(errno ? errno : EIO);
+		cmds[i].failed = 1;
+		cmds[i].state = BATCH_DONE;
+	}
+	return ret;
+}
+
+/* Send a keypad function and wait for the panel to take it or not */
+static int
+batch_keypad(int fd, struct batch_cmd *cmd, int pin)
+{
+	time_t deadline = time(NULL) + BATCH_TIMEOUT;
+	uint8_t buf[128], len, type;
+	struct timeval tv;
+	uint16_t id;
+	fd_set fds;
+	int i;
+
+	errno = 0;
+	if ((cmd->op == 'x' ? caddx_pri_fn(fd, cmd->arg, cmd->part, pin) :
+	     caddx_sec_fn(fd, cmd->arg, cmd->part)) < 0)
+		ERR(errno);
+
+	while (!quit && time(NULL) < deadline) {
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if ((i = select(fd + 1, &fds, NULL, NULL, &tv)) < 0) {
+			if (errno == EINTR)
+				continue;
+			ERR(errno);
+		}
+		if (!i)
+			continue;
+
+		len = sizeof(buf);
+		if (caddx_rx_pkt(fd, buf, &len, &id) < 0)
+			ERR(errno);
+		if (!len)
+			continue;
+		/* Untagged, the first answer of the right kind has to do */
+		type = buf[0] & CADDX_MSG_MASK;
+		if (proto >= CADDX_PROTO_V1 ? id != last_id :
+		    (type != CADDX_ACK && type != CADDX_FAILED &&
+		     type != CADDX_NAK && type != CADDX_REJECTED))
+			continue;
+
+		cmd->result = type == CADDX_ACK ? "acknowledged" :
+			type == CADDX_NAK ? "not acknowledged" :
+			type == CADDX_REJECTED ? "rejected" : "failed";
+		cmd->failed = type != CADDX_ACK;
+		return 0;
+	}
+	ERR(quit ? EINTR : ETIMEDOUT);
+
+ error:
+	return -1;
+}
+
+static int
+batch_run(int fd, struct batch_cmd *cmds, int n, int pin)
+{
+	int i, j, start = 0, failed = 0;
+
+	for (i = 0; i <= n; i++) {
+		struct batch_cmd *cmd = &cmds[i];
+		int barrier = (i == n || cmd->op == 'x' || cmd->op == 'X');
+
+		/* Two commands on the same zone or partition depend on each
+		 * other, so the second one starts a new run.
+		 */
+		for (j = start; !barrier && j < i; j++)
+			if ((cmd->op == 's') == (cmds[j].op == 's') &&
+			    (cmd->op == 's' ? cmd->part == cmds[j].part : cmd->arg == cmds[j].arg))
+				barrier = 1;
+		if (!barrier)
+			continue;
+
+		if (i > start)
+			batch_window(fd, cmds + start, i - start);
+		start = i;
+		if (i == n || (cmd->op != 'x' && cmd->op != 'X'))
+			continue;
+
+		if (batch_keypad(fd, cmd, pin) < 0) {
+			cmd->result = strerror(errno);
+			cmd->failed = 1;
+		}
+		cmd->state = BATCH_DONE;
+		start = i + 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		int arg = cmds[i].arg;
+		if (cmds[i].op == 's')
+			arg = cmds[i].part + 1;
+		else if (cmds[i].op == 'b' || cmds[i].op == 'B')
+			arg++;
+		printf("%d: %c %d: %s\n", cmds[i].line, cmds[i].op, arg, cmds[i].result);
+		failed += cmds[i].failed;
+	}
+	if (failed) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/* Statistics, served over HTTP at -w HOST:PORT and logged on SIGUSR1 */
+static const struct stat_def stats_defs[] = {
+	{ "caddxmon_frames_total", STAT_COUNTER, &st.frames, "Frames received from the bridge" },
+	{ "caddxmon_mcast_total", STAT_COUNTER, &st.mcast, "Datagrams received by multicast" },
+	{ "caddxmon_mcast_lost_total", STAT_COUNTER, &st.mcast_lost, "Datagrams that went missing" },
+	{ "caddxmon_snapshots_total", STAT_COUNTER, &st.snapshots, "Snapshots asked for to resync" },
+	{ "caddxmon_events_total", STAT_COUNTER, &st.events, "Zone and partition events" },
+	{ "caddxmon_rules_total", STAT_COUNTER, &st.rules, "Rule actions run" },
+	{ "caddxmon_commands_total", STAT_COUNTER, &st.commands, "Commands sent to the panel" },
+	{ "caddxmon_log_dropped_total", STAT_COUNTER, &log_dropped, "Log messages dropped on a full ring" },
+	{ "caddxmon_polls_total", STAT_COUNTER, &st.polls, "Partition status polls" },
+	{ "caddxmon_poll_changes_total", STAT_COUNTER, &st.poll_changes, "Polls that found an unannounced change" },
+	{ "caddxmon_poll_interval_seconds", STAT_GAUGE, &st.poll_ival, "Current partition poll interval" },
+	{ "caddxmon_poll_ms", STAT_HIST, &st.poll_ms, "Time a partition poll took to be answered" },
+	{ "caddxmon_parse_us", STAT_HIST, &st.parse, "Handling a frame, events and actions included" },
+	{ "caddxmon_notify_us", STAT_HIST, &st.notify, "Starting the -e program for an event" },
+	{ "caddxmon_rule_us", STAT_HIST, &st.rule, "Running a rule action" },
+};
+
+static void
+stats_update(void)
+{
+	st.poll_ival = poll_ival;
+}
+
+/* Answer a scraper once it has sent its request */
+static void
+stats_answer(int *cfd)
+{
+	uint8_t req[512];
+
+	if (read(*cfd, req, sizeof(req)) > 0) {
+		stats_update();
+		stats_serve(*cfd, stats_defs, ARRAY_SIZE(stats_defs));
+	}
+	close(*cfd);
+	*cfd = -1;
+}
+
 int
 main(int argc, char *argv[])
 {
-	int i, fd = -1, poll_part = 0, pri_fn = -1, sec_fn = -1, pin = -1;
-	int do_status = 0;
+	int i, fd = -1, pri_fn = -1, sec_fn = -1, pin = -1;
+	int do_status = 0, hist_kind = -1, hist_idx = 0;
+	uint32_t hist_secs = 3600;
+	char *end;
 	struct timeval tv;
 	int bypass = -1, no_bypass = -1;
-	char *host = strdup(DEFAULT_HOST), *port;
-	int part_status_count = 1, part_status_freq = 30;
+	char *host = strdup(DEFAULT_HOST), *port, *script = NULL, *rules = NULL;
+	char *mcast_group = NULL, *mcast_if = NULL, *stats_addr = NULL;
+	int stats_sfd = -1, stats_cfd = -1, max_fd;
 	uint8_t buf[128], len;
+	uint16_t id;
 	struct addrinfo gai = { 0 }, *ai, *pai;
 	struct sigaction action;
 
-	while ((i = getopt(argc, argv, "B:b:e:fH:P:svX:x:")) != -1) {
+	while ((i = getopt(argc, argv, "B:b:e:fH:M:m:n:P:p:R:S:svw:X:x:y:")) != -1) {
 		switch (i) {
 		case 'b': bypass = strtol(optarg, NULL, 0) - 1; fg = 1; break;
 		case 'B': no_bypass = strtol(optarg, NULL, 0) - 1; fg = 1; break;
 		case 'e': notify_proc = optarg; break;
 		case 'f': fg = 1; break;
 		case 'H': free(host); host = strdup(optarg); break;
+		case 'M': mcast_if = optarg; break;
+		case 'm': mcast_group = optarg; break;
+		case 'n': panel = strtol(optarg, NULL, 0) - 1; break;
 		case 'P': pin = strtol(optarg, NULL, 10); break;
 		case 'p': poll_part = strtol(optarg, NULL, 0) - 1; break;
+		case 'R': rules = optarg; break;
+		case 'S': script = optarg; fg = 1; break;
 		case 's': do_status = 1; fg = 1; break;
 		case 'v': loglevel++; break;
+		case 'w': stats_addr = optarg; break;
 		case 'X': sec_fn = strtol(optarg, NULL, 0); fg = 1; break;
 		case 'x': pri_fn = strtol(optarg, NULL, 0); fg = 1; break;
+		case 'y':
+			if (optarg[0] != 'z' && optarg[0] != 'p') {
+				usage();
+				return -1;
+			}
+			hist_kind = (optarg[0] == 'z') ? CADDX_HIST_ZONE : CADDX_HIST_PART;
+			hist_idx = strtol(optarg + 1, &end, 0) - 1;
+			if (*end == ':')
+				hist_secs = strtoul(end + 1, NULL, 0);
+			fg = 1;
+			break;
 		default: usage(); return -1;
 		}
 	}
@@ -247,10 +1382,15 @@ main(int argc, char *argv[])
 		ERR(EINVAL);
 	*(port++) = 0;
 
+	rule_pin = pin;
+	if (rules && rules_load(rules, poll_part) < 0)
+		ERR(errno);
+
 	memset(&action, 0, sizeof(action));
 	action.sa_handler = caddx_signal;
 	sigaction(SIGINT, &action, NULL);
 	sigaction(SIGCHLD, &action, NULL);
+	sigaction(SIGUSR1, &action, NULL);
 
 	gai.ai_family = AF_UNSPEC;
 	gai.ai_socktype = SOCK_STREAM;
@@ -290,146 +1430,177 @@ main(int argc, char *argv[])
 	tv.tv_usec = 0;
 	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-	if (pri_fn >= 0) {
-		if (pin >= 0) {
-			struct caddx_keypad_func0 func = {{ 0 }};
-			func.msg.type = CADDX_KEYPAD_FUNC0;
-			func.msg.ack = 1;
-			if (pin > 9999) {
-				func.pin1 = (pin / 100000) % 10;
-				func.pin2 = (pin /  10000) % 10;
-				func.pin3 = (pin /   1000) % 10;
-				func.pin4 = (pin /    100) % 10;
-				func.pin5 = (pin /     10) % 10;
-				func.pin6 = (pin /      1) % 10;
-			} else {
-				func.pin1 = (pin / 1000) % 10;
-				func.pin2 = (pin /  100) % 10;
-				func.pin3 = (pin /   10) % 10;
-				func.pin4 = (pin /    1) % 10;
-			}
-			func.function = pri_fn;
-			func.part = (1 << poll_part);
-			buf[0] = sizeof(func);
-			if (full_write(fd, buf, 1, 1) < 0)
-				ERR(errno);
-			if (full_write(fd, (uint8_t *)&func, sizeof(func), 1) < 0)
-				ERR(errno);
-			goto error;
-		} else {
-			struct caddx_keypad_func0_nopin func = {{ 0 }};
-			func.msg.type = CADDX_KEYPAD_FUNC0_NOPIN;
-			func.msg.ack = 1;
-			func.function = pri_fn;
-			func.part = (1 << poll_part);
-			buf[0] = sizeof(func);
-			if (full_write(fd, buf, 1, 1) < 0)
-				ERR(errno);
-			if (full_write(fd, (uint8_t *)&func, sizeof(func), 1) < 0)
-				ERR(errno);
-			goto error;
+	/* One-shot commands and batches stay with the legacy protocol unless
+	 * -n picks a panel: the hello costs them a round trip, and two
+	 * seconds and a rejected frame at the panel with an older bridge.
+	 */
+	if ((panel >= 0 || !(script || hist_kind >= 0 || pri_fn >= 0 || sec_fn >= 0 ||
+			     bypass >= 0 || no_bypass >= 0 || do_status)) &&
+	    caddx_hello(fd) < 0)
+		ERR(errno);
+
+	if (script) {
+		struct batch_cmd *cmds = calloc(BATCH_MAX, sizeof(*cmds));
+		if (!cmds)
+			ERR(ENOMEM);
+		if ((i = batch_load(script, cmds, BATCH_MAX, poll_part)) < 0 ||
+		    batch_run(fd, cmds, i, pin) < 0) {
+			free(cmds);
+			ERR(errno);
 		}
-	} else if (sec_fn >= 0) {
-		struct caddx_keypad_func1 func = {{ 0 }};
-		func.msg.type = CADDX_KEYPAD_FUNC1;
-		func.msg.ack = 1;
-		func.function = sec_fn;
-		func.part = (1 << poll_part);
-		buf[0] = sizeof(func);
-		if (full_write(fd, buf, 1, 1) < 0)
+		free(cmds);
+		goto error;
+	} else if (hist_kind >= 0) {
+		if (caddx_history(fd, hist_kind, hist_idx, hist_secs) < 0)
+			ERR(errno);
+		goto error;
+	} else if (pri_fn >= 0) {
+		if (caddx_pri_fn(fd, pri_fn, poll_part, pin) < 0)
 			ERR(errno);
-		if (full_write(fd, (uint8_t *)&func, sizeof(func), 1) < 0)
+		goto error;
+	} else if (sec_fn >= 0) {
+		if (caddx_sec_fn(fd, sec_fn, poll_part) < 0)
 			ERR(errno);
 		goto error;
 	} else if (bypass >= 0 || no_bypass >= 0) {
-		struct caddx_zone_status *status = (struct caddx_zone_status *)buf;
-		struct caddx_bypass_toggle *toggle = (struct caddx_bypass_toggle *)&buf[1];
+		struct caddx_bypass_toggle toggle = {{ 0 }};
 		uint8_t zone = (bypass >= 0) ? bypass : no_bypass;
+		struct caddx_view v;
 		len = sizeof(buf);
-		if (caddx_zone_status(fd, zone, buf, &len) < 0)
+		if (caddx_zone_status(fd, zone, buf, &len) < 0 ||
+		    caddx_decode(&v, buf, len) < 0)
 			ERR(errno);
-		if ((bypass >= 0 && status->bypassed) ||
-		    (no_bypass >= 0 && !status->bypassed))
+		if ((bypass >= 0) == caddx_bit(&v, CADDX_ZS_BYPASSED))
 			goto error;
 
-		buf[0] = sizeof(*toggle);
-		memset(toggle, 0, sizeof(*toggle));
-		toggle->msg.type = CADDX_BYPASS_TOGGLE;
-		toggle->zone = zone;
-		if (full_write(fd, buf, 1 + sizeof(*toggle), 1) < 0)
+		toggle.msg.type = CADDX_BYPASS_TOGGLE;
+		toggle.zone = zone;
+		if (caddx_send(fd, caddx_new_id(), &toggle, sizeof(toggle)) < 0)
 			ERR(errno);
 
 		len = sizeof(buf);
-		if (caddx_zone_status(fd, zone, buf, &len) < 0)
+		if (caddx_zone_status(fd, zone, buf, &len) < 0 ||
+		    caddx_decode(&v, buf, len) < 0)
 			ERR(errno);
-		if ((bypass >= 0 && status->bypassed) ||
-		    (no_bypass >= 0 && !status->bypassed))
+		if ((bypass >= 0) == caddx_bit(&v, CADDX_ZS_BYPASSED))
 			goto error;
 
 		printf("could not (un)bypass\n");
 		ERR(EIO);
 	} else if (do_status) {
-		struct caddx_part_status *status = (struct caddx_part_status *)buf;
-		struct caddx_part_status_req *req = (struct caddx_part_status_req *)&buf[1];
-
-		buf[0] = sizeof(*req);
-		memset(req, 0, sizeof(*req));
-		req->msg.type = CADDX_PART_STATUS_REQ;
-		req->part = poll_part;
-		if (full_write(fd, buf, 1 + sizeof(*req), 1) < 0)
+		struct caddx_part_status_req req = {{ 0 }};
+		struct caddx_view v;
+		uint16_t id = caddx_new_id();
+
+		req.msg.type = CADDX_PART_STATUS_REQ;
+		req.part = poll_part;
+		if (caddx_send(fd, id, &req, sizeof(req)) < 0)
 			ERR(errno);
 
 		len = sizeof(buf);
-		if (caddx_rx_pkt_type(fd, buf, &len, CADDX_PART_STATUS) < 0)
+		if (caddx_rx_reply(fd, buf, &len, id, CADDX_PART_STATUS) < 0 ||
+		    caddx_decode(&v, buf, len) < 0)
 			ERR(errno);
 
-		if (status->exit1) {
-			printf("Arming (exit1).\n");
-		} else if (status->exit2) {
-			printf("Arming (exit2).\n");
-		} else if (status->entryguard && status->armed)
-			printf("Armed (in stay mode).\n");
-		else if (status->armed)
-			printf("Armed.\n");
-		else printf ("Not armed.\n");
+		printf("%s\n", part_status_str(&v));
 
 		goto error;
 	}
 
+	if (stats_addr && (stats_sfd = listen_open(stats_addr)) < 0)
+		ERR(errno);
+
+	/* Only now: what the one-shot commands print must not overtake it */
+	if (log_start() < 0)
+		ERR(errno);
+
+	if (mcast_group) {
+		struct caddx_subscribe sub = { CADDX_SUBSCRIBE, 0, panel };
+
+		if (mcast_open(mcast_group, mcast_if) < 0)
+			ERR(errno);
+		/* Events come by multicast, TCP only carries our replies */
+		if (proto >= CADDX_PROTO_V1 &&
+		    caddx_send(fd, caddx_new_id(), &sub, sizeof(sub) - (panel < 0)) < 0)
+			ERR(errno);
+		if (mcast_snapshot(fd) < 0)
+			ERR(errno);
+	}
+
 	while (!quit) {
 		fd_set fds;
 		struct timeval tv;
 		FD_ZERO(&fds);
 		FD_SET(fd, &fds);
+		if (mcast_fd >= 0)
+			FD_SET(mcast_fd, &fds);
+		if (stats_sfd >= 0)
+			FD_SET(stats_sfd, &fds);
+		if (stats_cfd >= 0)
+			FD_SET(stats_cfd, &fds);
+		max_fd = fd > mcast_fd ? fd : mcast_fd;
+		max_fd = max_fd > stats_sfd ? max_fd : stats_sfd;
+		max_fd = max_fd > stats_cfd ? max_fd : stats_cfd;
+
+		if (stats_dump) {
+			stats_dump = 0;
+			stats_update();
+			stats_log(stats_defs, ARRAY_SIZE(stats_defs));
+		}
 
 		tv.tv_sec = 1;
 		tv.tv_usec = 0;
-		if ((i = select(fd + 1, &fds, NULL, NULL, &tv)) < 0) {
+		if ((i = select(max_fd + 1, &fds, NULL, NULL, &tv)) < 0) {
 			if (errno == EINTR)
 				continue;
 			ERR(errno);
 		}
 
-		if (i == 0) {
-			if (!--part_status_count) {
-				buf[0] = 2;
-				buf[1] = CADDX_PART_STATUS_REQ,
-				buf[2] = poll_part;
-				full_write(fd, buf, 3, 1);
-				part_status_count = part_status_freq;
-			}
+		poll_tick(fd);
+		if (i == 0)
 			continue;
+
+		if (mcast_fd >= 0 && FD_ISSET(mcast_fd, &fds) && mcast_rx(fd) < 0)
+			ERR(errno);
+		if (stats_cfd >= 0 && FD_ISSET(stats_cfd, &fds))
+			stats_answer(&stats_cfd);
+		/* A new scrape replaces one that never sent its request */
+		if (stats_sfd >= 0 && FD_ISSET(stats_sfd, &fds) &&
+		    (i = accept4(stats_sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+			if (stats_cfd >= 0)
+				close(stats_cfd);
+			stats_cfd = i;
 		}
+		if (!FD_ISSET(fd, &fds))
+			continue;
 
 		len = sizeof(buf);
-		if (caddx_rx_pkt(fd, buf, &len) < 0)
+		if (caddx_rx_pkt(fd, buf, &len, &id) < 0)
 			ERR(errno);
-		caddx_parse(fd, buf, len);
+		st.frames++;
+		if (len && buf[0] == CADDX_SNAPSHOT) {
+			mcast_snapshot_end(buf, len);
+			continue;
+		}
+		/* Multicast brings every panel frame, replies to our requests
+		 * too; over TCP only the snapshot is news.
+		 */
+		if (mcast_fd >= 0 && (proto < CADDX_PROTO_V1 || id != mcast_snap_id)) {
+			poll_reply(buf, len, id);
+			continue;
+		}
+		if (!poll_reply(buf, len, id))
+			poll_seen(buf, len);
+		caddx_parse_timed(fd, buf, len);
 	}
 
  error:
 	if (host) free(host);
 	if (fd >= 0) close(fd);
+	if (mcast_fd >= 0) close(mcast_fd);
+	if (stats_sfd >= 0) close(stats_sfd);
+	if (stats_cfd >= 0) close(stats_cfd);
+	log_stop();
 	if (errno && errline) {
 		err("%s: error: %s @%d\n", __func__, strerror(errno), errline);
 		errno = errline = 0;
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -9,10 +10,15 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/select.h>
 #include <signal.h>
+#include <time.h>
+#include <limits.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "caddx.h"
@@ -24,435 +30,3404 @@
 #define DEFAULT_TTYNAME	"/dev/ttyUSB0"
 #define DEFAULT_BAUD	38400
 #define DEFAULT_LISTEN	"127.0.0.1:1587"
+#define DEFAULT_MAX_CLIENTS	32
+#define DEFAULT_HIST_KB		256
 
 int errline = 0;
 
+/* A message for clients.  It is stored once and every client queue it
+ * is on holds a reference; only the per-client header is kept apart.
+ */
+struct caddx_frame {
+	uint32_t refs;
+	uint64_t at;		/* mono_us() when it was made */
+	uint8_t len;
+	uint8_t msg[];
+};
+
+struct caddx_qent {
+	struct caddx_frame *f;
+	uint8_t hdr[1 + CADDX_ID_LEN];
+	uint8_t hlen;
+};
+
+/* Room for a full state snapshot, while the two iovecs per entry that
+ * clients_flush() needs still fit in IOV_MAX (1024 on Linux).
+ */
+#define CADDX_CLIENT_QLEN	512
+
+/* iovecs for all client writes of one round */
+#define CADDX_FLUSH_IOV		4096
+
+/* Outbound panel messages.  The panel handles one request at a time, so
+ * frames wait here until the one in flight has been answered or has
+ * timed out.  Knowing what is in flight is also what tells us which
+ * client a reply belongs to.
+ *
+ * Commands (keypad functions, bypasses) wait in a queue of their own
+ * that goes ahead of status requests, which go ahead of what the bridge
+ * fetches in the background, so an arm or panic is never stuck behind a
+ * round of polls.  A frame that has waited TX_AGE goes ahead of fresher
+ * classes so none starves.  Waiting commands it only passes right after
+ * one was sent, so at most one aged frame goes per command.
+ *
+ * Within a class, each client and the bridge itself have a queue of
+ * their own, served by deficit round robin on the bytes they put on the
+ * line, so a client that floods the panel with requests only slows down
+ * itself.  Clients can further be limited to a rate (-r); frames over it
+ * wait, and past TX_CLIENT_MAX queued ones new frames are refused.
+ */
+#define CADDX_REPLY_TIMEOUT	2000	/* ms */
+#define TX_AGE			5000	/* ms */
+#define TX_QUANTUM		16	/* bytes per round robin turn */
+#define TX_OVERHEAD		4	/* start, length and checksum */
+#define TX_CLIENT_MAX		64
+#define TX_MAX_LIMITS		8
+
+enum {
+	TX_PRIO_CMD,
+	TX_PRIO_REQ,
+	TX_PRIO_BG,
+	TX_PRIO_N
+};
+
+struct caddx_txreq {
+	struct caddx_txreq *next;
+	struct caddx_client *cl;
+	uint64_t queued;	/* mono_ms() */
+	uint16_t id;
+	uint8_t prio;
+	uint8_t limited;	/* counted in the source's limited already */
+	uint8_t len;
+	uint8_t msg[255];
+};
+
+struct tx_limit {
+	struct sockaddr_storage addr;	/* AF_UNSPEC: any host */
+	uint32_t rate;			/* frames per second */
+	uint32_t burst;			/* frames */
+};
+
+struct caddx_txsrc {
+	struct caddx_txreq *q[TX_PRIO_N], **tail[TX_PRIO_N];
+	uint32_t deficit[TX_PRIO_N];
+	uint32_t queued;		/* frames in q */
+	const struct tx_limit *lim;	/* NULL: no limit */
+	uint32_t tokens;		/* thousandths of a frame */
+	uint64_t refill;		/* mono_ms() of the last refill */
+	uint32_t limited;		/* frames held back or refused */
+};
+
+/* Clients live in a table allocated once at startup.  A slot keeps its
+ * address while the client is connected, fd < 0 marks a free one and
+ * free slots are chained through next, so connects and disconnects cost
+ * neither a list walk nor a malloc().
+ */
+#define CADDX_MAX_CLIENTS	120	/* a read and a write op each, see IO_MAX_OPS */
+#define PROTO_STREAM		-1	/* a client of -e, see stream_publish() */
+
 struct caddx_client {
 	int fd;
-	struct sockaddr addr;
+	int proto;
+	uint8_t subs;
+	struct sockaddr_storage addr;
 	socklen_t addr_len;
-	struct caddx_client *next;
+	uint8_t rbuf[1 + 255];
+	uint32_t rlen;
+	struct caddx_qent q[CADDX_CLIENT_QLEN];
+	uint32_t qhead, qlen, qoff;
+	int wwait;		/* socket is full, waiting for IO_EV_WRITABLE */
+	uint32_t hello;		/* stream: status the first dump is at plus one */
+	struct caddx_txsrc src;
+	struct caddx_panel *panel;	/* the one it talks to */
+	struct caddx_client *next;	/* free list */
 };
 
 static int baud = DEFAULT_BAUD;
-static int synced = 0, sync_count = 1, sync_freq = 10;
+static int sync_freq = 10;
 static int fg = 0;
-static struct caddx_client *clients = NULL;
+static struct caddx_client *client_tab = NULL, *client_free = NULL;
+static uint32_t client_hi = 0, nclients = 0;
+static uint32_t max_clients = DEFAULT_MAX_CLIENTS, max_per_host = 0;
+static struct tx_limit tx_limits[TX_MAX_LIMITS];
+static uint32_t tx_nlimits = 0;
+
+/* Panel link, see link_open().  Frames for the panel collect in
+ * link_out and go out with one write per round.
+ */
+enum {
+	LINK_TTY,
+	LINK_PTY,		/* pty:[PATH], for testing against a simulator */
+	LINK_TCP,		/* tcp://HOST:PORT, a raw TCP serial server */
+};
+
+#define LINK_OUT_LEN		1024
+#define LINK_RETRY_MIN		1000	/* ms */
+#define LINK_RETRY_MAX		30000
+#define LINK_STALL_WAIT		10	/* ms, with link_out too full for a request */
+
+/* Statistics, see stats_defs */
+static struct {
+	uint64_t rx_bytes, rx_frames, rx_cksum, rx_cut, rx_malformed, rx_overrun, rx_naks;
+	uint64_t tx_frames, tx_bytes, tx_escapes, tx_acks, tx_naks;
+	uint64_t tx_timeouts, tx_limited, syncs;
+	uint64_t link_drops, link_stalls;
+	uint64_t client_connects, client_refused, client_drops, client_stalls;
+	uint64_t nobufs, stream_lines;
+	uint64_t clients, queued, stale, link;	/* gauges, set by stats_update() */
+	struct stat_hist reply_ms, client_qlen;
+	/* Where a frame's time goes, in us */
+	struct stat_hist rx_wait, rx_parse, deliver, client, link_wait;
+} st;
+static int stats_dump = 0;
+
+/* Warm restart (-s).  What was seen is saved to a file now and then and
+ * on exit.  At startup it is loaded and served as stale until the panel
+ * confirms each status; they are asked for one by one while the panel
+ * link is idle.  zone_stale etc. mark what has not been confirmed yet.
+ */
+#define STATE_MAGIC	"CXST"
+#define STATE_VERSION	1
+#define STATE_FREQ	60		/* s between saves */
+#define STATE_SEQ_SKIP	0x10000		/* see state_load() */
+#define STATE_KEYS	(256 + 256 + 1)	/* zones, partitions, system */
+
+struct caddx_state_hdr {
+	uint8_t magic[4];
+	uint8_t version;
+	uint8_t reserved[3];
+	uint8_t saved[4];	/* Unix seconds, big endian */
+	uint8_t mcast_seq[4];	/* big endian */
+} __packed;
+
+/* Status changes, oldest first.  They are appended in time order, so a
+ * time bound is a binary search away, and the changes of each zone and
+ * partition are chained through prev.  Records are numbered by seq, the
+ * slot is seq % hist_len and prev/skip/hist_last hold seq + 1, 0 for
+ * none.
+ *
+ * The n-th change of a zone or partition (its height) also points back
+ * to the one at hist_skip_height(n), as in a skip list, so the change
+ * of a key just before a given seq is O(log n) hops away rather than a
+ * walk over all that came after.
+ */
+#define HIST_KEYS	(256 + 256)	/* zones, then partitions */
+
+struct caddx_hist {
+	uint32_t time;
+	uint32_t prev;
+	uint32_t skip;
+	uint32_t height;
+	uint8_t len;
+	uint8_t msg[CADDX_PART_STATUS_LEN];
+};
+
+/* Panel event log download (-L).  Entries are fetched one at a time
+ * while the panel has nothing else to do and are appended to a file of
+ * fixed-size records, so record n sits at LOG_OFF(n).  The panel's log
+ * is a ring; the header remembers the slot the next new entry lands in.
+ * A slot that still holds what was stored for it last time around means
+ * there is nothing new.
+ */
+#define LOG_MAGIC	"CXLG"
+#define LOG_VERSION	1
+#define LOG_FREQ	300	/* s between checks for new entries */
+#define LOG_RETRY	30	/* s after an unanswered request */
+#define LOG_ENTRY_LEN	(CADDX_LOG_EVENT_LEN - 1)
+#define LOG_OFF(n)	(sizeof(struct caddx_logfile_hdr) + (off_t)(n) * sizeof(struct caddx_logrec))
+
+struct caddx_logfile_hdr {
+	uint8_t magic[4];
+	uint8_t version;
+	uint8_t log_size;	/* slots in the panel's log, 0 until known */
+	uint8_t next;		/* slot to fetch next */
+	uint8_t reserved;
+} __packed;
+
+struct caddx_logrec {
+	uint8_t time[4];	/* when it was fetched, Unix seconds, big endian */
+	uint8_t entry[LOG_ENTRY_LEN];	/* caddx_log_event without the type */
+	uint8_t reserved[3];
+} __packed;
+
+/* Zone names (-N).  They are fetched from the panel once, while it has
+ * nothing else to do, and kept in a file together with the panel's
+ * interface configuration (firmware version and capabilities).  Zone
+ * name requests are answered from here; the names are fetched again
+ * only if a client asks for it or the configuration changes.
+ */
+#define NAMES_MAGIC	"CXZN"
+#define NAMES_VERSION	1
+#define NAMES_IDENT_LEN	10
+#define NAMES_LEN	CADDX_ZN_NAME_LEN
+
+struct caddx_names_hdr {
+	uint8_t magic[4];
+	uint8_t version;
+	uint8_t ident[NAMES_IDENT_LEN];
+	uint8_t count[2];	/* names that follow, big endian */
+} __packed;
+
+#define MCAST_TTL	1
+
+static int mcast_fd = -1;
+static struct sockaddr_in mcast_addr;
+
+/* A panel the bridge talks to, one per -t.  Each has a link, sync,
+ * request queues and state of its own.  The code below works on the
+ * panel pn points at; the main loop points it at each in turn, client
+ * handling at the client's.
+ */
+#define CADDX_MAX_PANELS	16	/* their links go with the fds on upgrade */
+
+struct caddx_panel {
+	int fd;			/* the link, -1 while there is none */
+
+	int synced;
+	uint64_t sync_next;
+
+	struct caddx_txsrc tx_bridge;
+	struct caddx_txreq *tx_inflight;
+	uint64_t tx_deadline, tx_wake;
+	uint32_t tx_queued, tx_rr[TX_PRIO_N];
+	int tx_fresh[TX_PRIO_N], tx_aged_ok;
+
+	char *link_uri;
+	int link_kind, link_up, link_slave;
+	uint8_t link_out[LINK_OUT_LEN];
+	uint32_t link_outlen, link_backoff;
+	uint64_t link_retry, link_out_at;
+	struct termios tio_old;
+
+	/* Raw bytes from the tty, still stuffed, that do not make a frame
+	 * yet.  Holds the largest frame we accept stuffed, plus one read on
+	 * top.
+	 */
+	uint8_t rx_raw[1 + 2 * 128 + IO_BUF_LEN];
+	/* When the bytes in rx_raw came in: the first of them, the last
+	 * read and the first of the frame just cut out.
+	 */
+	uint64_t rx_at, rx_now, rx_frame_at;
+	uint32_t rx_rawlen;
+	/* Type and first byte of the bridge's own request the frame being
+	 * parsed answers, type 0 if it answers none.
+	 */
+	uint8_t rx_own[2];
+
+	/* Last zone and partition status seen from the panel, [0] is the
+	 * length or 0 if nothing has been seen yet.
+	 */
+	uint8_t zone_seen[256][1 + CADDX_ZONE_STATUS_LEN];
+	uint8_t part_seen[256][1 + CADDX_PART_STATUS_LEN];
+	uint8_t sys_seen[1 + CADDX_SYSTEM_STATUS_LEN];
+
+	char *state_path;
+	uint8_t zone_stale[256], part_stale[256], sys_stale;
+	uint32_t state_stale, state_next;
+	int state_dirty, state_pending;
+	uint64_t state_due, state_deadline;
+
+	struct caddx_hist *hist;
+	uint32_t hist_len, hist_seq;
+	uint32_t hist_last[HIST_KEYS];
+
+	char *log_path;
+	int log_fd;
+	struct caddx_logfile_hdr log_hdr;
+	uint32_t log_count, log_left;
+	uint8_t log_slot[256][LOG_ENTRY_LEN], log_known[256];
+	int log_busy, log_pending, log_first;
+	uint64_t log_due, log_deadline;
+
+	char *names_path;
+	uint8_t names_ident[NAMES_IDENT_LEN];
+	char zone_names[256][NAMES_LEN];
+	uint32_t names_count, names_next;
+	int names_valid, names_busy, names_pending;
+	uint64_t names_deadline;
+
+	uint32_t mcast_seq;
+};
+
+static struct caddx_panel *panels = NULL, *pn = NULL;
+static uint32_t npanels = 0;
+
+/* Queue a frame for the panel, link_flush() writes it out */
+static int
+caddx_tx(uint8_t *msg, uint32_t len)
+{
+	int n;
+
+	warn("%s: %d\n", __func__, len);
+#ifdef HEXDUMP
+	if (loglevel >= 2)
+		hexdump(msg, len);
+#endif
+
+	errno = 0;
+	if (!pn->link_up)
+		ERR(ENOTCONN);
+	if ((n = caddx_frame(pn->link_out + pn->link_outlen, sizeof(pn->link_out) - pn->link_outlen, msg, len)) < 0)
+		ERR(errno);
+	if (!pn->link_outlen)
+		pn->link_out_at = mono_us();
+
+#if 0
+	printf("^^ tx:\n");
+	hexdump(pn->link_out + pn->link_outlen, n);
+#endif
+	pn->link_outlen += n;
+	st.tx_frames++;
+	st.tx_bytes += n;
+	/* Start, length, message and checksum, the rest is escapes */
+	st.tx_escapes += n - (1 + 1 + len + 2);
+
+	/* FALLTHROUGH */
+ error:
+	if (errno)
+		return -1;
+	return 0;
+}
+
+/* Frames and requests come from malloc(), or with CONFIG_STATIC_MEM
+ * from pools made at startup: -F frames, and TX_CLIENT_MAX requests per
+ * client plus TX_BRIDGE_MAX per panel.  Past that they are dropped, so
+ * memory stays where it was at startup.
+ */
+#ifdef CONFIG_STATIC_MEM
+#define DEFAULT_MAX_FRAMES	1024
+#define TX_BRIDGE_MAX		16
+
+static struct pool frame_pool, txreq_pool;
+static uint32_t max_frames = DEFAULT_MAX_FRAMES;
+
+#define FRAME_ALLOC(len)	pool_get(&frame_pool)
+#define FRAME_FREE(f)		pool_put(&frame_pool, f)
+#define TXREQ_ALLOC()		pool_get(&txreq_pool)
+#define TXREQ_FREE(req)		pool_put(&txreq_pool, req)
+#else
+#define FRAME_ALLOC(len)	malloc(sizeof(struct caddx_frame) + (len))
+#define FRAME_FREE(f)		free(f)
+#define TXREQ_ALLOC()		malloc(sizeof(struct caddx_txreq))
+#define TXREQ_FREE(req)		free(req)
+#endif
+
+static struct caddx_frame *
+frame_new(uint8_t *msg, uint8_t len)
+{
+	struct caddx_frame *f;
+
+	if (!(f = FRAME_ALLOC(len))) {
+		st.nobufs++;
+		errno = ENOBUFS;
+		return NULL;
+	}
+	f->refs = 1;
+	f->at = mono_us();
+	f->len = len;
+	memcpy(f->msg, msg, len);
+	return f;
+}
+
+static void
+frame_put(struct caddx_frame *f)
+{
+	if (!--f->refs)
+		FRAME_FREE(f);
+}
+
+static int
+client_tab_init(void)
+{
+	if (!(client_tab = calloc(max_clients, sizeof(*client_tab)))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+static struct caddx_client *
+client_new(int fd)
+{
+	struct caddx_client *cl;
+
+	if ((cl = client_free))
+		client_free = cl->next;
+	else if (client_hi < max_clients)
+		cl = &client_tab[client_hi++];
+	else
+		return NULL;
+
+	memset(cl, 0, sizeof(*cl));
+	cl->fd = fd;
+	nclients++;
+	return cl;
+}
+
+static void
+client_release(struct caddx_client *cl)
+{
+	cl->fd = -1;
+	cl->next = client_free;
+	client_free = cl;
+	nclients--;
+}
+
+static void
+txsrc_push(struct caddx_txsrc *src, struct caddx_txreq *req)
+{
+	req->next = NULL;
+	if (!src->q[req->prio])
+		src->tail[req->prio] = &src->q[req->prio];
+	*src->tail[req->prio] = req;
+	src->tail[req->prio] = &req->next;
+	src->queued++;
+}
+
+/* Safe to call while walking client_tab, the slot only goes back on the
+ * free list.
+ */
+static void
+caddx_rm_client(struct caddx_client *cl)
+{
+	struct caddx_txreq *req;
+	int i;
+
+	warn("%p: rm client %d\n", cl, cl->fd);
+	st.client_drops++;
+	if (cl->src.limited)
+		info("%p: %u frames were limited\n", cl, cl->src.limited);
+	io_cancel(cl->fd);
+	close(cl->fd); /* TODO: Check retval? */
+
+	/* What it asked for still goes out, nobody gets the answer */
+	for (i = 0; i < TX_PRIO_N; i++)
+		while ((req = cl->src.q[i])) {
+			cl->src.q[i] = req->next;
+			req->cl = NULL;
+			txsrc_push(&cl->panel->tx_bridge, req);
+		}
+	if (cl->panel->tx_inflight && cl->panel->tx_inflight->cl == cl)
+		cl->panel->tx_inflight->cl = NULL;
+	for (; cl->qlen; cl->qlen--, cl->qhead++)
+		frame_put(cl->q[cl->qhead % CADDX_CLIENT_QLEN].f);
+
+	client_release(cl);
+}
+
+/* Queue f for cl, it goes out with the next clients_flush() */
+static int
+client_queue(struct caddx_client *cl, struct caddx_frame *f, uint16_t id)
+{
+	struct caddx_qent *e;
+
+	if (cl->qlen == CADDX_CLIENT_QLEN) {
+		warn("%p: client %d is not keeping up\n", cl, cl->fd);
+		errno = ENOBUFS;
+		return -1;
+	}
+	if (cl->proto >= CADDX_PROTO_V1 && f->len > 255 - CADDX_ID_LEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	e = &cl->q[(cl->qhead + cl->qlen++) % CADDX_CLIENT_QLEN];
+	e->hlen = 1;
+	if (cl->proto >= CADDX_PROTO_V1) {
+		e->hdr[1] = id >> 8;
+		e->hdr[2] = id & 0xff;
+		e->hlen += CADDX_ID_LEN;
+	}
+	e->hdr[0] = e->hlen - 1 + f->len;
+	/* Stream lines go out as they are */
+	if (cl->proto == PROTO_STREAM)
+		e->hlen = 0;
+	e->f = f;
+	f->refs++;
+	return 0;
+}
+
+static int
+client_write(struct caddx_client *cl, uint16_t id, void *msg, uint8_t len)
+{
+	struct caddx_frame *f;
+	int ret;
+
+	if (!(f = frame_new(msg, len)))
+		return -1;
+	ret = client_queue(cl, f, id);
+	frame_put(f);
+	return ret;
+}
+
+/* Describe what is queued for cl in at most max iovecs */
+static int
+client_iov(struct caddx_client *cl, struct iovec *iov, uint32_t max)
+{
+	struct caddx_qent *e;
+	uint32_t i, n = 0;
+
+	for (i = 0; i < cl->qlen && n + 2 <= max; i++) {
+		e = &cl->q[(cl->qhead + i) % CADDX_CLIENT_QLEN];
+		iov[n].iov_base = e->hdr;
+		iov[n++].iov_len = e->hlen;
+		iov[n].iov_base = e->f->msg;
+		iov[n++].iov_len = e->f->len;
+	}
+	if (!n)
+		return 0;
+
+	/* Skip what a previous short write already sent */
+	if (cl->qoff < iov[0].iov_len) {
+		iov[0].iov_base = (uint8_t *)iov[0].iov_base + cl->qoff;
+		iov[0].iov_len -= cl->qoff;
+	} else {
+		iov[1].iov_base = (uint8_t *)iov[1].iov_base + cl->qoff - iov[0].iov_len;
+		iov[1].iov_len -= cl->qoff - iov[0].iov_len;
+		iov[0].iov_len = 0;
+	}
+	return n;
+}
 
-/* CADDX Binary Protocol:
- * Byte: Description
- *  Bit: Description
+/* Drop what a write of cl's queue took, res is its result */
+static int
+client_written(struct caddx_client *cl, ssize_t res)
+{
+	struct caddx_qent *e;
+	uint64_t now = mono_us();
+	uint32_t left;
+
+	if (res < 0 && res != -EAGAIN && res != -EINTR) {
+		errno = -res;
+		return -1;
+	}
+	debug("%p: flushed %zd bytes to %d\n", cl, res, cl->fd);
+
+	while (res > 0 && cl->qlen) {
+		e = &cl->q[cl->qhead % CADDX_CLIENT_QLEN];
+		left = e->hlen + e->f->len - cl->qoff;
+		if (res < left) {
+			cl->qoff += res;
+			break;
+		}
+		res -= left;
+		stat_hist_add(&st.client, now - e->f->at);
+		PROBE(client_write, cl->fd, e->f->msg[0], now - e->f->at);
+		frame_put(e->f);
+		cl->qhead = (cl->qhead + 1) % CADDX_CLIENT_QLEN;
+		cl->qlen--;
+		cl->qoff = 0;
+	}
+
+	/* Whatever is left waits until the socket has room again */
+	if (cl->qlen && !cl->wwait && io_watch(cl->fd, IO_EV_WRITABLE, cl) == 0) {
+		cl->wwait = 1;
+		st.client_stalls++;
+	}
+	return 0;
+}
+
+/* Write out everything queued for clients, one writev() per client and
+ * all of them in a single submission with io_uring.
+ */
+static void
+clients_flush(void)
+{
+	static struct iovec iov[CADDX_FLUSH_IOV];
+	struct io_wr wr[IO_MAX_OPS];
+	struct caddx_client *who[IO_MAX_OPS], *cl;
+	uint32_t used = 0;
+	int i, n = 0;
+
+	for (cl = client_tab; cl < client_tab + client_hi && n < IO_MAX_OPS; cl++) {
+		if (cl->fd < 0 || !cl->qlen || cl->wwait)
+			continue;
+		if (!(i = client_iov(cl, iov + used, CADDX_FLUSH_IOV - used)))
+			break;
+		stat_hist_add(&st.client_qlen, cl->qlen);
+		wr[n].fd = cl->fd;
+		wr[n].iov = iov + used;
+		wr[n].iovcnt = i;
+		who[n++] = cl;
+		used += i;
+	}
+	if (!n || io_writev(wr, n) < 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		if (client_written(who[i], wr[i].res) < 0)
+			caddx_rm_client(who[i]);
+}
+
+static uint8_t
+caddx_reply_type(uint8_t type)
+{
+	const struct caddx_msg_info *info = caddx_msg_info(type);
+
+	/* Commands are answered with a positive acknowledge */
+	return info && info->reply ? info->reply : CADDX_ACK;
+}
+
+static int
+caddx_is_reply(struct caddx_txreq *req, uint8_t *msg, uint32_t len)
+{
+	uint8_t type = msg[0] & CADDX_MSG_MASK;
+
+	if (type == CADDX_FAILED || type == CADDX_NAK || type == CADDX_REJECTED)
+		return 1;
+	if (type != caddx_reply_type(req->msg[0] & CADDX_MSG_MASK))
+		return 0;
+
+	switch (type) {
+	case CADDX_ZONE_NAME:
+	case CADDX_ZONE_STATUS:
+	case CADDX_PART_STATUS:
+	case CADDX_LOG_EVENT:
+		/* These echo the zone, partition or index they describe,
+		 * which tells them apart from transition messages. */
+		return len > 1 && req->len > 1 && msg[1] == req->msg[1];
+	}
+	return 1;
+}
+
+/* The queue a frame from a client goes to */
+static int
+caddx_tx_prio(uint8_t type)
+{
+	return caddx_reply_type(type & CADDX_MSG_MASK) == CADDX_ACK ?
+		TX_PRIO_CMD : TX_PRIO_REQ;
+}
+
+static int
+caddx_queue(struct caddx_client *cl, uint16_t id, uint8_t *msg, uint8_t len, int prio)
+{
+	struct caddx_txsrc *src = cl ? &cl->src : &pn->tx_bridge;
+	struct caddx_txreq *req;
+
+	if (cl && src->queued >= TX_CLIENT_MAX) {
+		src->limited++;
+		st.tx_limited++;
+		errno = ENOBUFS;
+		return -1;
+	}
+	if (!(req = TXREQ_ALLOC())) {
+		st.nobufs++;
+		errno = ENOBUFS;
+		return -1;
+	}
+	req->next = NULL;
+	req->cl = cl;
+	req->queued = mono_ms();
+	req->id = id;
+	req->prio = prio;
+	req->limited = 0;
+	req->len = len;
+	memcpy(req->msg, msg, len);
+
+	txsrc_push(src, req);
+	pn->tx_queued++;
+	return 0;
+}
+
+/* Nothing in flight or waiting */
+static int
+tx_idle(void)
+{
+	return !pn->tx_queued && !pn->tx_inflight;
+}
+
+/* The k-th source for round robin, the bridge comes after the clients.
+ * Clients of other panels have nothing queued here.
+ */
+static struct caddx_txsrc *
+txsrc_at(uint32_t k)
+{
+	if (k == client_hi)
+		return &pn->tx_bridge;
+	return client_tab[k].fd >= 0 && client_tab[k].panel == pn ?
+		&client_tab[k].src : NULL;
+}
+
+/* Whether src has a frame of class prio that may go now */
+static int
+txsrc_ready(struct caddx_txsrc *src, int prio, uint64_t now)
+{
+	const struct tx_limit *lim = src->lim;
+	uint64_t t;
+
+	if (!src->q[prio])
+		return 0;
+	if (!lim)
+		return 1;
+
+	t = src->tokens + (now - src->refill) * lim->rate;
+	src->tokens = (t > lim->burst * 1000) ? lim->burst * 1000 : t;
+	src->refill = now;
+	if (src->tokens >= 1000)
+		return 1;
+
+	if (!src->q[prio]->limited) {
+		src->q[prio]->limited = 1;
+		src->limited++;
+		st.tx_limited++;
+	}
+	/* Come back when there is a token */
+	t = now + (1000 - src->tokens + lim->rate - 1) / lim->rate;
+	if (!pn->tx_wake || t < pn->tx_wake)
+		pn->tx_wake = t;
+	return 0;
+}
+
+/* Take the next frame to send off its queue */
+static struct caddx_txreq *
+caddx_tx_pick(void)
+{
+	struct caddx_txsrc *src;
+	struct caddx_txreq *req;
+	uint64_t now = mono_ms(), oldest[TX_PRIO_N];
+	uint32_t k, n = client_hi + 1, cost;
+	int i, best = -1;
+
+	pn->tx_wake = 0;
+	for (i = 0; i < TX_PRIO_N; i++) {
+		oldest[i] = UINT64_MAX;
+		for (k = 0; k < n; k++)
+			if ((src = txsrc_at(k)) && txsrc_ready(src, i, now) &&
+			    src->q[i]->queued < oldest[i])
+				oldest[i] = src->q[i]->queued;
+		if (oldest[i] == UINT64_MAX)
+			continue;
+		/* Past waiting commands only right after one went out */
+		if (best < 0 || (now - oldest[i] >= TX_AGE && oldest[i] < oldest[best] &&
+				 (oldest[TX_PRIO_CMD] == UINT64_MAX || pn->tx_aged_ok)))
+			best = i;
+	}
+	if (best < 0)
+		return NULL;
+	pn->tx_aged_ok = best == TX_PRIO_CMD;
+
+	/* Deficit round robin over the sources that have one ready */
+	for (;;) {
+		k = pn->tx_rr[best] % n;
+		src = txsrc_at(k);
+		if (src && txsrc_ready(src, best, now)) {
+			if (pn->tx_fresh[best]) {
+				src->deficit[best] += TX_QUANTUM;
+				pn->tx_fresh[best] = 0;
+			}
+			cost = src->q[best]->len + TX_OVERHEAD;
+			if (cost <= src->deficit[best])
+				break;
+		} else if (src)
+			src->deficit[best] = 0;
+		pn->tx_rr[best] = k + 1;
+		pn->tx_fresh[best] = 1;
+	}
+
+	req = src->q[best];
+	src->q[best] = req->next;
+	req->next = NULL;
+	src->deficit[best] -= cost;
+	src->queued--;
+	if (src->lim)
+		src->tokens -= 1000;
+	pn->tx_queued--;
+	return req;
+}
+
+/* Give up on a request, v1 clients are told it failed */
+static void
+caddx_tx_fail(struct caddx_txreq *req)
+{
+	uint8_t failed = CADDX_FAILED;
+
+	if (req->cl && req->cl->proto >= CADDX_PROTO_V1 &&
+	    client_write(req->cl, req->id, &failed, 1) < 0)
+		caddx_rm_client(req->cl);
+	TXREQ_FREE(req);
+}
+
+static void
+caddx_tx_next(void)
+{
+	struct caddx_txreq *req;
+
+	if (pn->tx_inflight && mono_ms() >= pn->tx_deadline) {
+		warn("no reply to %02x\n", pn->tx_inflight->msg[0]);
+		st.tx_timeouts++;
+		caddx_tx_fail(pn->tx_inflight);
+		pn->tx_inflight = NULL;
+	}
+
+	/* Requests wait in their queues while the link is down, and while
+	 * link_out might not take the largest frame, until link_flush()
+	 * has made room.
+	 */
+	while (pn->link_up && !pn->tx_inflight) {
+		if (sizeof(pn->link_out) - pn->link_outlen < CADDX_FRAME_MAX(255)) {
+			if (pn->tx_queued)
+				pn->tx_wake = mono_ms() + LINK_STALL_WAIT;
+			break;
+		}
+		if (!(req = caddx_tx_pick()))
+			break;
+		if (caddx_tx(req->msg, req->len) < 0) {
+			caddx_tx_fail(req);
+			continue;
+		}
+		pn->tx_inflight = req;
+		pn->tx_deadline = mono_ms() + CADDX_REPLY_TIMEOUT;
+	}
+}
+
+/* Decoded event stream (-e).  Its clients get a line of JSON for each
+ * zone, partition or system status that changed, naming the flags that
+ * were set and cleared since the last one:
  *
- * 0: Start character (CADDX_START)
- * 1: Length (not incl. escaped bytes and checksum)
- * 2:
- *  7: Ack required
- *  6: Reserved
- *  0-5: Message type
- * ... Message
- * N-1: Fletcher sum1
- * N: Fletcher sum2
+ * {"type":"zone","panel":1,"id":3,"set":["faulted"],"clear":[]}
+ * {"type":"part","panel":1,"id":1,"armed":true,"set":["armed"],"clear":["ready"]}
+ * {"type":"system","panel":1,"set":["ac_fail"],"clear":[]}
+ *
+ * Panels, zones and partitions count from 1.  Each line is made once and
+ * the same frame is queued for every stream client.  A new client first
+ * gets a line for every status known, with only what is set.  What
+ * stream clients send is ignored.
+ */
+struct stream_flag {
+	uint16_t bit;		/* CADDX_BIT() */
+	const char *name;
+};
+
+static const struct stream_flag stream_zone[] = {
+	{ CADDX_ZS_FAULTED, "faulted" },
+	{ CADDX_ZS_TAMPERED, "tampered" },
+	{ CADDX_ZS_TROUBLE, "trouble" },
+	{ CADDX_ZS_BYPASSED, "bypassed" },
+	{ CADDX_ZS_INHIBITED, "inhibited" },
+	{ CADDX_ZS_LOW_BATTERY, "low_battery" },
+	{ CADDX_ZS_LOST_SUPERVISION, "lost_supervision" },
+	{ CADDX_ZS_ALARM_MEMORY, "alarm_memory" },
+	{ CADDX_ZS_BYPASS_MEMORY, "bypass_memory" },
+};
+
+static const struct stream_flag stream_part[] = {
+	{ CADDX_PS_ARMED, "armed" },
+	{ CADDX_PS_INSTANT, "instant" },
+	{ CADDX_PS_READY_TO_ARM, "ready" },
+	{ CADDX_PS_ENTRY, "entry" },
+	{ CADDX_PS_EXIT1, "exit1" },
+	{ CADDX_PS_EXIT2, "exit2" },
+	{ CADDX_PS_SIREN_ON, "siren" },
+	{ CADDX_PS_STEADY_SIREN_ON, "steady_siren" },
+	{ CADDX_PS_FIRE, "fire" },
+	{ CADDX_PS_FIRE_TROUBLE, "fire_trouble" },
+	{ CADDX_PS_TAMPER, "tamper" },
+	{ CADDX_PS_ALARM_MEMORY, "alarm_memory" },
+	{ CADDX_PS_ZONE_BYPASSED, "zone_bypassed" },
+};
+
+static const struct stream_flag stream_sys[] = {
+	{ CADDX_SS_GROUND_FAULT, "ground_fault" },
+	{ CADDX_SS_PHONE_FAULT, "phone_fault" },
+	{ CADDX_SS_FAIL_TO_COMM, "fail_to_communicate" },
+	{ CADDX_SS_FUSE_FAULT, "fuse_fault" },
+	{ CADDX_SS_BOX_TAMPER, "box_tamper" },
+	{ CADDX_SS_SIREN_TAMPER, "siren_tamper" },
+	{ CADDX_SS_LOW_BATTERY, "low_battery" },
+	{ CADDX_SS_AC_FAIL, "ac_fail" },
+};
+
+static char *stream_addr = NULL;
+static int stream_sfd = -1;
+
+/* Append to line the names in tab of flags that are on in a and off in
+ * b as a JSON list, returns how many there were.
+ */
+static int
+stream_flags(char *line, int *n, const struct stream_flag *tab, uint32_t ntab,
+	     const struct caddx_view *a, const struct caddx_view *b)
+{
+	uint32_t i;
+	int found = 0;
+
+	*n += sprintf(line + *n, "[");
+	for (i = 0; i < ntab; i++) {
+		if (!caddx_bit(a, tab[i].bit) || (b && caddx_bit(b, tab[i].bit)))
+			continue;
+		*n += sprintf(line + *n, "%s\"%s\"", found++ ? "," : "", tab[i].name);
+	}
+	*n += sprintf(line + *n, "]");
+	return found;
+}
+
+/* Make the line for status msg of pn, given the one before (NULL: none).
+ * Returns its length, or 0 if none of the flags it names changed.  The
+ * tables above keep it well short of 255 bytes.
+ */
+static int
+stream_line(char *line, const uint8_t *prev, const uint8_t *msg, uint32_t len)
+{
+	struct caddx_view v = { NULL, msg, len }, old = { NULL, prev, len };
+	const struct stream_flag *tab;
+	uint32_t ntab;
+	int n, changed;
+
+	n = sprintf(line, "{\"type\":");
+	switch (msg[0] & CADDX_MSG_MASK) {
+	case CADDX_ZONE_STATUS:
+		tab = stream_zone;
+		ntab = ARRAY_SIZE(stream_zone);
+		n += sprintf(line + n, "\"zone\",\"panel\":%ld,\"id\":%u,",
+			     (long)(pn - panels) + 1, caddx_byte(&v, CADDX_ZS_ZONE) + 1);
+		break;
+	case CADDX_PART_STATUS:
+		tab = stream_part;
+		ntab = ARRAY_SIZE(stream_part);
+		n += sprintf(line + n, "\"part\",\"panel\":%ld,\"id\":%u,\"armed\":%s,",
+			     (long)(pn - panels) + 1, caddx_byte(&v, CADDX_PS_PART) + 1,
+			     caddx_bit(&v, CADDX_PS_ARMED) ? "true" : "false");
+		break;
+	case CADDX_SYSTEM_STATUS:
+		tab = stream_sys;
+		ntab = ARRAY_SIZE(stream_sys);
+		n += sprintf(line + n, "\"system\",\"panel\":%ld,", (long)(pn - panels) + 1);
+		break;
+	default:
+		return 0;
+	}
+	n += sprintf(line + n, "\"set\":");
+	changed = stream_flags(line, &n, tab, ntab, &v, prev ? &old : NULL);
+	n += sprintf(line + n, ",\"clear\":");
+	if (prev)
+		changed += stream_flags(line, &n, tab, ntab, &old, &v);
+	else
+		n += sprintf(line + n, "[]");
+	n += sprintf(line + n, "}\n");
+	return (changed || !prev) ? n : 0;
+}
+
+/* Queue the line for a status change to every stream client */
+static void
+stream_publish(const uint8_t *prev, const uint8_t *msg, uint32_t len)
+{
+	struct caddx_client *cl;
+	struct caddx_frame *f;
+	char line[256];
+	int n;
+
+	if (stream_sfd < 0 || !(n = stream_line(line, prev, msg, len)))
+		return;
+	if (!(f = frame_new((uint8_t *)line, n)))
+		return;
+	st.stream_lines++;
+	for (cl = client_tab; cl < client_tab + client_hi; cl++)
+		if (cl->fd >= 0 && cl->proto == PROTO_STREAM && client_queue(cl, f, 0) < 0)
+			caddx_rm_client(cl);
+	frame_put(f);
+}
+
+/* Remember status messages, returns 1 if msg is a status that differs
+ * from what was seen last for its zone or partition.
  */
+static int
+caddx_seen(uint8_t *msg, uint32_t len)
+{
+	uint8_t *seen, *stale;
+
+	switch (msg[0] & CADDX_MSG_MASK) {
+	case CADDX_ZONE_STATUS:
+		if (len != CADDX_ZONE_STATUS_LEN)
+			return 0;
+		seen = pn->zone_seen[msg[1]];
+		stale = &pn->zone_stale[msg[1]];
+		break;
+	case CADDX_PART_STATUS:
+		if (len != CADDX_PART_STATUS_LEN)
+			return 0;
+		seen = pn->part_seen[msg[1]];
+		stale = &pn->part_stale[msg[1]];
+		break;
+	case CADDX_SYSTEM_STATUS:
+		if (len != CADDX_SYSTEM_STATUS_LEN)
+			return 0;
+		seen = pn->sys_seen;
+		stale = &pn->sys_stale;
+		break;
+	default:
+		return 0;
+	}
+	if (*stale) {
+		*stale = 0;
+		pn->state_stale--;
+	}
+
+	/* The ack request bit is not part of the state */
+	if (seen[0] == len && seen[1] == (msg[0] & CADDX_MSG_MASK) &&
+	    !memcmp(seen + 2, msg + 1, len - 1))
+		return 0;
+	stream_publish(seen[0] ? seen + 1 : NULL, msg, len);
+	seen[0] = len;
+	seen[1] = msg[0] & CADDX_MSG_MASK;
+	memcpy(seen + 2, msg + 1, len - 1);
+	pn->state_dirty = 1;
+	return 1;
+}
+
+static uint8_t *
+state_key(uint32_t key, uint8_t **stale)
+{
+	if (key < 256) {
+		*stale = &pn->zone_stale[key];
+		return pn->zone_seen[key];
+	} else if (key < 512) {
+		*stale = &pn->part_stale[key - 256];
+		return pn->part_seen[key - 256];
+	}
+	*stale = &pn->sys_stale;
+	return pn->sys_seen;
+}
+
+/* Tell new stream clients every status known.  That can be more lines
+ * than a client queue holds, so it goes a few at a time, continued each
+ * round as the queue drains.  Returns 1 if a client has more to come
+ * right away.
+ */
+#define STREAM_HELLO_QLEN	(CADDX_CLIENT_QLEN / 4)
+static int
+stream_hello(void)
+{
+	struct caddx_panel *save = pn;
+	struct caddx_client *cl;
+	uint8_t *seen, *stale;
+	char line[256];
+	uint32_t i, end = npanels * STATE_KEYS;
+	int n, more = 0;
+
+	for (cl = client_tab; cl < client_tab + client_hi; cl++) {
+		if (cl->fd < 0 || cl->proto != PROTO_STREAM || !cl->hello)
+			continue;
+		for (i = cl->hello - 1; i < end && cl->qlen < STREAM_HELLO_QLEN; i++) {
+			pn = &panels[i / STATE_KEYS];
+			seen = state_key(i % STATE_KEYS, &stale);
+			if (!seen[0] || !(n = stream_line(line, NULL, seen + 1, seen[0])))
+				continue;
+			/* Out of frames, try again once some went out */
+			if (client_write(cl, 0, line, n) < 0)
+				break;
+		}
+		cl->hello = i < end ? i + 1 : 0;
+		if (cl->hello && cl->qlen && !cl->wwait)
+			more = 1;
+	}
+	pn = save;
+	return more;
+}
+
+static int
+state_load(void)
+{
+	struct caddx_state_hdr hdr;
+	uint8_t *stale;
+	uint32_t i;
+	int fd;
+
+	errno = 0;
+	if ((fd = open(pn->state_path, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno == ENOENT)
+			errno = 0;
+		return errno ? -1 : 0;
+	}
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, STATE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != STATE_VERSION ||
+	    read(fd, pn->zone_seen, sizeof(pn->zone_seen)) != sizeof(pn->zone_seen) ||
+	    read(fd, pn->part_seen, sizeof(pn->part_seen)) != sizeof(pn->part_seen) ||
+	    read(fd, pn->sys_seen, sizeof(pn->sys_seen)) != sizeof(pn->sys_seen)) {
+		warn("state: ignoring %s\n", pn->state_path);
+		memset(pn->zone_seen, 0, sizeof(pn->zone_seen));
+		memset(pn->part_seen, 0, sizeof(pn->part_seen));
+		memset(pn->sys_seen, 0, sizeof(pn->sys_seen));
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	/* Datagrams may have gone out after the last save; skip far enough
+	 * ahead that receivers see a gap and resync instead of taking new
+	 * ones for duplicates.
+	 */
+	pn->mcast_seq = (hdr.mcast_seq[0] << 24) | (hdr.mcast_seq[1] << 16) |
+		(hdr.mcast_seq[2] << 8) | hdr.mcast_seq[3];
+	pn->mcast_seq += STATE_SEQ_SKIP;
+
+	for (i = 0; i < STATE_KEYS; i++)
+		if (state_key(i, &stale)[0]) {
+			*stale = 1;
+			pn->state_stale++;
+		}
+	info("state: %u statuses restored\n", pn->state_stale);
+	return 0;
+}
+
+static void
+state_save(void)
+{
+	struct caddx_state_hdr hdr = { STATE_MAGIC, STATE_VERSION };
+	uint32_t now = time(NULL);
+	char tmp[PATH_MAX];
+	int fd;
+
+	hdr.saved[0] = now >> 24;
+	hdr.saved[1] = now >> 16;
+	hdr.saved[2] = now >> 8;
+	hdr.saved[3] = now;
+	hdr.mcast_seq[0] = pn->mcast_seq >> 24;
+	hdr.mcast_seq[1] = pn->mcast_seq >> 16;
+	hdr.mcast_seq[2] = pn->mcast_seq >> 8;
+	hdr.mcast_seq[3] = pn->mcast_seq;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", pn->state_path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		goto error;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, pn->zone_seen, sizeof(pn->zone_seen)) != sizeof(pn->zone_seen) ||
+	    write(fd, pn->part_seen, sizeof(pn->part_seen)) != sizeof(pn->part_seen) ||
+	    write(fd, pn->sys_seen, sizeof(pn->sys_seen)) != sizeof(pn->sys_seen)) {
+		close(fd);
+		goto error;
+	}
+	close(fd);
+	if (rename(tmp, pn->state_path) < 0)
+		goto error;
+	pn->state_dirty = 0;
+	return;
+ error:
+	err("state: %s: %s\n", pn->state_path, strerror(errno ? errno : EIO));
+	errno = 0;
+}
+
+/* Save now and then, and confirm restored statuses while idle */
+static void
+state_tick(void)
+{
+	uint8_t req[2], *stale;
+	uint64_t now = mono_ms();
+
+	if (!pn->state_path)
+		return;
+	if (now >= pn->state_due) {
+		if (pn->state_dirty)
+			state_save();
+		pn->state_due = now + STATE_FREQ * 1000;
+	}
+
+	if (!pn->state_stale || !pn->synced)
+		return;
+	if (pn->state_pending) {
+		state_key(pn->state_next, &stale);
+		if (*stale && now < pn->state_deadline)
+			return;
+		if (*stale) {
+			/* Not confirmed, better not to claim anything */
+			warn("state: no answer for %u, dropping it\n", pn->state_next);
+			state_key(pn->state_next, &stale)[0] = 0;
+			*stale = 0;
+			pn->state_stale--;
+		}
+		pn->state_pending = 0;
+	}
+	if (!tx_idle())
+		return;
+
+	for (; pn->state_next < STATE_KEYS; pn->state_next++) {
+		state_key(pn->state_next, &stale);
+		if (*stale)
+			break;
+	}
+	if (pn->state_next == STATE_KEYS)
+		return;
+	if (pn->state_next < 256) {
+		req[0] = CADDX_ZONE_STATUS_REQ;
+		req[1] = pn->state_next;
+	} else if (pn->state_next < 512) {
+		req[0] = CADDX_PART_STATUS_REQ;
+		req[1] = pn->state_next - 256;
+	} else
+		req[0] = CADDX_SYSTEM_STATUS_REQ;
+	if (caddx_queue(NULL, 0, req, pn->state_next < 512 ? 2 : 1, TX_PRIO_BG) < 0)
+		return;
+	pn->state_pending = 1;
+	pn->state_deadline = now + 2 * CADDX_REPLY_TIMEOUT;
+}
+
+static int
+hist_init(uint32_t kb)
+{
+	pn->hist_len = kb * 1024 / sizeof(*pn->hist);
+	if (pn->hist_len && !(pn->hist = calloc(pn->hist_len, sizeof(*pn->hist)))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+hist_key(uint8_t *msg)
+{
+	if ((msg[0] & CADDX_MSG_MASK) == CADDX_ZONE_STATUS)
+		return msg[1];
+	if ((msg[0] & CADDX_MSG_MASK) == CADDX_PART_STATUS)
+		return 256 + msg[1];
+	return -1;
+}
+
+static uint32_t
+hist_oldest(void)
+{
+	return pn->hist_seq > pn->hist_len ? pn->hist_seq - pn->hist_len : 0;
+}
+
+/* Clear the lowest bit set */
+static uint32_t
+hist_lowest_off(uint32_t n)
+{
+	return n & (n - 1);
+}
+
+static uint32_t
+hist_skip_height(uint32_t height)
+{
+	if (height < 2)
+		return 0;
+	/* Odd heights skip less far, so a walk never has to take many
+	 * single steps in a row.
+	 */
+	return (height & 1) ? hist_lowest_off(hist_lowest_off(height - 1)) + 1 :
+		hist_lowest_off(height);
+}
+
+static struct caddx_hist *
+hist_rec(uint32_t s)
+{
+	return &pn->hist[(s - 1) % pn->hist_len];
+}
+
+/* The record at height of the key that s is a record of, 0 if it is no
+ * longer in the ring.
+ */
+static uint32_t
+hist_ancestor(uint32_t s, uint32_t height)
+{
+	uint32_t at, hs, hsp;
+
+	while (s && s - 1 >= hist_oldest() && (at = hist_rec(s)->height) > height) {
+		hs = hist_skip_height(at);
+		hsp = hist_skip_height(at - 1);
+		if (hist_rec(s)->skip &&
+		    (hs == height || (hs > height && !(hsp + 2 < hs && hsp >= height))))
+			s = hist_rec(s)->skip;
+		else
+			s = hist_rec(s)->prev;
+	}
+	return (s && s - 1 >= hist_oldest()) ? s : 0;
+}
+
+/* The newest record older than seq lo on the chain from s */
+static uint32_t
+hist_before(uint32_t s, uint32_t lo)
+{
+	while (s && s - 1 >= lo) {
+		if (hist_rec(s)->skip && hist_rec(s)->skip - 1 >= lo)
+			s = hist_rec(s)->skip;
+		else
+			s = hist_rec(s)->prev;
+	}
+	return s;
+}
+
+static void
+hist_add(uint8_t *msg, uint32_t len)
+{
+	struct caddx_hist *h;
+	uint32_t now = time(NULL), prev, height = 0, skip = 0;
+	int key;
+
+	if (!pn->hist_len || (key = hist_key(msg)) < 0 || len > sizeof(h->msg))
+		return;
+	/* Keep the ring sorted even if the clock steps back */
+	if (pn->hist_seq && pn->hist[(pn->hist_seq - 1) % pn->hist_len].time > now)
+		now = pn->hist[(pn->hist_seq - 1) % pn->hist_len].time;
+
+	/* Before the slot is reused: prev may be the record it holds */
+	prev = pn->hist_last[key];
+	if (prev && prev - 1 >= hist_oldest()) {
+		height = hist_rec(prev)->height + 1;
+		skip = hist_ancestor(prev, hist_skip_height(height));
+	}
+	if (skip && pn->hist_seq >= pn->hist_len && skip - 1 <= pn->hist_seq - pn->hist_len)
+		skip = 0;
+
+	h = &pn->hist[pn->hist_seq % pn->hist_len];
+	h->time = now;
+	h->prev = prev;
+	h->skip = skip;
+	h->height = height;
+	h->len = len;
+	memcpy(h->msg, msg, len);
+	h->msg[0] &= CADDX_MSG_MASK;
+	pn->hist_last[key] = ++pn->hist_seq;
+}
+
+/* Find up to max records of key in [from, to], newest first.  Returns how
+ * many were stored in out; *more is set if older ones were left out.
+ */
+static uint32_t
+hist_find(int key, uint32_t from, uint32_t to, uint32_t *out, uint32_t max,
+	  int *more)
+{
+	uint32_t lo = hist_oldest(), hi = pn->hist_seq, mid, s, n = 0;
+
+	/* lo: the first record newer than to */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pn->hist[mid % pn->hist_len].time <= to)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*more = 0;
+	s = hist_before(pn->hist_last[key], lo);
+	for (; s && s - 1 >= hist_oldest(); s = hist_rec(s)->prev) {
+		if (hist_rec(s)->time < from)
+			break;
+		if (n == max) {
+			*more = 1;
+			break;
+		}
+		out[n++] = s - 1;
+	}
+	return n;
+}
+
+/* Hand a panel message to the clients.  A reply goes to the client that
+ * asked and to those subscribed to all replies; if it tells us something
+ * new it is an event as well.
+ */
+static void
+caddx_deliver(uint8_t *buf, struct caddx_txreq *req)
+{
+	struct caddx_client *cl;
+	uint8_t want = CADDX_SUB_EVENTS;
+	struct caddx_frame *f;
+	uint64_t at = mono_us();
+	int changed = caddx_seen(buf + 1, buf[0]);
+
+	if (changed)
+		hist_add(buf + 1, buf[0]);
+	if (req && !changed)
+		want = CADDX_SUB_REPLIES;
+
+	if (!(f = frame_new(buf + 1, buf[0])))
+		return;
+	for (cl = client_tab; cl < client_tab + client_hi; cl++) {
+		if (cl->fd < 0 || cl->panel != pn)
+			continue;
+		if (req && req->cl == cl) {
+			if (client_queue(cl, f, req->id) < 0)
+				caddx_rm_client(cl);
+		} else if (cl->subs & want) {
+			if (client_queue(cl, f, 0) < 0)
+				caddx_rm_client(cl);
+		}
+	}
+	frame_put(f);
+	stat_hist_add(&st.deliver, mono_us() - at);
+	PROBE(deliver, buf[1] & CADDX_MSG_MASK, mono_us() - at);
+}
+
+static int
+log_open(const char *path)
+{
+	struct caddx_logrec rec;
+	off_t end;
+	uint32_t i;
+
+	errno = 0;
+	if ((pn->log_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+		ERR(errno);
+	if ((end = lseek(pn->log_fd, 0, SEEK_END)) < 0)
+		ERR(errno);
+	if (end < (off_t)sizeof(pn->log_hdr)) {
+		memcpy(pn->log_hdr.magic, LOG_MAGIC, sizeof(pn->log_hdr.magic));
+		pn->log_hdr.version = LOG_VERSION;
+		if (pwrite(pn->log_fd, &pn->log_hdr, sizeof(pn->log_hdr), 0) != sizeof(pn->log_hdr))
+			ERR(errno ? errno : EIO);
+		return 0;
+	}
+	if (pread(pn->log_fd, &pn->log_hdr, sizeof(pn->log_hdr), 0) != sizeof(pn->log_hdr))
+		ERR(errno ? errno : EIO);
+	if (memcmp(pn->log_hdr.magic, LOG_MAGIC, sizeof(pn->log_hdr.magic)) ||
+	    pn->log_hdr.version != LOG_VERSION)
+		ERR(EINVAL);
+
+	/* A partial record left by a crash is overwritten by the next one */
+	pn->log_count = (end - sizeof(pn->log_hdr)) / sizeof(rec);
+
+	/* Only the last 256 records can still be in the panel */
+	for (i = (pn->log_count > 256) ? pn->log_count - 256 : 0; i < pn->log_count; i++) {
+		if (pread(pn->log_fd, &rec, sizeof(rec), LOG_OFF(i)) != sizeof(rec))
+			ERR(errno ? errno : EIO);
+		memcpy(pn->log_slot[rec.entry[0]], rec.entry, LOG_ENTRY_LEN);
+		pn->log_known[rec.entry[0]] = 1;
+	}
+	info("log: %u entries, next slot %d\n", pn->log_count, pn->log_hdr.next);
+
+	/* FALLTHROUGH */
+ error:
+	if (errno) {
+		if (pn->log_fd >= 0) close(pn->log_fd);
+		pn->log_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* Minutes into the year, the entries carry no year */
+static uint32_t
+log_when(uint8_t *entry)
+{
+	/* The entry is a log event without its type byte */
+	return ((entry[CADDX_LE_MONTH - 1] * 32 + entry[CADDX_LE_DAY - 1]) * 24 +
+		entry[CADDX_LE_HOUR - 1]) * 60 + entry[CADDX_LE_MINUTE - 1];
+}
+
+static void
+log_done(void)
+{
+	uint32_t i, best = 0;
+
+	/* Without a previous pass to compare against, we started at slot 0;
+	 * continue after the newest entry.
+	 */
+	if (pn->log_first && pn->log_hdr.log_size) {
+		for (i = 0; i < pn->log_hdr.log_size; i++)
+			if (pn->log_known[i] && log_when(pn->log_slot[i]) >= log_when(pn->log_slot[best]))
+				best = i;
+		pn->log_hdr.next = (best + 1) % pn->log_hdr.log_size;
+		pwrite(pn->log_fd, &pn->log_hdr, sizeof(pn->log_hdr), 0);
+	}
+	info("log: %u entries, next slot %d\n", pn->log_count, pn->log_hdr.next);
+	pn->log_busy = pn->log_first = 0;
+	pn->log_due = mono_ms() + LOG_FREQ * 1000;
+}
+
+/* Ask for the next log entry if the panel has nothing better to do */
+static void
+log_tick(void)
+{
+	uint8_t req[2] = { CADDX_LOG_EVENT_REQ };
+	uint64_t now = mono_ms();
+
+	if (pn->log_fd < 0 || !pn->synced)
+		return;
+	if (pn->log_pending) {
+		if (now < pn->log_deadline)
+			return;
+		warn("log: no answer for slot %d\n", pn->log_hdr.next);
+		pn->log_pending = pn->log_busy = 0;
+		pn->log_due = now + LOG_RETRY * 1000;
+	}
+	if (!pn->log_busy) {
+		if (now < pn->log_due)
+			return;
+		pn->log_busy = 1;
+		pn->log_first = !pn->log_count;
+		pn->log_left = pn->log_hdr.log_size ? pn->log_hdr.log_size : 256;
+	}
+	if (!tx_idle())
+		return;
+
+	req[1] = pn->log_hdr.next;
+	if (caddx_queue(NULL, 0, req, sizeof(req), TX_PRIO_BG) < 0)
+		return;
+	pn->log_pending = 1;
+	pn->log_deadline = now + 2 * CADDX_REPLY_TIMEOUT;
+}
+
+static void
+log_rx(const struct caddx_view *v)
+{
+	struct caddx_logrec rec = {{ 0 }};
+	uint8_t event = caddx_byte(v, CADDX_LE_EVENT);
+	uint8_t size = caddx_byte(v, CADDX_LE_LOG_SIZE);
+	uint32_t now = time(NULL);
+
+	if (pn->log_fd < 0)
+		return;
+	if (!pn->log_pending || event != pn->log_hdr.next) {
+		/* The panel reporting a new entry, go and get it */
+		if (!pn->log_busy)
+			pn->log_due = 0;
+		return;
+	}
+	pn->log_pending = 0;
+
+	if (pn->log_known[event] && !memcmp(pn->log_slot[event], v->msg + 1, LOG_ENTRY_LEN)) {
+		log_done();
+		return;
+	}
+
+	rec.time[0] = now >> 24;
+	rec.time[1] = now >> 16;
+	rec.time[2] = now >> 8;
+	rec.time[3] = now;
+	memcpy(rec.entry, v->msg + 1, LOG_ENTRY_LEN);
+	if (pwrite(pn->log_fd, &rec, sizeof(rec), LOG_OFF(pn->log_count)) != sizeof(rec)) {
+		err("log: %s\n", strerror(errno ? errno : EIO));
+		log_done();
+		return;
+	}
+	pn->log_count++;
+	memcpy(pn->log_slot[event], v->msg + 1, LOG_ENTRY_LEN);
+	pn->log_known[event] = 1;
+
+	pn->log_hdr.log_size = size;
+	pn->log_hdr.next = size ? (event + 1) % size : 0;
+	pwrite(pn->log_fd, &pn->log_hdr, sizeof(pn->log_hdr), 0);
+	if (!--pn->log_left || (pn->log_first && !pn->log_hdr.next))
+		log_done();
+}
+
+static int
+names_load(void)
+{
+	struct caddx_names_hdr hdr;
+	int fd;
+
+	errno = 0;
+	if ((fd = open(pn->names_path, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno == ENOENT)
+			errno = 0;
+		return errno ? -1 : 0;
+	}
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, NAMES_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != NAMES_VERSION) {
+		warn("names: ignoring %s\n", pn->names_path);
+		close(fd);
+		return 0;
+	}
+	pn->names_count = (hdr.count[0] << 8) | hdr.count[1];
+	if (pn->names_count > 256 || read(fd, pn->zone_names, pn->names_count * NAMES_LEN) != (ssize_t)(pn->names_count * NAMES_LEN)) {
+		warn("names: %s is short\n", pn->names_path);
+		pn->names_count = 0;
+	}
+	memcpy(pn->names_ident, hdr.ident, sizeof(pn->names_ident));
+	close(fd);
+	return 0;
+}
+
+static void
+names_save(void)
+{
+	struct caddx_names_hdr hdr = { NAMES_MAGIC, NAMES_VERSION };
+	char tmp[PATH_MAX];
+	int fd;
+
+	memcpy(hdr.ident, pn->names_ident, sizeof(hdr.ident));
+	hdr.count[0] = pn->names_count >> 8;
+	hdr.count[1] = pn->names_count;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", pn->names_path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		goto error;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, pn->zone_names, pn->names_count * NAMES_LEN) != (ssize_t)(pn->names_count * NAMES_LEN)) {
+		close(fd);
+		goto error;
+	}
+	close(fd);
+	if (rename(tmp, pn->names_path) < 0)
+		goto error;
+	return;
+ error:
+	err("names: %s: %s\n", pn->names_path, strerror(errno ? errno : EIO));
+	errno = 0;
+}
+
+/* Drop the names and fetch them again */
+static void
+names_reset(void)
+{
+	pn->names_valid = pn->names_count = pn->names_next = pn->names_pending = 0;
+	pn->names_busy = (pn->names_path != NULL);
+}
+
+/* The panel's interface configuration arrived, are the names still its? */
+static void
+names_check(const uint8_t *ident)
+{
+	if (pn->names_count && !memcmp(pn->names_ident, ident, sizeof(pn->names_ident))) {
+		pn->names_valid = 1;
+		return;
+	}
+	info("names: panel configuration changed\n");
+	memcpy(pn->names_ident, ident, sizeof(pn->names_ident));
+	names_reset();
+}
+
+static void
+names_done(void)
+{
+	info("names: %u zones\n", pn->names_count);
+	pn->names_busy = pn->names_pending = 0;
+	pn->names_valid = 1;
+	names_save();
+}
+
+/* Ask for the next zone name if the panel has nothing better to do */
+static void
+names_tick(void)
+{
+	struct caddx_zone_name_req req = {{ CADDX_ZONE_NAME_REQ }};
+	uint64_t now = mono_ms();
+
+	if (!pn->names_busy || !pn->synced)
+		return;
+	if (pn->names_pending) {
+		if (now < pn->names_deadline)
+			return;
+		/* Try again, it might just have been noise */
+		warn("names: no answer for zone %u\n", pn->names_next + 1);
+		pn->names_pending = 0;
+	}
+	if (!tx_idle())
+		return;
+
+	req.zone = pn->names_next;
+	if (caddx_queue(NULL, 0, (uint8_t *)&req, sizeof(req), TX_PRIO_BG) < 0)
+		return;
+	pn->names_pending = 1;
+	pn->names_deadline = now + 2 * CADDX_REPLY_TIMEOUT;
+}
+
+static void
+names_rx(const struct caddx_view *v)
+{
+	uint8_t zone;
+
+	if (caddx_type(v) != CADDX_ZONE_NAME) {
+		/* The panel has no zone names_next, that was all of them.
+		 * Only if this refuses our own request for it though, not
+		 * something a client asked for meanwhile.
+		 */
+		if (pn->names_pending && pn->rx_own[0] == CADDX_ZONE_NAME_REQ &&
+		    pn->rx_own[1] == pn->names_next)
+			names_done();
+		return;
+	}
+	zone = caddx_byte(v, CADDX_ZN_ZONE);
+	memcpy(pn->zone_names[zone], v->msg + CADDX_ZN_NAME, NAMES_LEN);
+	if (!pn->names_pending || zone != pn->names_next)
+		return;
+
+	pn->names_pending = 0;
+	pn->names_count = ++pn->names_next;
+	if (pn->names_next == 256)
+		names_done();
+}
+
+/* Answer a zone name request from the cache, returns 1 if it was and
+ * -1 if that cost the client its connection.
+ */
+static int
+names_answer(struct caddx_client *cl, uint16_t id, uint8_t *msg, uint8_t len)
+{
+	uint8_t name[CADDX_ZONE_NAME_LEN] = { CADDX_ZONE_NAME };
+
+	if ((msg[0] & CADDX_MSG_MASK) != CADDX_ZONE_NAME_REQ ||
+	    len < sizeof(struct caddx_zone_name_req) || !pn->names_valid ||
+	    msg[1] >= pn->names_count)
+		return 0;
+	name[CADDX_ZN_ZONE] = msg[1];
+	memcpy(name + CADDX_ZN_NAME, pn->zone_names[msg[1]], NAMES_LEN);
+	if (client_write(cl, id, name, sizeof(name)) < 0) {
+		caddx_rm_client(cl);
+		return -1;
+	}
+	return 1;
+}
+
+static int
+mcast_init(char *group, char *ifaddr)
+{
+	struct in_addr iface = { htonl(INADDR_ANY) };
+	unsigned char ttl = MCAST_TTL;
+	char *port;
+
+	errno = 0;
+	if ((port = rindex(group, ':')) == NULL)
+		ERR(EINVAL);
+	*(port++) = 0;
+
+	memset(&mcast_addr, 0, sizeof(mcast_addr));
+	mcast_addr.sin_family = AF_INET;
+	mcast_addr.sin_port = htons(strtol(port, NULL, 0));
+	if (!inet_aton(group, &mcast_addr.sin_addr) ||
+	    !IN_MULTICAST(ntohl(mcast_addr.sin_addr.s_addr)))
+		ERR(EINVAL);
+	if (ifaddr && !inet_aton(ifaddr, &iface))
+		ERR(EINVAL);
+
+	if ((mcast_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		ERR(errno);
+	if (setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+	    setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0)
+		ERR(errno);
+	fcntl(mcast_fd, F_SETFL, O_NONBLOCK);
+	info("publishing to %s:%s\n", group, port);
+
+	/* FALLTHROUGH */
+ error:
+	if (errno)
+		return -1;
+	return 0;
+}
+
+/* Send a panel frame ([len][msg]) to the multicast group.  The sequence
+ * number moves on even if this one cannot be sent, so receivers notice.
+ */
+static void
+mcast_publish(uint8_t *buf)
+{
+	uint8_t out[sizeof(struct caddx_mcast_hdr) + 255];
+	struct caddx_mcast_hdr *hdr = (struct caddx_mcast_hdr *)out;
+	uint32_t seq = pn->mcast_seq++;
+
+	if (mcast_fd < 0)
+		return;
+
+	hdr->magic[0] = CADDX_MCAST_MAGIC >> 8;
+	hdr->magic[1] = CADDX_MCAST_MAGIC & 0xff;
+	hdr->version = CADDX_MCAST_V1;
+	hdr->panel = pn - panels;
+	hdr->seq[0] = seq >> 24;
+	hdr->seq[1] = seq >> 16;
+	hdr->seq[2] = seq >> 8;
+	hdr->seq[3] = seq;
+	hdr->len = buf[0];
+	memcpy(out + sizeof(*hdr), buf + 1, buf[0]);
+
+	if (sendto(mcast_fd, out, sizeof(*hdr) + buf[0], 0,
+		   (struct sockaddr *)&mcast_addr, sizeof(mcast_addr)) < 0)
+		warn("mcast %u: %s\n", seq, strerror(errno));
+}
+
+static void
+rx_consume(uint32_t n)
+{
+	pn->rx_frame_at = pn->rx_at;
+	pn->rx_rawlen -= n;
+	memmove(pn->rx_raw, pn->rx_raw + n, pn->rx_rawlen);
+	/* What is left came with the last read at the latest */
+	if (pn->rx_rawlen)
+		pn->rx_at = pn->rx_now;
+}
+
+/* Cut the next frame out of rx_raw and unstuff it into buf as
+ * [len][msg][cksum].  Returns 1 for a frame, 0 if it is not all there
+ * yet and -1 for a bad one, whose bytes are dropped then.
+ */
+static int
+caddx_rx_frame(uint8_t *buf, uint32_t maxlen)
+{
+	uint32_t i = 0;
+	int ret;
+
+	while (i < pn->rx_rawlen && pn->rx_raw[i] != CADDX_START)
+		i++;
+	rx_consume(i);
+
+	ret = caddx_unframe(pn->rx_raw, pn->rx_rawlen, buf, maxlen, &i);
+	if (ret < 0 && errno == EPROTO) {
+		warn("rx: frame cut short after %u bytes\n", i);
+		st.rx_cut++;
+	}
+	if (ret)
+		rx_consume(i);
+	return ret;
+}
+
+/* Check and acknowledge the next frame from the panel and pass it on to
+ * clients.  Returns 1 for a frame in buf, 0 if there is none yet and -1
+ * for a bad one.
+ */
+static int
+caddx_rx_pkt(int fd, uint8_t *buf, uint32_t maxlen)
+{
+	int i, len;
+	uint16_t cksum;
+	struct caddx_txreq *req = NULL;
+
+	if ((i = caddx_rx_frame(buf, maxlen)) <= 0)
+		return i;
+	len = buf[0];
+	debug("read %d\n", len);
+	pn->rx_own[0] = 0;
+
+	cksum = fletcher_cksum(buf, len + 1);
+
+	if (!len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (cksum >> 8 != buf[1 + len] || (cksum & 0xff) != buf[2 + len]) {
+		uint8_t nak = CADDX_NAK;
+		caddx_tx(&nak, 1);
+		st.tx_naks++;
+		st.rx_cksum++;
+		warn("bad cksum: %02x%02x vs %04x\n", buf[1 + len], buf[2 + len], cksum);
+		errno = EPROTO;
+		return -1;
+	}
+
+	st.rx_frames++;
+	/* From its first byte to its last, then on to here */
+	stat_hist_add(&st.rx_wait, pn->rx_now - pn->rx_frame_at);
+	stat_hist_add(&st.rx_parse, mono_us() - pn->rx_now);
+	PROBE(rx_frame, buf[1] & CADDX_MSG_MASK, len, pn->rx_now - pn->rx_frame_at);
+	if ((buf[1] & CADDX_MSG_MASK) == CADDX_NAK)
+		st.rx_naks++;
+	if (buf[1] & CADDX_ACK_REQ) {
+		uint8_t ack = CADDX_ACK;
+		caddx_tx(&ack, 1);
+		st.tx_acks++;
+		PROBE(tx_ack, buf[1] & CADDX_MSG_MASK);
+	}
+
+	if (pn->tx_inflight && caddx_is_reply(pn->tx_inflight, buf + 1, buf[0])) {
+		req = pn->tx_inflight;
+		pn->tx_inflight = NULL;
+		if (!req->cl) {
+			pn->rx_own[0] = req->msg[0] & CADDX_MSG_MASK;
+			pn->rx_own[1] = req->len > 1 ? req->msg[1] : 0;
+		}
+		stat_hist_add(&st.reply_ms, mono_ms() + CADDX_REPLY_TIMEOUT - pn->tx_deadline);
+	}
+	mcast_publish(buf);
+	caddx_deliver(buf, req);
+	if (req) TXREQ_FREE(req);
+	return 1;
+}
+
+struct baud_rate {
+	uint32_t target;
+	uint32_t def;
+};
+
+static const struct baud_rate baud_rates[] =
+{
+        { 115200, B115200 },
+        {  57600,  B57600 },
+        {  38400,  B38400 },
+        {  19200,  B19200 },
+        {   9600,   B9600 },
+        {   4800,   B4800 },
+        {   2400,   B2400 },
+        {   1200,   B1200 },
+        {    300,    B300 },
+};
+
+static int
+serial_init(int fd)
+{
+	struct termios tio;
+	uint32_t i;
+
+	errno = 0;
+	tcgetattr(fd, &pn->tio_old);
+
+	for (i = 0; i < ARRAY_SIZE(baud_rates); i++)
+		if (baud_rates[i].target == baud)
+			break;
+	if (i == ARRAY_SIZE(baud_rates))
+		ERR(EINVAL);
+	i = baud_rates[i].def;
+
+	memset(&tio, 0, sizeof(tio));
+	tio.c_cflag = i | CS8 | CLOCAL | CREAD; /* TODO: Make CS8 modifiable */
+	tio.c_iflag = IGNPAR; /* TODO: Make modifiable */
+	tio.c_cc[VTIME] = 0;
+	tio.c_cc[VMIN] = 1;
+
+	if (tcflush(fd, TCIFLUSH) < 0)
+		ERR(errno);
+
+	if (tcsetattr(fd, TCSANOW, &tio) < 0)
+		ERR(errno);
+
+	/* FALLTHROUGH */
+ error:
+	if (errno)
+		return -1;
+	return 0;
+}
+
+/* The master side of a new pty; PATH, if given, becomes a symlink to
+ * the slave for the simulator to open.
+ */
+static int
+link_pty(const char *path)
+{
+	struct termios tio;
+	char *name;
+	int fd;
+
+	errno = 0;
+	if ((fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 ||
+	    grantpt(fd) < 0 || unlockpt(fd) < 0 || !(name = ptsname(fd)))
+		ERR(errno);
+	/* Reads fail with EIO whenever nobody has the slave open */
+	if ((pn->link_slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0)
+		ERR(errno);
+	if (tcgetattr(pn->link_slave, &tio) < 0)
+		ERR(errno);
+	cfmakeraw(&tio);
+	if (tcsetattr(pn->link_slave, TCSANOW, &tio) < 0)
+		ERR(errno);
+	if (*path) {
+		unlink(path);
+		if (symlink(name, path) < 0)
+			ERR(errno);
+	}
+	info("link: pty %s\n", name);
+	return fd;
+
+ error:
+	if (fd >= 0) close(fd);
+	if (pn->link_slave >= 0) close(pn->link_slave);
+	pn->link_slave = -1;
+	return -1;
+}
+
+/* Start connecting to HOST:PORT, link_connected() finishes the job */
+static int
+link_tcp(const char *hostport)
+{
+	struct addrinfo gai = { 0 }, *ai, *pai;
+	char host[256], *port;
+	int fd = -1, i;
+
+	errno = 0;
+	if (strlen(hostport) >= sizeof(host))
+		ERR(ENAMETOOLONG);
+	strcpy(host, hostport);
+	if ((port = rindex(host, ':')) == NULL)
+		ERR(EINVAL);
+	*(port++) = 0;
+
+	gai.ai_family = AF_UNSPEC;
+	gai.ai_socktype = SOCK_STREAM;
+	if ((i = getaddrinfo(host, port, &gai, &ai)) != 0)
+		ERR(i == EAI_SYSTEM ? errno : EHOSTUNREACH);
+
+	for (pai = ai; pai; pai = pai->ai_next) {
+		if ((fd = socket(pai->ai_family, pai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				 pai->ai_protocol)) < 0)
+			continue;
+		/* Frames are small and the panel waits for each; don't let
+		 * them sit in the kernel.
+		 */
+		i = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+		setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &i, sizeof(i));
+		if (connect(fd, pai->ai_addr, pai->ai_addrlen) == 0 || errno == EINPROGRESS)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	if (fd < 0) {
+		if (!errno)
+			errno = EHOSTUNREACH;
+		ERR(errno);
+	}
+	errno = 0;
+	return fd;
+
+ error:
+	return -1;
+}
+
+/* Open the link to the panel: a tty, pty:[PATH] or tcp://HOST:PORT.
+ * A TCP link is only up once link_connected() says so.
+ */
+static int
+link_open(void)
+{
+	int fd;
+
+	pn->link_outlen = pn->rx_rawlen = 0;
+	if (pn->link_kind == LINK_TCP)
+		return link_tcp(pn->link_uri + strlen("tcp://"));
+	if (pn->link_kind == LINK_PTY)
+		fd = link_pty(pn->link_uri + strlen("pty:"));
+	else if ((fd = open(pn->link_uri, O_RDWR | O_NOCTTY | O_CLOEXEC)) >= 0 &&
+		 serial_init(fd) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd >= 0)
+		pn->link_up = 1;
+	return fd;
+}
+
+static int
+link_watch(int *fd)
+{
+	return io_watch(*fd, pn->link_up ? IO_EV_READ : IO_EV_WRITABLE, fd);
+}
+
+/* The link is up, either for the first time or again.  Whatever the
+ * panel did meanwhile went unseen, so sync and confirm all statuses
+ * again; clients keep what they have until then.
+ */
+static void
+link_ready(void)
+{
+	uint8_t *stale;
+	uint32_t i;
+
+	info("link: %s up\n", pn->link_uri);
+	pn->link_up = 1;
+	pn->link_backoff = LINK_RETRY_MIN;
+	pn->synced = 0;
+	pn->sync_next = 0;
+	for (i = 0; i < STATE_KEYS; i++)
+		if (state_key(i, &stale)[0] && !*stale) {
+			*stale = 1;
+			pn->state_stale++;
+		}
+}
+
+static void
+link_later(void)
+{
+	pn->link_retry = mono_ms() + pn->link_backoff;
+	pn->link_backoff = pn->link_backoff * 2 > LINK_RETRY_MAX ? LINK_RETRY_MAX : pn->link_backoff * 2;
+}
+
+/* Drop the link and try again after a while, backing off */
+static void
+link_down(int *fd)
+{
+	warn("link: %s down, retrying in %u ms\n", pn->link_uri, pn->link_backoff);
+	st.link_drops++;
+	io_cancel(*fd);
+	close(*fd);
+	*fd = -1;
+	if (pn->link_slave >= 0)
+		close(pn->link_slave);
+	pn->link_slave = -1;
+	pn->link_up = 0;
+	pn->link_outlen = pn->rx_rawlen = 0;
+	link_later();
+}
+
+/* A TCP connect finished one way or the other */
+static void
+link_connected(int *fd)
+{
+	socklen_t len = sizeof(int);
+	int e = 0;
+
+	if (getsockopt(*fd, SOL_SOCKET, SO_ERROR, &e, &len) < 0 || e) {
+		warn("link: %s: %s\n", pn->link_uri, strerror(e ? e : errno));
+		link_down(fd);
+	} else {
+		link_ready();
+		if (link_watch(fd) < 0)
+			link_down(fd);
+	}
+	errno = errline = 0;
+}
+
+static void
+link_reopen(int *fd)
+{
+	if (*fd >= 0 || mono_ms() < pn->link_retry)
+		return;
+	if ((*fd = link_open()) < 0) {
+		warn("link: %s: %s, retrying in %u ms\n", pn->link_uri, strerror(errno), pn->link_backoff);
+		link_later();
+	} else {
+		if (pn->link_up)
+			link_ready();
+		if (link_watch(fd) < 0)
+			link_down(fd);
+	}
+	errno = errline = 0;
+}
+
+/* Write out what this round queued for the panel.  What the link does
+ * not take now goes with the next round.
+ */
+static void
+link_flush(int *fd)
+{
+	ssize_t n;
+
+	if (!pn->link_up || !pn->link_outlen)
+		return;
+	if ((n = write(*fd, pn->link_out, pn->link_outlen)) < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			warn("link write: %s\n", strerror(errno));
+			link_down(fd);
+		} else {
+			st.link_stalls++;
+		}
+		errno = 0;
+		return;
+	}
+	if (n < pn->link_outlen)
+		st.link_stalls++;
+	stat_hist_add(&st.link_wait, mono_us() - pn->link_out_at);
+	PROBE(link_write, n, mono_us() - pn->link_out_at);
+	pn->link_outlen -= n;
+	memmove(pn->link_out, pn->link_out + n, pn->link_outlen);
+}
+
+static void
+caddx_parse(int fd, const struct caddx_view *v)
+{
+	const uint8_t *ident = v->msg + 1;
+
+	warn("%s: %s\n", __func__, v->info->name);
+#ifdef HEXDUMP
+	if (loglevel >= 2)
+		hexdump((uint8_t *)v->msg, v->len);
+#endif
+
+	switch (caddx_type(v)) {
+	case CADDX_IFACE_CFG:
+		err("%s: NX version %.*s up, caps: %02x %02x %02x %02x %02x %02x\n",
+		    pn->link_uri, 4, ident, ident[4], ident[5], ident[6], ident[7], ident[8], ident[9]);
+		pn->synced = 1;
+		names_check(ident);
+		break;
+	case CADDX_ZONE_NAME:
+	case CADDX_FAILED:
+	case CADDX_REJECTED:
+		names_rx(v);
+		break;
+	case CADDX_LOG_EVENT:
+		log_rx(v);
+		break;
+	}
+}
+
+/* Handle n bytes read from the tty */
+static void
+caddx_rx_feed(int fd, uint8_t *data, uint32_t n)
+{
+	struct caddx_view v;
+	uint8_t buf[128];
+	int i;
+
+	debug("  read %u bytes from tty\n", n);
+	st.rx_bytes += n;
+	pn->rx_now = mono_us();
+	PROBE(rx_read, n);
+#ifdef HEXDUMP
+	if (loglevel >= 2)
+		hexdump(data, n);
+#endif
+	if (n > sizeof(pn->rx_raw) - pn->rx_rawlen) {
+		/* Nothing in there can still become a frame we accept */
+		warn("rx overrun, dropping %u bytes\n", pn->rx_rawlen);
+		st.rx_overrun += pn->rx_rawlen;
+		pn->rx_rawlen = 0;
+	}
+	if (!pn->rx_rawlen)
+		pn->rx_at = pn->rx_now;
+	memcpy(pn->rx_raw + pn->rx_rawlen, data, n);
+	pn->rx_rawlen += n;
+
+	while ((i = caddx_rx_pkt(fd, buf, sizeof(buf))) != 0) {
+		if (i < 0)
+			continue;
+		/* Clients get it either way, the bridge only goes by what it
+		 * can make sense of.
+		 */
+		if (caddx_decode(&v, buf + 1, buf[0]) == 0)
+			caddx_parse(fd, &v);
+		else if (errno == EBADMSG) {
+			warn("rx: malformed %s, %u bytes\n",
+			     caddx_msg_info(buf[1])->name, buf[0]);
+			st.rx_malformed++;
+		}
+	}
+	errno = errline = 0;
+}
+
+#ifdef CONFIG_STATIC_MEM
+#define STATIC_OPTS	"F:"
+#define STATIC_USAGE	"-F ...: Frames buffered for all clients together (default " __str(DEFAULT_MAX_FRAMES) ")\n"
+#else
+#define STATIC_OPTS	""
+#define STATIC_USAGE	""
+#endif
+
+static void
+usage(void)
+{
+	printf("\
+Usage: caddx [flags]\n\
+-b ...: Baud (default " __str(DEFAULT_BAUD) ")\n\
+-C ...: Max clients from one host (default no limit)\n\
+-c ...: Max clients (default " __str(DEFAULT_MAX_CLIENTS) ", at most " __str(CADDX_MAX_CLIENTS) ")\n\
+-e ...: Serve status changes as lines of JSON at HOST:PORT\n\
+" STATIC_USAGE "\
+-f    : Run in foreground\n\
+-H ...: KiB kept for the event history (default " __str(DEFAULT_HIST_KB) ", 0: none)\n\
+-L ...: Download the panel's event log to file ...\n\
+-l ...: Listen to HOST:PORT (default " DEFAULT_LISTEN ")\n\
+-M ...: Send multicast from the interface with this IPv4 address\n\
+-m ...: Publish panel messages to multicast GROUP:PORT (IPv4)\n\
+-N ...: Keep the zone names in file ...\n\
+-r ...: [HOST=]RATE[:BURST]: Limit clients (from HOST) to RATE frames/s\n\
+-s ...: Save the panel state to file ... and start from it\n\
+-t ...: Panel link: a tty, pty:[PATH] or tcp://HOST:PORT (default " DEFAULT_TTYNAME ")\n\
+        Each -t after the first adds a panel, up to " __str(CADDX_MAX_PANELS) "; -L, -N and -s\n\
+        given after a -t are for its panel\n\
+-U ...: Take over from the caddx at Unix socket ..., then wait there for the next\n\
+-u    : Use io_uring for I/O when available\n\
+-v    : Increase verbosity\n\
+-w ...: Serve statistics for Prometheus at HOST:PORT, SIGUSR1 logs them\n\
+");
+}
+
+static void caddx_signal(int signum)
+{
+	if (signum == SIGINT || signum == SIGTERM)
+		quit = 1;
+	else if (signum == SIGUSR1)
+		stats_dump = 1;
+}
+
+/* Whether a and b are the same host, ports aside */
+static int
+same_host(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return 0;
+	if (a->ss_family == AF_INET)
+		return ((struct sockaddr_in *)a)->sin_addr.s_addr ==
+			((struct sockaddr_in *)b)->sin_addr.s_addr;
+	if (a->ss_family == AF_INET6)
+		return !memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+			       &((struct sockaddr_in6 *)b)->sin6_addr,
+			       sizeof(struct in6_addr));
+	return 1;
+}
+
+/* -r [HOST=]RATE[:BURST] */
+static int
+tx_limit_add(char *arg)
+{
+	struct tx_limit *lim = &tx_limits[tx_nlimits];
+	struct addrinfo gai = { 0 }, *ai;
+	char *p;
+
+	if (tx_nlimits == TX_MAX_LIMITS) {
+		errno = ENOSPC;
+		return -1;
+	}
+	memset(lim, 0, sizeof(*lim));
+	if ((p = strchr(arg, '='))) {
+		*(p++) = 0;
+		gai.ai_flags = AI_NUMERICHOST;
+		if (getaddrinfo(arg, NULL, &gai, &ai) != 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(&lim->addr, ai->ai_addr, ai->ai_addrlen);
+		freeaddrinfo(ai);
+		arg = p;
+	}
+	lim->rate = strtoul(arg, &p, 0);
+	lim->burst = (*p == ':') ? strtoul(p + 1, NULL, 0) : lim->rate;
+	if (!lim->rate || !lim->burst) {
+		errno = EINVAL;
+		return -1;
+	}
+	tx_nlimits++;
+	return 0;
+}
+
+/* Pick the rate limit for cl, one for its host before the default */
+static void
+client_limit(struct caddx_client *cl)
+{
+	uint32_t i;
+
+	cl->src.lim = NULL;
+	for (i = 0; i < tx_nlimits; i++) {
+		if (tx_limits[i].addr.ss_family == AF_UNSPEC) {
+			if (!cl->src.lim)
+				cl->src.lim = &tx_limits[i];
+		} else if (same_host(&tx_limits[i].addr, &cl->addr)) {
+			cl->src.lim = &tx_limits[i];
+			break;
+		}
+	}
+	if (cl->src.lim) {
+		cl->src.tokens = cl->src.lim->burst * 1000;
+		cl->src.refill = mono_ms();
+	}
+}
+
+/* A client on the listener, or with stream set on that of -e */
+static int
+handle_connect(int cfd, int stream)
+{
+	struct caddx_client *cl = NULL, *p;
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	uint32_t n = 0;
+
+	errno = 0;
+	memset(&addr, 0, sizeof(addr));
+	getpeername(cfd, (struct sockaddr *)&addr, &addr_len);
+
+	if (max_per_host) {
+		for (p = client_tab; p < client_tab + client_hi; p++)
+			if (p->fd >= 0 && same_host(&p->addr, &addr))
+				n++;
+		if (n >= max_per_host) {
+			warn("refusing client %d: %u from the same host\n", cfd, n);
+			st.client_refused++;
+			ERR(EUSERS);
+		}
+	}
+	if (!(cl = client_new(cfd))) {
+		warn("refusing client %d: %u clients\n", cfd, nclients);
+		st.client_refused++;
+		ERR(EUSERS);
+	}
+	cl->subs = CADDX_SUB_EVENTS | CADDX_SUB_REPLIES;
+	cl->panel = panels;
+	cl->addr = addr;
+	cl->addr_len = addr_len;
+	client_limit(cl);
+	if (stream) {
+		cl->proto = PROTO_STREAM;
+		cl->subs = 0;
+		cl->hello = 1;
+	}
+
+	if (io_watch(cfd, IO_EV_READ, cl) < 0)
+		ERR(errno);
+	warn("%p: add %sclient %d\n", cl, stream ? "stream " : "", cl->fd);
+	st.client_connects++;
+
+	/* FALLTHROUGH */
+ error:
+	if (errno) {
+		close(cfd);
+		if (cl) client_release(cl);
+		return -1;
+	}
+	return 0;
+}
+
+/* Move cl to panel n.  It stays where it is if there is no such panel
+ * or it still waits for answers from the old one.  Returns the panel
+ * it is on.
+ */
+static uint8_t
+client_panel(struct caddx_client *cl, uint8_t n)
+{
+	struct caddx_panel *old = cl->panel;
+
+	if (n >= npanels || old == &panels[n])
+		;
+	else if (cl->src.queued || (old->tx_inflight && old->tx_inflight->cl == cl))
+		warn("%p: requests pending, staying on panel %ld\n", cl, (long)(old - panels));
+	else
+		cl->panel = &panels[n];
+	pn = cl->panel;
+	return pn - panels;
+}
+
+static int
+client_local(struct caddx_client *cl, uint16_t id, uint8_t *msg, uint8_t len)
+{
+	switch (msg[0]) {
+	case CADDX_HELLO: {
+		struct caddx_hello hello = { CADDX_HELLO, CADDX_PROTO_V1 };
+		uint8_t n = sizeof(hello) - 1;
+		if (len < n)
+			break;
+		if (((struct caddx_hello *)msg)->version < hello.version)
+			hello.version = ((struct caddx_hello *)msg)->version;
+		/* Only a client that asked for a panel hears which */
+		if (len > n) {
+			hello.panel = client_panel(cl, ((struct caddx_hello *)msg)->panel);
+			n++;
+		}
+		/* The answer still goes out in the framing the client used */
+		if (client_write(cl, id, &hello, n) < 0) {
+			caddx_rm_client(cl);
+			return -1;
+		}
+		cl->proto = hello.version;
+		if (cl->proto >= CADDX_PROTO_V1)
+			cl->subs = CADDX_SUB_EVENTS;
+		info("%p: client %d speaks v%d, panel %ld\n", cl, cl->fd, cl->proto,
+		     (long)(cl->panel - panels));
+		return 0;
+	}
+	case CADDX_SNAPSHOT: {
+		struct caddx_snapshot_end end = { CADDX_SNAPSHOT,
+			{ pn->mcast_seq >> 24, pn->mcast_seq >> 16, pn->mcast_seq >> 8, pn->mcast_seq },
+			pn->state_stale ? CADDX_SNAPSHOT_STALE : 0 };
+		int i;
+
+		for (i = 0; i < 256; i++)
+			if (pn->zone_seen[i][0] &&
+			    client_write(cl, id, pn->zone_seen[i] + 1, pn->zone_seen[i][0]) < 0)
+				goto snapshot_error;
+		for (i = 0; i < 256; i++)
+			if (pn->part_seen[i][0] &&
+			    client_write(cl, id, pn->part_seen[i] + 1, pn->part_seen[i][0]) < 0)
+				goto snapshot_error;
+		if (pn->sys_seen[0] && client_write(cl, id, pn->sys_seen + 1, pn->sys_seen[0]) < 0)
+			goto snapshot_error;
+		if (client_write(cl, id, &end, sizeof(end)) < 0) {
+ snapshot_error:
+			caddx_rm_client(cl);
+			return -1;
+		}
+		return 0;
+	}
+	case CADDX_HISTORY: {
+		struct caddx_history *req = (struct caddx_history *)msg;
+		uint32_t from, to, found[CADDX_CLIENT_QLEN], n = 0, max;
+		int more = 0;
+
+		if (len < sizeof(*req) || req->kind > CADDX_HIST_PART)
+			break;
+		from = caddx_be32(req->from);
+		to = caddx_be32(req->to);
+
+		/* Whatever would not fit the client's queue is left for later */
+		max = (cl->qlen < CADDX_CLIENT_QLEN) ? CADDX_CLIENT_QLEN - cl->qlen - 1 : 0;
+		if (pn->hist_len)
+			n = hist_find(req->kind * 256 + req->index, from, to, found, max, &more);
+		while (n--) {
+			struct caddx_hist *h = &pn->hist[found[n] % pn->hist_len];
+			uint8_t ev[sizeof(struct caddx_history_event) + sizeof(h->msg)] = {
+				CADDX_HISTORY_EVENT,
+				h->time >> 24, h->time >> 16, h->time >> 8, h->time };
+			memcpy(ev + sizeof(struct caddx_history_event), h->msg, h->len);
+			if (client_write(cl, id, ev, sizeof(struct caddx_history_event) + h->len) < 0)
+				goto history_error;
+		}
+		req->more = more;
+		if (client_write(cl, id, req, sizeof(*req)) < 0) {
+ history_error:
+			caddx_rm_client(cl);
+			return -1;
+		}
+		return 0;
+	}
+	case CADDX_NAMES_RESET:
+		names_reset();
+		if (client_write(cl, id, msg, 1) < 0) {
+			caddx_rm_client(cl);
+			return -1;
+		}
+		return 0;
+	case CADDX_SUBSCRIBE: {
+		struct caddx_subscribe sub = { CADDX_SUBSCRIBE };
+		uint8_t n = sizeof(sub) - 1;
+		if (len < n)
+			break;
+		cl->subs = sub.flags = ((struct caddx_subscribe *)msg)->flags &
+			(CADDX_SUB_EVENTS | CADDX_SUB_REPLIES);
+		if (len > n) {
+			sub.panel = client_panel(cl, ((struct caddx_subscribe *)msg)->panel);
+			n++;
+		}
+		if (client_write(cl, id, &sub, n) < 0) {
+			caddx_rm_client(cl);
+			return -1;
+		}
+		return 0;
+	}
+	}
+	warn("%p: unknown local message %02x\n", cl, msg[0]);
+	return 0;
+}
+
+static int
+client_frame(struct caddx_client *cl, uint8_t *buf, uint8_t len)
+{
+	uint8_t *msg = buf;
+	uint16_t id = 0;
+	int ret;
+
+	warn("%s: %d\n", __func__, len);
+#ifdef HEXDUMP
+	if (loglevel >= 2)
+		hexdump(buf, len);
+#endif
+
+	if (cl->proto >= CADDX_PROTO_V1) {
+		if (len < CADDX_ID_LEN) {
+			err("short frame from %d\n", cl->fd);
+			caddx_rm_client(cl);
+			return -1;
+		}
+		id = (buf[0] << 8) | buf[1];
+		msg += CADDX_ID_LEN;
+		len -= CADDX_ID_LEN;
+	}
+	if (!len)
+		return 0;
+
+	if (msg[0] & CADDX_LOCAL)
+		return client_local(cl, id, msg, len);
+	if ((ret = names_answer(cl, id, msg, len)))
+		return ret < 0 ? -1 : 0;
+	if (caddx_queue(cl, id, msg, len, caddx_tx_prio(msg[0])) < 0)
+		warn("%p: dropped frame: %s\n", cl, strerror(errno));
+	return 0;
+}
+
+/* Handle n bytes read from the client (n <= 0: EOF or -errno) */
+static int
+client_read(struct caddx_client *cl, uint8_t *data, int n)
+{
+	uint8_t *p;
+	uint32_t i;
+
+	if (n <= 0) {
+		err("failed read %d: %s\n", cl->fd, n ? strerror(-n) : "EOF");
+		caddx_rm_client(cl);
+		return -1;
+	}
+	debug("clread got %d from %d\n", n, cl->fd);
+	if (cl->proto == PROTO_STREAM)
+		return 0;
+
+	/* A partial frame leaves room for at least one more byte */
+	while (n > 0) {
+		i = sizeof(cl->rbuf) - cl->rlen;
+		if (i > (uint32_t)n)
+			i = n;
+		memcpy(cl->rbuf + cl->rlen, data, i);
+		cl->rlen += i;
+		data += i;
+		n -= i;
+
+		p = cl->rbuf;
+		while (cl->rlen && cl->rlen >= 1u + p[0]) {
+			if (client_frame(cl, p + 1, p[0]) < 0)
+				return -1;
+			cl->rlen -= 1 + p[0];
+			p += 1 + p[0];
+		}
+		memmove(cl->rbuf, p, cl->rlen);
+	}
+	return 0;
+}
+
+/* Statistics, served over HTTP at -w HOST:PORT and logged on SIGUSR1.
+ * One scrape is answered at a time; a new one replaces a pending one.
+ */
+static const struct stat_def stats_defs[] = {
+	{ "caddx_rx_bytes_total", STAT_COUNTER, &st.rx_bytes, "Bytes read from the panel" },
+	{ "caddx_rx_frames_total", STAT_COUNTER, &st.rx_frames, "Frames received from the panel" },
+	{ "caddx_rx_cksum_errors_total", STAT_COUNTER, &st.rx_cksum, "Frames from the panel with a bad checksum" },
+	{ "caddx_rx_cut_total", STAT_COUNTER, &st.rx_cut, "Frames from the panel cut short by a start byte" },
+	{ "caddx_rx_malformed_total", STAT_COUNTER, &st.rx_malformed, "Frames from the panel with a bad length or field" },
+	{ "caddx_rx_overrun_bytes_total", STAT_COUNTER, &st.rx_overrun, "Bytes from the panel dropped on overrun" },
+	{ "caddx_rx_naks_total", STAT_COUNTER, &st.rx_naks, "NAKs received from the panel" },
+	{ "caddx_tx_frames_total", STAT_COUNTER, &st.tx_frames, "Frames sent to the panel" },
+	{ "caddx_tx_bytes_total", STAT_COUNTER, &st.tx_bytes, "Bytes sent to the panel" },
+	{ "caddx_tx_escapes_total", STAT_COUNTER, &st.tx_escapes, "Escape bytes sent to the panel" },
+	{ "caddx_tx_acks_total", STAT_COUNTER, &st.tx_acks, "ACKs sent to the panel" },
+	{ "caddx_tx_naks_total", STAT_COUNTER, &st.tx_naks, "NAKs sent to the panel" },
+	{ "caddx_tx_timeouts_total", STAT_COUNTER, &st.tx_timeouts, "Requests the panel did not answer" },
+	{ "caddx_tx_limited_total", STAT_COUNTER, &st.tx_limited, "Client frames held back or refused by -r" },
+	{ "caddx_syncs_total", STAT_COUNTER, &st.syncs, "Sync attempts" },
+	{ "caddx_log_dropped_total", STAT_COUNTER, &log_dropped, "Log messages dropped on a full ring" },
+	{ "caddx_link_drops_total", STAT_COUNTER, &st.link_drops, "Times the panel link went down" },
+	{ "caddx_link_stalls_total", STAT_COUNTER, &st.link_stalls, "Writes the panel link did not take in full" },
+	{ "caddx_client_connects_total", STAT_COUNTER, &st.client_connects, "Clients accepted" },
+	{ "caddx_client_refused_total", STAT_COUNTER, &st.client_refused, "Clients refused by -c or -C" },
+	{ "caddx_client_drops_total", STAT_COUNTER, &st.client_drops, "Clients that went away or were dropped" },
+	{ "caddx_client_stalls_total", STAT_COUNTER, &st.client_stalls, "Client writes that had to wait for room" },
+	{ "caddx_nobufs_total", STAT_COUNTER, &st.nobufs, "Frames or requests dropped for want of memory" },
+	{ "caddx_stream_lines_total", STAT_COUNTER, &st.stream_lines, "Lines made for the decoded event stream" },
+	{ "caddx_clients", STAT_GAUGE, &st.clients, "Clients connected" },
+	{ "caddx_tx_queued", STAT_GAUGE, &st.queued, "Requests queued or in flight to the panel" },
+	{ "caddx_state_stale", STAT_GAUGE, &st.stale, "Statuses still to be confirmed by the panel" },
+	{ "caddx_link_up", STAT_GAUGE, &st.link, "Panel links up" },
+	{ "caddx_reply_ms", STAT_HIST, &st.reply_ms, "Time the panel took to answer a request" },
+	{ "caddx_client_queue", STAT_HIST, &st.client_qlen, "Frames queued per client write" },
+	{ "caddx_rx_wait_us", STAT_HIST, &st.rx_wait, "From the first byte of a frame to its last" },
+	{ "caddx_rx_parse_us", STAT_HIST, &st.rx_parse, "From the last byte of a frame to its checksum checked" },
+	{ "caddx_deliver_us", STAT_HIST, &st.deliver, "Handing a frame to the history and client queues" },
+	{ "caddx_client_us", STAT_HIST, &st.client, "From a frame queued for a client to it written to the socket" },
+	{ "caddx_link_wait_us", STAT_HIST, &st.link_wait, "From a frame for the panel queued to it written to the link" },
+};
+
+static char *stats_addr = NULL;
+static int stats_sfd = -1, stats_cfd = -1;
+
+/* The panel figures are summed over all panels */
+static void
+stats_update(void)
+{
+	struct caddx_panel *p;
+
+	st.clients = nclients;
+	st.queued = st.stale = st.link = 0;
+	for (p = panels; p < panels + npanels; p++) {
+		st.queued += p->tx_queued + (p->tx_inflight != NULL);
+		st.stale += p->state_stale;
+		st.link += p->link_up;
+	}
+}
+
+static int
+stats_listen(void)
+{
+	char addr[256];
+
+	if (strlen(stats_addr) >= sizeof(addr)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr, stats_addr);
+	return stats_sfd = listen_open(addr);
+}
+
+static void
+stats_close(void)
+{
+	if (stats_cfd >= 0) {
+		io_cancel(stats_cfd);
+		close(stats_cfd);
+		stats_cfd = -1;
+	}
+	if (stats_sfd >= 0) {
+		io_cancel(stats_sfd);
+		close(stats_sfd);
+		stats_sfd = -1;
+	}
+}
+
+static void
+stats_accept(int cfd)
+{
+	if (stats_cfd >= 0) {
+		io_cancel(stats_cfd);
+		close(stats_cfd);
+	}
+	stats_cfd = cfd;
+	if (io_watch(cfd, IO_EV_READ, &stats_cfd) < 0) {
+		close(cfd);
+		stats_cfd = -1;
+	}
+}
+
+/* The scraper sent its request, whatever it was */
+static void
+stats_answer(int res)
+{
+	if (res > 0) {
+		stats_update();
+		stats_serve(stats_cfd, stats_defs, ARRAY_SIZE(stats_defs));
+	}
+	io_cancel(stats_cfd);
+	close(stats_cfd);
+	stats_cfd = -1;
+	errno = 0;
+}
+
+/* Upgrades (-U).  A caddx started with the -U PATH of a running one
+ * connects there, and the running one hands over the listener, the panel
+ * links and its clients as SCM_RIGHTS, followed by everything that is not in
+ * the kernel: half received frames from the panel and clients, what is
+ * queued for either side, the request in flight and the state served to
+ * clients.  Then it exits, and the new caddx listens at PATH for the
+ * next upgrade.  Both ends are on the same host, so the state goes in
+ * native byte order; the version has to match exactly.
+ */
+#define UPGRADE_MAGIC	"CXUP"
+#define UPGRADE_VERSION	4
+#define UPGRADE_TIMEOUT	5	/* s */
+
+struct caddx_upgrade_hdr {
+	uint8_t magic[4];
+	uint8_t version;
+	uint8_t reserved[3];
+	uint32_t npanels;	/* link fds after the listener */
+	uint32_t nclients;	/* fds after the links */
+};
+
+/* Per panel, followed by rx_raw and the state served to clients.  Its
+ * requests and history come after the clients.
+ */
+struct caddx_upgrade_panel {
+	uint8_t synced;
+	uint8_t names_valid;
+	uint8_t reserved[2];
+	uint32_t ntx;		/* queued requests, the one in flight first */
+	uint32_t tx_left;	/* ms the one in flight has left, 0: none */
+	uint32_t mcast_seq;
+	uint32_t rx_rawlen;
+	uint32_t hist_len, hist_seq;
+};
+
+/* Per client, followed by rbuf and the queue entries */
+struct caddx_upgrade_client {
+	int32_t proto;
+	uint32_t subs;
+	uint32_t panel;
+	struct sockaddr_storage addr;
+	uint32_t addr_len;
+	uint32_t rlen;
+	uint32_t qlen, qoff;
+	uint32_t hello;		/* stream: where the first dump is at */
+};
+
+/* Per queue entry and request, followed by the message */
+struct caddx_upgrade_msg {
+	int32_t client;		/* order in the fds sent, -1: none */
+	uint16_t id;
+	uint8_t len;
+	uint8_t prio;		/* requests only */
+};
+
+static char *upgrade_path = NULL;
+static int upgrade_cfd = -1, upgrade_done = 0;
+
+static int
+upgrade_sock(struct sockaddr_un *sun)
+{
+	int ufd;
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(upgrade_path) >= sizeof(sun->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sun->sun_path, upgrade_path);
+	if ((ufd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	return ufd;
+}
 
-static void
-caddx_stuff(uint8_t *buf, uint8_t val, uint32_t *inc)
+static int
+upgrade_listen(void)
 {
-	*buf = val;
-	if (*buf == CADDX_START) {
-		(*buf)--;
-		*(buf + 1) = *buf ^ CADDX_START_ESC;
-		(*inc)++;
-	} else if (*buf == CADDX_START - 1) {
-		*(buf + 1) = *buf ^ CADDX_START_ESC;
-		(*inc)++;
+	struct sockaddr_un sun;
+	mode_t mask;
+	int ufd;
+
+	if ((ufd = upgrade_sock(&sun)) < 0)
+		return -1;
+	/* Whoever can connect gets the panel and every client */
+	unlink(upgrade_path);
+	mask = umask(077);
+	if (bind(ufd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(ufd, 1) < 0) {
+		umask(mask);
+		close(ufd);
+		return -1;
 	}
+	umask(mask);
+	return ufd;
 }
 
-static int
-caddx_tx(int fd, uint8_t *msg, uint32_t len)
+/* Make fd blocking, but never for longer than UPGRADE_TIMEOUT */
+static void
+upgrade_blocking(int fd)
 {
-	uint8_t *p = NULL;
-	uint32_t escs = 0, i, j = 0;
-	uint16_t cksum;
+	struct timeval tv = { UPGRADE_TIMEOUT, 0 };
 
-	warn("%s: %d\n", __func__, len);
-#ifdef HEXDUMP
-	if (loglevel >= 2)
-		hexdump(msg, len);
-#endif
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
 
-	for (p = msg; p < msg + len; p++)
-		if (*p == CADDX_START || *p == CADDX_START - 1)
-			escs++;
-	if (!(p = malloc(2 + len + escs + 2 + 2)))
-		ERR(ENOMEM);
-	p[0] = CADDX_START;
-	p[1] = len;
-	memcpy(p + 2, msg, len);
-	cksum = fletcher_cksum(p + 1, len + 1);
-
-	if (escs)
-		for (i = 0; i < len; i++)
-			caddx_stuff(&p[2 + i + j], msg[i], &j);
-
-	j = 0;
-	caddx_stuff(&p[2 + len + escs + 0 + j], cksum >> 8, &j);
-	caddx_stuff(&p[2 + len + escs + 1 + j], cksum & 0xff, &j);
-	len = 2 + len + escs + 2 + j;
+static int
+upgrade_write(int cfd, const void *buf, uint32_t len)
+{
+	if (full_write(cfd, (uint8_t *)buf, len, 1) != (int)len) {
+		if (!errno)
+			errno = EIO;
+		return -1;
+	}
+	return 0;
+}
 
-#if 0
-	printf("^^ tx:\n");
-	hexdump(p, len);
-#endif
+static int
+upgrade_read(int cfd, void *buf, uint32_t len)
+{
+	if (full_read(cfd, buf, len, 1) != (int)len) {
+		if (!errno)
+			errno = EIO;
+		return -1;
+	}
+	return 0;
+}
 
-	if (write(fd, p, len) != len)
-		ERR(EIO);
+static int
+upgrade_write_msg(int cfd, int32_t client, uint16_t id, uint8_t prio,
+		  uint8_t *msg, uint8_t len)
+{
+	struct caddx_upgrade_msg m = { client, id, len, prio };
 
-	/* FALLTHROUGH */
- error:
-	if (p) free(p);
-	if (errno)
+	if (upgrade_write(cfd, &m, sizeof(m)) < 0 || upgrade_write(cfd, msg, len) < 0)
 		return -1;
 	return 0;
 }
 
-static void
-caddx_rm_client(struct caddx_client *cl)
+static int
+upgrade_write_req(struct caddx_txreq *req, int *order)
 {
-	struct caddx_client *l;
+	return upgrade_write_msg(upgrade_cfd, req->cl ? order[req->cl - client_tab] : -1,
+				 req->id, req->prio, req->msg, req->len);
+}
 
-	warn("%p: rm client %d\n", cl, cl->fd);
-	close(cl->fd); /* TODO: Check retval? */
+/* The panel whose link data is the watch of, NULL if none */
+static struct caddx_panel *
+panel_of(void *data)
+{
+	struct caddx_panel *p;
 
-	if (cl == clients) {
-		clients = cl->next;
-		return;
-	}
-	for (l = clients; l && l->next != cl; l = l->next) {}
-	if (!l || l->next != cl)
-		err("corrupt client list %p/%p", l, l ? l->next : NULL);
-	l->next = cl->next;
-	free(cl);
+	for (p = panels; p < panels + npanels; p++)
+		if (data == &p->fd)
+			return p;
+	return NULL;
 }
 
 static int
-caddx_rx_bytes(int fd, uint8_t *buf, uint32_t len)
+handle_events(int *sfd, int *ufd)
 {
-	uint32_t _len = len;
-	for (; len; len--) {
-		if (full_read(fd, buf, 1, 0) < 0)
-			return -1;
-		debug("  read %02x\n", *buf);
-		if (*buf == CADDX_START - 1) {
-			if (full_read(fd, buf, 1, 0) < 0)
-				return -1;
-			debug("  read %02x\n", *buf);
-			*buf ^= CADDX_START_ESC;
+	struct caddx_panel *p;
+	struct io_event *ev;
+
+	while ((ev = io_next())) {
+		if ((p = panel_of(ev->data))) {
+			pn = p;
+			if (ev->type == IO_EV_WRITABLE) {
+				link_connected(&pn->fd);
+			} else if (ev->res <= 0) {
+				err("link read: %s: %s\n", pn->link_uri,
+				    ev->res ? strerror(-ev->res) : "EOF");
+				link_down(&pn->fd);
+			} else {
+				caddx_rx_feed(pn->fd, ev->buf, ev->res);
+			}
+		} else if (ev->data == sfd || ev->data == &stream_sfd) {
+			if (ev->res >= 0)
+				handle_connect(ev->res, ev->data == &stream_sfd);
+			errno = errline = 0;
+		} else if (ev->data == &stats_sfd) {
+			if (ev->res >= 0)
+				stats_accept(ev->res);
+		} else if (ev->data == &stats_cfd) {
+			stats_answer(ev->res);
+		} else if (ev->data == ufd) {
+			if (ev->res < 0)
+				continue;
+			if (upgrade_cfd >= 0) {
+				close(ev->res);
+				continue;
+			}
+			info("upgrade: new caddx connected\n");
+			upgrade_cfd = ev->res;
+		} else if (ev->type == IO_EV_WRITABLE) {
+			((struct caddx_client *)ev->data)->wwait = 0;
+		} else {
+			pn = ((struct caddx_client *)ev->data)->panel;
+			client_read(ev->data, ev->buf, ev->res);
 		}
-		buf++;
 	}
-	return _len;
+	return 0;
 }
 
-#define _CADDX_RX(len, add) do { \
-	debug("read %d @%d\n", len, __LINE__); \
-	if (caddx_rx_bytes(fd, buf + done, len) != len) \
-		ERR(errno); \
-	done += (add); \
-} while (0)
-#define CADDX_RX(len) do { \
-	typeof(len) __len = (len); \
-	_CADDX_RX(__len, __len); \
-} while (0)
-
+/* Hand everything over to the caddx on upgrade_cfd, returns 0 once it
+ * has taken over.  On failure this one just carries on.
+ */
 static int
-caddx_rx_pkt(int fd, uint8_t *buf, uint32_t maxlen)
+upgrade_send(int *sfd, int *ufd)
 {
-	int done = 0, len, _len;
-	uint16_t cksum;
+	struct caddx_upgrade_hdr hdr = { UPGRADE_MAGIC, UPGRADE_VERSION };
+	union {
+		struct cmsghdr h;
+		uint8_t buf[CMSG_SPACE(sizeof(int) * (1 + CADDX_MAX_PANELS + CADDX_MAX_CLIENTS))];
+	} cm;
+	int fds[1 + CADDX_MAX_PANELS + CADDX_MAX_CLIENTS], order[CADDX_MAX_CLIENTS];
+	struct iovec iov = { &hdr, sizeof(hdr) };
+	struct msghdr mh = { 0 };
+	struct caddx_txreq *req;
 	struct caddx_client *cl;
-	struct caddx_msg *msg;
-
-	buf[0] = 0;
-	while (buf[0] != CADDX_START && !quit)
-		_CADDX_RX(1, 0);
-
-	if (quit)
-		ERR(EINTR);
+	struct caddx_panel *p;
+	uint32_t n = 0, i, nfds;
+	uint8_t ack;
+	int j;
+
+	/* The new caddx opens its own, on the same addresses */
+	stats_close();
+	if (stream_sfd >= 0) {
+		io_cancel(stream_sfd);
+		close(stream_sfd);
+		stream_sfd = -1;
+	}
 
-	CADDX_RX(1);
-	_len = len = buf[0];
+	/* Nothing may read from or accept on the fds any more, but what
+	 * was already taken still has to be dealt with.
+	 */
+	while ((j = io_stop()) != 0) {
+		if (j < 0 || handle_events(sfd, ufd) < 0)
+			goto error;
+	}
+	/* The new caddx gets the links as they are, with nothing left to write */
+	for (p = panels; p < panels + npanels; p++) {
+		pn = p;
+		link_flush(&p->fd);
+		if (!p->link_up || p->link_outlen) {
+			errno = EAGAIN;
+			goto error;
+		}
+	}
+	upgrade_blocking(upgrade_cfd);
 
-	if (len > maxlen - 3)
-		ERR(EINVAL);
+	fds[0] = *sfd;
+	for (i = 0; i < npanels; i++)
+		fds[1 + i] = panels[i].fd;
+	for (cl = client_tab; cl < client_tab + client_hi; cl++) {
+		if (cl->fd < 0)
+			continue;
+		order[cl - client_tab] = n;
+		fds[1 + npanels + n++] = cl->fd;
+	}
+	hdr.npanels = npanels;
+	hdr.nclients = n;
+	nfds = 1 + npanels + n;
+
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cm.buf;
+	mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+	memset(cm.buf, 0, sizeof(cm.buf));
+	cm.h.cmsg_level = SOL_SOCKET;
+	cm.h.cmsg_type = SCM_RIGHTS;
+	cm.h.cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+	memcpy(CMSG_DATA(&cm.h), fds, sizeof(int) * nfds);
+	if (sendmsg(upgrade_cfd, &mh, MSG_NOSIGNAL) != sizeof(hdr))
+		goto error;
 
-	CADDX_RX(len);
-	_CADDX_RX(2, 0);
+	for (p = panels; p < panels + npanels; p++) {
+		struct caddx_upgrade_panel up = { p->synced, p->names_valid };
 
-	cksum = fletcher_cksum(buf, _len + 1);
+		up.ntx = p->tx_queued;
+		if (p->tx_inflight) {
+			uint64_t now = mono_ms();
+			up.ntx++;
+			up.tx_left = (p->tx_deadline > now) ? p->tx_deadline - now : 1;
+		}
+		up.mcast_seq = p->mcast_seq;
+		up.rx_rawlen = p->rx_rawlen;
+		up.hist_len = p->hist_len;
+		up.hist_seq = p->hist_seq;
+		if (upgrade_write(upgrade_cfd, &up, sizeof(up)) < 0 ||
+		    upgrade_write(upgrade_cfd, p->rx_raw, p->rx_rawlen) < 0 ||
+		    upgrade_write(upgrade_cfd, p->zone_seen, sizeof(p->zone_seen)) < 0 ||
+		    upgrade_write(upgrade_cfd, p->part_seen, sizeof(p->part_seen)) < 0 ||
+		    upgrade_write(upgrade_cfd, p->sys_seen, sizeof(p->sys_seen)) < 0 ||
+		    upgrade_write(upgrade_cfd, p->zone_stale, sizeof(p->zone_stale)) < 0 ||
+		    upgrade_write(upgrade_cfd, p->part_stale, sizeof(p->part_stale)) < 0 ||
+		    upgrade_write(upgrade_cfd, &p->sys_stale, sizeof(p->sys_stale)) < 0)
+			goto error;
+	}
 
-	if (!buf[0])
-		goto error;
+	for (cl = client_tab; cl < client_tab + client_hi; cl++) {
+		struct caddx_upgrade_client c = { cl->proto, cl->subs, cl->panel - panels };
 
-	if (cksum >> 8 != buf[done] || (cksum & 0xff) != buf[done + 1]) {
-		uint8_t nak = CADDX_NAK;
-		caddx_tx(fd, &nak, 1);
-		warn("bad cksum: %02x%02x vs %04x\n", buf[done], buf[done + 1 ], cksum);
-		ERR(EPROTO);
+		if (cl->fd < 0)
+			continue;
+		c.addr = cl->addr;
+		c.addr_len = cl->addr_len;
+		c.rlen = cl->rlen;
+		c.qlen = cl->qlen;
+		c.qoff = cl->qoff;
+		c.hello = cl->hello;
+		if (upgrade_write(upgrade_cfd, &c, sizeof(c)) < 0 ||
+		    upgrade_write(upgrade_cfd, cl->rbuf, cl->rlen) < 0)
+			goto error;
+		for (i = 0; i < cl->qlen; i++) {
+			struct caddx_qent *e = &cl->q[(cl->qhead + i) % CADDX_CLIENT_QLEN];
+			uint16_t id = (e->hlen > 1) ? (e->hdr[1] << 8) | e->hdr[2] : 0;
+			if (upgrade_write_msg(upgrade_cfd, -1, id, 0, e->f->msg, e->f->len) < 0)
+				goto error;
+		}
 	}
 
-	msg = (struct caddx_msg *)(buf + 1);
-	if (msg->ack) {
-		uint8_t ack = CADDX_ACK;
-		caddx_tx(fd, &ack, 1);
+	for (p = panels; p < panels + npanels; p++) {
+		pn = p;
+		if (p->tx_inflight && upgrade_write_req(p->tx_inflight, order) < 0)
+			goto error;
+		for (i = 0; i <= client_hi; i++) {
+			struct caddx_txsrc *src = txsrc_at(i);
+			for (j = 0; src && j < TX_PRIO_N; j++)
+				for (req = src->q[j]; req; req = req->next)
+					if (upgrade_write_req(req, order) < 0)
+						goto error;
+		}
+
+		if (p->hist_len &&
+		    (upgrade_write(upgrade_cfd, p->hist, p->hist_len * sizeof(*p->hist)) < 0 ||
+		     upgrade_write(upgrade_cfd, p->hist_last, sizeof(p->hist_last)) < 0))
+			goto error;
 	}
 
-	for (cl = clients; cl; cl = cl->next)
-		if (full_write(cl->fd, buf, 1 + buf[0], 1) < 0)
-			caddx_rm_client(cl);
+	/* Once it says so, the fds are the new caddx's */
+	if (upgrade_read(upgrade_cfd, &ack, 1) < 0 || ack != 1)
+		goto error;
+	err("upgrade: handed over %u panels, %u clients\n", npanels, n);
+	upgrade_done = 1;
+	return 0;
 
-	/* FALLTHROUGH */
  error:
-	if (errno)
-		return -1;
-	return 0;
+	err("upgrade failed: %s\n", strerror(errno ? errno : EIO));
+	close(upgrade_cfd);
+	upgrade_cfd = -1;
+	if (stats_addr && (stats_listen() < 0 || io_watch(stats_sfd, IO_EV_ACCEPT, &stats_sfd) < 0))
+		err("stats: %s: %s\n", stats_addr, strerror(errno));
+	if (stream_addr && stream_sfd < 0 &&
+	    ((stream_sfd = listen_open(stream_addr)) < 0 ||
+	     io_watch(stream_sfd, IO_EV_ACCEPT, &stream_sfd) < 0))
+		err("stream: %s: %s\n", stream_addr, strerror(errno));
+	errno = errline = 0;
+	return -1;
 }
 
-struct baud_rate {
-	uint32_t target;
-	uint32_t def;
-};
-
-static const struct baud_rate baud_rates[] =
-{
-        { 115200, B115200 },
-        {  57600,  B57600 },
-        {  38400,  B38400 },
-        {  19200,  B19200 },
-        {   9600,   B9600 },
-        {   4800,   B4800 },
-        {   2400,   B2400 },
-        {   1200,   B1200 },
-        {    300,    B300 },
-};
-
-static struct termios tio_old;
-
 static int
-serial_init(int fd)
+upgrade_recv_msg(int cfd, struct caddx_upgrade_msg *m, uint8_t *msg)
 {
-	struct termios tio;
-	uint32_t i;
-
-	errno = 0;
-	tcgetattr(fd, &tio_old);
-
-	for (i = 0; i < ARRAY_SIZE(baud_rates); i++)
-		if (baud_rates[i].target == baud)
-			break;
-	if (i == ARRAY_SIZE(baud_rates))
-		ERR(EINVAL);
-	i = baud_rates[i].def;
-
-	memset(&tio, 0, sizeof(tio));
-	tio.c_cflag = i | CS8 | CLOCAL | CREAD; /* TODO: Make CS8 modifiable */
-	tio.c_iflag = IGNPAR; /* TODO: Make modifiable */
-	tio.c_cc[VTIME] = 0;
-	tio.c_cc[VMIN] = 1;
-
-	if (tcflush(fd, TCIFLUSH) < 0)
-		ERR(errno);
-
-	if (tcsetattr(fd, TCSANOW, &tio) < 0)
-		ERR(errno);
-
-	/* FALLTHROUGH */
- error:
-	if (errno)
+	if (upgrade_read(cfd, m, sizeof(*m)) < 0 ||
+	    upgrade_read(cfd, msg, m->len) < 0)
 		return -1;
 	return 0;
 }
 
+/* Take over from the caddx at upgrade_path.  Returns 1 if it did, 0 if
+ * there is none.
+ */
 static int
-caddx_parse(int fd, uint8_t *buf, uint32_t len)
+upgrade_recv(int *sfd)
 {
-	struct caddx_msg *msg = (struct caddx_msg *)buf;
+	struct caddx_upgrade_hdr hdr;
+	struct caddx_upgrade_panel up[CADDX_MAX_PANELS];
+	union {
+		struct cmsghdr h;
+		uint8_t buf[CMSG_SPACE(sizeof(int) * (1 + CADDX_MAX_PANELS + CADDX_MAX_CLIENTS))];
+	} cm;
+	int fds[1 + CADDX_MAX_PANELS + CADDX_MAX_CLIENTS], cfd = -1, nfds = 0;
+	struct iovec iov = { &hdr, sizeof(hdr) };
+	struct msghdr mh = { 0 };
+	struct caddx_client *cl, *order[CADDX_MAX_CLIENTS];
+	struct caddx_upgrade_msg m;
+	struct sockaddr_un sun;
+	uint8_t msg[255], ack = 1;
+	uint32_t i, j, k;
 
-	warn("%s: %d\n", __func__, len);
-#ifdef HEXDUMP
-	if (loglevel >= 2)
-		hexdump(buf, len);
-#endif
+	errno = 0;
+	if ((cfd = upgrade_sock(&sun)) < 0)
+		ERR(errno);
+	if (connect(cfd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		/* Nobody to take over from */
+		if (errno == ENOENT || errno == ECONNREFUSED) {
+			close(cfd);
+			errno = 0;
+			return 0;
+		}
+		ERR(errno);
+	}
+	upgrade_blocking(cfd);
+
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cm.buf;
+	mh.msg_controllen = sizeof(cm.buf);
+	if (recvmsg(cfd, &mh, MSG_CMSG_CLOEXEC) != sizeof(hdr))
+		ERR(errno ? errno : EPROTO);
+	if (CMSG_FIRSTHDR(&mh) && cm.h.cmsg_level == SOL_SOCKET &&
+	    cm.h.cmsg_type == SCM_RIGHTS) {
+		nfds = (cm.h.cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(&cm.h), nfds * sizeof(int));
+	}
+	/* Every panel has to be there again, in the same order */
+	if (memcmp(hdr.magic, UPGRADE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != UPGRADE_VERSION || (mh.msg_flags & MSG_CTRUNC) ||
+	    hdr.npanels != npanels || nfds != (int)(1 + hdr.npanels + hdr.nclients))
+		ERR(EPROTO);
+	if (hdr.nclients > max_clients)
+		ERR(EUSERS);
 
-	switch (msg->type) {
-	case CADDX_IFACE_CFG:
-		if (len != 11)
-			return -1;
-		err("NX version %.*s up, caps: %02x %02x %02x %02x %02x %02x\n", 4, buf + 1,
-			buf[5], buf[6], buf[7], buf[8], buf[9], buf[10]);
-		synced = 1;
-		break;
+	for (k = 0; k < npanels; k++) {
+		pn = &panels[k];
+		if (upgrade_read(cfd, &up[k], sizeof(up[k])) < 0)
+			ERR(errno);
+		if (up[k].rx_rawlen > sizeof(pn->rx_raw))
+			ERR(EPROTO);
+		if (upgrade_read(cfd, pn->rx_raw, up[k].rx_rawlen) < 0 ||
+		    upgrade_read(cfd, pn->zone_seen, sizeof(pn->zone_seen)) < 0 ||
+		    upgrade_read(cfd, pn->part_seen, sizeof(pn->part_seen)) < 0 ||
+		    upgrade_read(cfd, pn->sys_seen, sizeof(pn->sys_seen)) < 0 ||
+		    upgrade_read(cfd, pn->zone_stale, sizeof(pn->zone_stale)) < 0 ||
+		    upgrade_read(cfd, pn->part_stale, sizeof(pn->part_stale)) < 0 ||
+		    upgrade_read(cfd, &pn->sys_stale, sizeof(pn->sys_stale)) < 0)
+			ERR(errno);
+		pn->rx_rawlen = up[k].rx_rawlen;
+		for (i = 0; i < 256; i++)
+			pn->state_stale += pn->zone_stale[i] + pn->part_stale[i];
+		pn->state_stale += pn->sys_stale;
 	}
-	return 0;
-}
 
-static void
-usage(void)
-{
-	printf("\
-Usage: caddx [flags]\n\
--b ...: Baud (default " __str(DEFAULT_BAUD) ")\n\
--f    : Run in foreground\n\
--l ...: Listen to HOST:PORT (default " DEFAULT_LISTEN ")\n\
--t ...: TTY name (default " DEFAULT_TTYNAME ")\n\
--v    : Increase verbosity\n\
-");
-}
+	for (i = 0; i < hdr.nclients; i++) {
+		struct caddx_upgrade_client c;
 
-static void caddx_signal(int signum)
-{
-	if (signum == SIGINT)
-		quit = 1;
-}
+		if (upgrade_read(cfd, &c, sizeof(c)) < 0)
+			ERR(errno);
+		if (c.rlen > sizeof(cl->rbuf) || c.qlen > CADDX_CLIENT_QLEN ||
+		    c.panel >= npanels)
+			ERR(EPROTO);
+		cl = order[i] = client_new(fds[1 + npanels + i]);
+		cl->proto = c.proto;
+		cl->subs = c.subs;
+		cl->panel = &panels[c.panel];
+		cl->addr = c.addr;
+		cl->addr_len = c.addr_len;
+		cl->rlen = c.rlen;
+		cl->hello = c.hello;
+		client_limit(cl);
+		if (upgrade_read(cfd, cl->rbuf, cl->rlen) < 0)
+			ERR(errno);
+		for (j = 0; j < c.qlen; j++)
+			if (upgrade_recv_msg(cfd, &m, msg) < 0 ||
+			    client_write(cl, m.id, msg, m.len) < 0)
+				ERR(errno);
+		cl->qoff = c.qoff;
+	}
 
-static int
-can_read(int fd)
-{
-	fd_set rfds;
-	struct timeval tv = { 0 };
-	FD_ZERO(&rfds);
-	FD_SET(fd, &rfds);
-	return select(fd + 1, &rfds, NULL, NULL, &tv) > 0;
-}
+	for (k = 0; k < npanels; k++) {
+		pn = &panels[k];
+		for (i = 0; i < up[k].ntx; i++) {
+			if (upgrade_recv_msg(cfd, &m, msg) < 0)
+				ERR(errno);
+			if (m.client >= (int32_t)hdr.nclients || m.prio >= TX_PRIO_N ||
+			    (m.client >= 0 && order[m.client]->panel != pn))
+				ERR(EPROTO);
+			if (caddx_queue(m.client >= 0 ? order[m.client] : NULL, m.id, msg, m.len, m.prio) < 0)
+				ERR(errno);
+			/* The first one is the one in flight, if any */
+			if (!i && up[k].tx_left) {
+				pn->tx_inflight = caddx_tx_pick();
+				pn->tx_deadline = mono_ms() + up[k].tx_left;
+			}
+		}
 
-static int
-handle_connect(int sfd)
-{
-	struct timeval timeout = { 0 };
-	struct caddx_client *cl = malloc(sizeof(*cl)), *p;
-	errno = 0;
-	if (!cl)
-		ERR(ENOMEM);
+		if (up[k].hist_len == pn->hist_len) {
+			if (pn->hist_len &&
+			    (upgrade_read(cfd, pn->hist, pn->hist_len * sizeof(*pn->hist)) < 0 ||
+			     upgrade_read(cfd, pn->hist_last, sizeof(pn->hist_last)) < 0))
+				ERR(errno);
+			pn->hist_seq = up[k].hist_seq;
+		} else if (up[k].hist_len) {
+			/* Another -H, start with an empty history */
+			warn("upgrade: dropping the history of %s\n", pn->link_uri);
+			for (i = 0; i < up[k].hist_len * sizeof(*pn->hist) + sizeof(pn->hist_last); i += j) {
+				j = up[k].hist_len * sizeof(*pn->hist) + sizeof(pn->hist_last) - i;
+				if (j > sizeof(msg))
+					j = sizeof(msg);
+				if (upgrade_read(cfd, msg, j) < 0)
+					ERR(errno);
+			}
+		}
 
-	memset(cl, 0, sizeof(*cl));
-	if ((cl->fd = accept(sfd, &cl->addr, &cl->addr_len)) < 0)
+		pn->synced = up[k].synced;
+		pn->names_valid = up[k].names_valid && pn->names_count;
+		pn->mcast_seq = up[k].mcast_seq;
+	}
+	if (upgrade_write(cfd, &ack, 1) < 0)
 		ERR(errno);
+	close(cfd);
 
-	timeout.tv_sec = 5;
-	setsockopt(cl->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-	setsockopt(cl->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	*sfd = fds[0];
+	for (k = 0; k < npanels; k++)
+		panels[k].fd = fds[1 + k];
+	err("upgrade: took over %u panels, %u clients\n", npanels, hdr.nclients);
+	return 1;
 
-	if (!clients)
-		clients = cl;
-	else {
-		for (p = clients; p->next; p = p->next) {}
-		p->next = cl;
-	}
-	warn("%p: add client %d\n", cl, cl->fd);
-
-	/* FALLTHROUGH */
  error:
-	if (errno) {
-		if (cl) free(cl);
-		return -1;
-	}
-	return 0;
+	for (i = 0; i < (uint32_t)nfds; i++)
+		close(fds[i]);
+	if (cfd >= 0)
+		close(cfd);
+	return -1;
 }
 
+/* Add a panel at uri and point pn at it */
 static int
-client_read(int fd, struct caddx_client *cl)
+panel_new(char *uri)
 {
-	uint8_t len, buf[128];
+	struct caddx_panel *p;
 
-	debug("%p: clread from %d\n", cl, cl->fd);
-	if (full_read(cl->fd, &len, 1, 1) < 0 ||
-	    len > sizeof(buf)) {
-		err("failed read %d\n", cl->fd);
-		caddx_rm_client(cl);
+	if (npanels == CADDX_MAX_PANELS) {
+		errno = EMLINK;
 		return -1;
 	}
-	debug("clread %d\n", len);
-
-	if (full_read(cl->fd, buf, len, 1) < 0) {
-		err("failed read2 %d\n", cl->fd);
-		caddx_rm_client(cl);
+	if (!(p = realloc(panels, (npanels + 1) * sizeof(*panels)))) {
+		errno = ENOMEM;
 		return -1;
 	}
-	debug("clread got %d\n", len);
-	warn("%s: %d\n", __func__, len);
-#ifdef HEXDUMP
-	if (loglevel >= 2)
-		hexdump(buf, len);
-#endif
-
-	caddx_tx(fd, buf, len);
+	panels = p;
+	pn = &panels[npanels++];
+	memset(pn, 0, sizeof(*pn));
+	pn->fd = pn->link_slave = pn->log_fd = -1;
+	pn->link_uri = uri;
+	pn->link_backoff = LINK_RETRY_MIN;
 	return 0;
 }
 
 int
 main(int argc, char *argv[])
 {
-	int fd = -1, i, sfd = -1, max_fd = 0;
-	char *ttyname = DEFAULT_TTYNAME, *listen_to = strdup(DEFAULT_LISTEN), *port;
-	uint8_t buf[128];
-	fd_set fds;
-	struct timeval tv;
+	int i, sfd = -1, ufd = -1, use_uring = 0, upgraded = 0, linked = 0, hello = 0;
+	uint32_t hist_kb = DEFAULT_HIST_KB;
+	char *listen_to = strdup(DEFAULT_LISTEN);
+	char *mcast_group = NULL, *mcast_if = NULL;
+	struct caddx_client *cl;
+	struct caddx_panel *p;
 	struct sigaction action;
-	struct addrinfo gai = { 0 }, *ai, *pai;
 
-	while ((i = getopt(argc, argv, "b:fhl:t:v")) != -1) {
+	/* Until a -t says otherwise */
+	if (panel_new(DEFAULT_TTYNAME) < 0)
+		ERR(errno);
+
+	while ((i = getopt(argc, argv, "b:C:c:e:" STATIC_OPTS "fH:hL:l:M:m:N:r:s:t:U:uvw:")) != -1) {
 		switch (i) {
 		case 'b': baud = strtol(optarg, NULL, 0); break;
+		case 'C': max_per_host = strtoul(optarg, NULL, 0); break;
+		case 'c': max_clients = strtoul(optarg, NULL, 0); break;
+		case 'e': stream_addr = optarg; break;
+#ifdef CONFIG_STATIC_MEM
+		case 'F': max_frames = strtoul(optarg, NULL, 0); break;
+#endif
 		case 'f': fg = 1; break;
+		case 'H': hist_kb = strtoul(optarg, NULL, 0); break;
+		case 'L': pn->log_path = optarg; break;
 		case 'l': free(listen_to); listen_to = strdup(optarg); break;
-		case 't': ttyname = optarg; break;
+		case 'M': mcast_if = optarg; break;
+		case 'm': mcast_group = optarg; break;
+		case 'N': pn->names_path = optarg; break;
+		case 'r':
+			if (tx_limit_add(optarg) < 0)
+				ERR(errno);
+			break;
+		case 's': pn->state_path = optarg; break;
+		case 't':
+			if (linked++ && panel_new(optarg) < 0)
+				ERR(errno);
+			pn->link_uri = optarg;
+			break;
+		case 'U': upgrade_path = optarg; break;
+		case 'u': use_uring = 1; break;
 		case 'v': loglevel++; break;
+		case 'w': stats_addr = optarg; break;
 		default: usage(); exit(-1);
 		}
 	}
 
+	if (!max_clients || max_clients > CADDX_MAX_CLIENTS)
+		ERR(EINVAL);
+	if (client_tab_init() < 0)
+		ERR(errno);
+#ifdef CONFIG_STATIC_MEM
+	if (!max_frames)
+		ERR(EINVAL);
+	if (pool_init(&frame_pool, sizeof(struct caddx_frame) + 255, max_frames) < 0 ||
+	    pool_init(&txreq_pool, sizeof(struct caddx_txreq),
+		      max_clients * TX_CLIENT_MAX + npanels * TX_BRIDGE_MAX) < 0)
+		ERR(errno);
+#endif
+	for (pn = panels; pn < panels + npanels; pn++) {
+		if (!strncmp(pn->link_uri, "tcp://", strlen("tcp://")))
+			pn->link_kind = LINK_TCP;
+		else if (!strncmp(pn->link_uri, "pty:", strlen("pty:")))
+			pn->link_kind = LINK_PTY;
+		if (hist_init(hist_kb) < 0 ||
+		    (pn->log_path && log_open(pn->log_path) < 0) ||
+		    (pn->names_path && names_load() < 0))
+			ERR(errno);
+	}
+
 	memset(&action, 0, sizeof(action));
 	action.sa_handler = caddx_signal;
 	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGUSR1, &action, NULL);
+	/* Clients that went away show up as EPIPE from the write */
+	action.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &action, NULL);
 
-	if ((fd = open(ttyname, O_RDWR | O_NOCTTY)) < 0)
+	if (mcast_group && mcast_init(mcast_group, mcast_if) < 0)
 		ERR(errno);
 
-	if (serial_init(fd) < 0)
+	/* Take over from a running caddx, if there is one */
+	if (upgrade_path && (upgraded = upgrade_recv(&sfd)) < 0)
 		ERR(errno);
 
-	if ((port = rindex(listen_to, ':')) == NULL)
-		ERR(EINVAL);
-	*(port++) = 0;
+	for (pn = panels; pn < panels + npanels; pn++) {
+		/* A serial server may well come up after us, a tty should be there */
+		if (upgraded) {
+			pn->link_up = 1;
+		} else if ((pn->fd = link_open()) < 0) {
+			if (pn->link_kind != LINK_TCP)
+				ERR(errno);
+			warn("link: %s: %s, retrying in %u ms\n", pn->link_uri, strerror(errno), pn->link_backoff);
+			link_later();
+			errno = 0;
+		}
 
-	gai.ai_family = AF_UNSPEC;
-	gai.ai_socktype = SOCK_STREAM;
-	if ((i = getaddrinfo(listen_to, port, (const struct addrinfo *)&gai, &ai)) != 0)
-		ERR(i);
+		if (pn->state_path && !upgraded && state_load() < 0)
+			ERR(errno);
+	}
+	pn = panels;
 
-	for (pai = ai; pai; pai = pai->ai_next) {
-		if ((sfd = socket(pai->ai_family, pai->ai_socktype, pai->ai_protocol)) < 0)
-			continue;
+	if (sfd < 0 && (sfd = listen_open(listen_to)) < 0)
+		ERR(errno);
 
-		i = 1;
-		setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+	if (stats_addr && stats_listen() < 0)
+		ERR(errno);
 
-		if (bind(sfd, pai->ai_addr, pai->ai_addrlen) < 0) {
- sock_error:
-			close(sfd);
-			continue;
-		}
+	if (stream_addr && (stream_sfd = listen_open(stream_addr)) < 0)
+		ERR(errno);
 
-		if (listen(sfd, 5) < 0)
-			goto sock_error;
-		break;
-	}
-	freeaddrinfo(ai);
-	if (!pai) {
-		if (!errno)
-			errno = EINVAL;
+	if (upgrade_path && (ufd = upgrade_listen()) < 0)
 		ERR(errno);
-	}
 
 	if (!fg) {
 		log_syslog = 1;
@@ -463,49 +3438,101 @@ main(int argc, char *argv[])
 		setsid();
 	}
 
+	if (log_start() < 0)
+		ERR(errno);
+
+	if (io_init(use_uring) < 0)
+		ERR(errno);
+	info("I/O engine: %s\n", io_engine());
+	for (pn = panels; pn < panels + npanels; pn++)
+		if (pn->fd >= 0 && link_watch(&pn->fd) < 0)
+			ERR(errno);
+	pn = panels;
+	if (io_watch(sfd, IO_EV_ACCEPT, &sfd) < 0 ||
+	    (ufd >= 0 && io_watch(ufd, IO_EV_ACCEPT, &ufd) < 0) ||
+	    (stats_sfd >= 0 && io_watch(stats_sfd, IO_EV_ACCEPT, &stats_sfd) < 0) ||
+	    (stream_sfd >= 0 && io_watch(stream_sfd, IO_EV_ACCEPT, &stream_sfd) < 0))
+		ERR(errno);
+	for (cl = client_tab; cl < client_tab + client_hi; cl++)
+		if (cl->fd >= 0 && io_watch(cl->fd, IO_EV_READ, cl) < 0)
+			ERR(errno);
+
 	while (!quit) {
-		struct caddx_client *cl = clients;
-		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
-		FD_SET(sfd, &fds);
-		max_fd = fd;
-		if (sfd > fd)
-			max_fd = sfd;
-		for (cl = clients; cl; cl = cl->next) {
-			FD_SET(cl->fd, &fds);
-			if (cl->fd > max_fd)
-				max_fd = cl->fd;
-		}
-
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
-		i = select(max_fd + 1, &fds, NULL, NULL, &tv);
-		if (can_read(fd)) {
-			caddx_rx_pkt(fd, buf, sizeof(buf));
-			caddx_parse(fd, buf + 1, buf[0]);
-		}
-		if (can_read(sfd)) {
-			handle_connect(sfd);
-			errno = errline = 0;
+		uint64_t now = mono_ms(), timeout = hello ? 0 : 1000, t;
+
+		for (p = panels; p < panels + npanels; p++) {
+			if (p->tx_inflight)
+				t = (p->tx_deadline > now) ? p->tx_deadline - now : 0;
+			else if (p->tx_wake)
+				t = (p->tx_wake > now) ? p->tx_wake - now : 0;
+			else
+				continue;
+			if (t < timeout)
+				timeout = t;
 		}
-		for (cl = clients; cl; cl = cl->next)
-			if (can_read(cl->fd))
-				client_read(fd, cl);
+		if (io_wait(timeout) < 0 && errno != EINTR)
+			ERR(errno);
+		errno = 0;
+		if (handle_events(&sfd, &ufd) < 0)
+			ERR(errno);
 
-		if (!synced && !--sync_count) {
-			uint8_t sync = CADDX_IFACE_CFG_REQ;
-			info("sync\n");
-			caddx_tx(fd, &sync, 1);
-			sync_count = sync_freq;
+		for (p = panels; p < panels + npanels; p++) {
+			pn = p;
+			if (pn->link_up && !pn->synced && mono_ms() >= pn->sync_next) {
+				uint8_t sync = CADDX_IFACE_CFG_REQ;
+				info("sync %s\n", pn->link_uri);
+				st.syncs++;
+				caddx_queue(NULL, 0, &sync, 1, TX_PRIO_REQ);
+				pn->sync_next = mono_ms() + sync_freq * 1000;
+			}
+			state_tick();
+			names_tick();
+			log_tick();
+			link_reopen(&pn->fd);
+			caddx_tx_next();
+			link_flush(&pn->fd);
 		}
-	}
 
+		/* Everything this round produced goes out in one go */
+		hello = stream_hello();
+		clients_flush();
+
+		if (stats_dump) {
+			stats_dump = 0;
+			stats_update();
+			stats_log(stats_defs, ARRAY_SIZE(stats_defs));
+		}
+
+		if (upgrade_cfd >= 0 && upgrade_send(&sfd, &ufd) == 0)
+			break;
+	}
+	/* After an upgrade the state files are the new caddx's */
+	for (pn = panels; pn < panels + npanels; pn++)
+		if (pn->state_path && !upgrade_done)
+			state_save();
 
 	/* FALLTHROUGH */
  error:
 	if (listen_to) free(listen_to);
-	if (fd >= 0) close(fd);
+	if (client_tab) free(client_tab);
+#ifdef CONFIG_STATIC_MEM
+	if (frame_pool.mem) free(frame_pool.mem);
+	if (txreq_pool.mem) free(txreq_pool.mem);
+#endif
+	for (p = panels; p < panels + npanels; p++) {
+		if (p->hist) free(p->hist);
+		if (p->fd >= 0) close(p->fd);
+		if (p->log_fd >= 0) close(p->log_fd);
+	}
+	if (panels) free(panels);
 	if (sfd >= 0) close(sfd);
+	if (ufd >= 0) close(ufd);
+	if (stats_sfd >= 0) close(stats_sfd);
+	if (stream_sfd >= 0) close(stream_sfd);
+	if (stats_cfd >= 0) close(stats_cfd);
+	if (upgrade_cfd >= 0) close(upgrade_cfd);
+	if (mcast_fd >= 0) close(mcast_fd);
+	log_stop();
 	if (errno && errline) {
 		err("%s: error: %s @%d\n", __func__, strerror(errno), errline);
 		errno = errline = 0;
@@ -12,77 +12,168 @@
 #define CADDX_IFACE_CFG		0x01
 #define CADDX_IFACE_CFG_REQ	0x21
 #define CADDX_PART_STATUS_REQ	0x26
+#define CADDX_FAILED		0x1c
 #define CADDX_ACK		0x1d
 #define CADDX_NAK		0x1e
+#define CADDX_REJECTED		0x1f
 
 #define __packed __attribute__((packed))
 
+/* Messages with the reserved bit set never appear on the serial link.
+ * They make up the bridge's own client protocol: caddx answers them
+ * itself and never forwards them to the panel.
+ */
+#define CADDX_LOCAL		0x40
+
+/* Client protocol negotiation.  A client sends [2][CADDX_HELLO][version]
+ * in the legacy framing and caddx answers with the version it will speak.
+ * A bridge may serve several panels, numbered from 0 in the order it was
+ * given them; clients start out on panel 0.  A client that adds a panel
+ * byte to the hello moves to that panel, and the answer carries the
+ * panel it is on then, which is the old one if there is no such panel
+ * or requests to the old one are still pending.
+ * From version 1 on, frames in both directions carry a request ID:
+ *
+ * 0: Length (incl. the ID)
+ * 1-2: Request ID (big endian), 0 if unsolicited
+ * ... Message
+ *
+ * A reply to a request is tagged with the request's ID for the client
+ * that sent it.  Clients that never say hello keep the legacy framing:
+ * [length][message].
+ */
+#define CADDX_HELLO		(CADDX_LOCAL | 0x01)
+#define CADDX_PROTO_LEGACY	0
+#define CADDX_PROTO_V1		1
+#define CADDX_ID_LEN		2
+struct caddx_hello {
+	uint8_t type;
+	uint8_t version;
+	uint8_t panel;		/* optional */
+} __packed;
+
+/* Choose what a client receives besides the replies to its own requests.
+ * Panel replies to other clients' requests are only sent to clients that
+ * ask for them, unless they change the state the bridge last saw.  The
+ * bridge echoes the flags now in effect.  Legacy clients get everything.
+ * A panel byte moves the client as with CADDX_HELLO.
+ */
+#define CADDX_SUBSCRIBE		(CADDX_LOCAL | 0x02)
+#define CADDX_SUB_EVENTS	0x01	/* unsolicited panel messages */
+#define CADDX_SUB_REPLIES	0x02	/* replies to other clients */
+struct caddx_subscribe {
+	uint8_t type;
+	uint8_t flags;
+	uint8_t panel;		/* optional */
+} __packed;
+
+/* Ask for every zone and partition status the bridge knows.  They come
+ * back tagged with the request's ID, followed by a caddx_snapshot_end
+ * carrying the multicast sequence number the snapshot is current up to.
+ */
+#define CADDX_SNAPSHOT		(CADDX_LOCAL | 0x03)
+#define CADDX_SNAPSHOT_STALE	0x01	/* restored, not confirmed by the panel yet */
+struct caddx_snapshot_end {
+	uint8_t type;
+	uint8_t seq[4];		/* next sequence number, big endian */
+	uint8_t flags;
+} __packed;
+
+/* Ask for the status changes the bridge kept for one zone or partition
+ * between two times (Unix seconds, both inclusive).  They come back
+ * oldest first as caddx_history_event, then the request is echoed with
+ * more set if older changes in the range did not fit; ask again with an
+ * earlier to for those.
+ */
+#define CADDX_HISTORY		(CADDX_LOCAL | 0x04)
+#define CADDX_HISTORY_EVENT	(CADDX_LOCAL | 0x05)
+#define CADDX_HIST_ZONE		0
+#define CADDX_HIST_PART		1
+struct caddx_history {
+	uint8_t type;
+	uint8_t kind;		/* CADDX_HIST_ZONE or CADDX_HIST_PART */
+	uint8_t index;		/* 0-based, as in the panel messages */
+	uint8_t from[4];	/* big endian */
+	uint8_t to[4];		/* big endian */
+	uint8_t more;
+} __packed;
+
+struct caddx_history_event {
+	uint8_t type;
+	uint8_t time[4];	/* big endian */
+	uint8_t msg[];		/* zone or partition status */
+} __packed;
+
+/* Forget the zone names the bridge has cached and fetch them again from
+ * the panel.  The message is echoed once the cache is dropped.
+ */
+#define CADDX_NAMES_RESET	(CADDX_LOCAL | 0x06)
+
+/* Multicast event datagrams (caddx -m).  Every frame received from a
+ * panel is sent once, behind this header; seq goes up by one per
+ * datagram from that panel so receivers can tell when they missed
+ * something.
+ */
+#define CADDX_MCAST_MAGIC	0x4358	/* "CX" */
+#define CADDX_MCAST_V1		1
+struct caddx_mcast_hdr {
+	uint8_t magic[2];
+	uint8_t version;
+	uint8_t panel;		/* as in CADDX_HELLO */
+	uint8_t seq[4];		/* big endian */
+	uint8_t len;
+} __packed;
+
 struct caddx_msg {
 	uint8_t type:6;
 	bool reserved06:1;
 	bool ack:1;
 } __packed;
 
-#define CADDX_ZONE_STATUS	0x04
-struct caddx_zone_status {
-	struct caddx_msg msg;
+/* Panel messages are read through a caddx_view (see below) rather than
+ * overlaid with bitfield structs, whose layout is up to the compiler.
+ * A flag is named by its byte and bit in the message, type byte
+ * included: CADDX_BIT(6, 0) is bit 0 of the seventh byte.
+ */
+#define CADDX_BIT(byte, bit)	((byte) << 3 | (bit))
 
-	uint8_t zone;
-
-	bool part1_en:1;
-	bool part2_en:1;
-	bool part3_en:1;
-	bool part4_en:1;
-	bool part5_en:1;
-	bool part6_en:1;
-	bool part7_en:1;
-	bool part8_en:1;
-
-	bool fire:1;
-	bool hour_24:1;
-	bool key_switch:1;
-	bool follower:1;
-	bool entry_exit_delay_1:1;
-	bool entry_exit_delay_2:1;
-	bool interior:1;
-	bool local_only:1;
-
-	bool keypad_sounder:1;
-	bool yelping_siren:1;
-	bool steady_siren:1;
-	bool chime:1;
-	bool bypassable:1;
-	bool group_bypassable:1;
-	bool force_armable:1;
-	bool entry_guard:1;
-
-	bool fast_loop_response:1;
-	bool double_eol_tamper:1;
-	bool trouble0:1;
-	bool cross_zone:1;
-	bool dialer_delay:1;
-	bool swinger_shutdown:1;
-	bool restorable:1;
-	bool listen_in:1;
-
-	bool faulted:1;
-	bool tampered:1;
-	bool trouble:1;
-	bool bypassed:1;
-	bool inhibited:1;
-	bool low_battery:1;
-	bool loss_of_supervision:1;
-	bool reserved77:1;
-
-	bool alarm_memory:1;
-	bool bypass_memory:1;
-	bool reserved82:1;
-	bool reserved83:1;
-	bool reserved84:1;
-	bool reserved85:1;
-	bool reserved86:1;
-	bool reserved87:1;
-} __packed;
+#define CADDX_ZONE_STATUS	0x04
+#define CADDX_ZONE_STATUS_LEN	8
+#define CADDX_ZS_ZONE		1
+#define CADDX_ZS_PARTS		2	/* partition mask */
+#define CADDX_ZS_FIRE		CADDX_BIT(3, 0)
+#define CADDX_ZS_HOUR_24	CADDX_BIT(3, 1)
+#define CADDX_ZS_KEY_SWITCH	CADDX_BIT(3, 2)
+#define CADDX_ZS_FOLLOWER	CADDX_BIT(3, 3)
+#define CADDX_ZS_DELAY_1	CADDX_BIT(3, 4)
+#define CADDX_ZS_DELAY_2	CADDX_BIT(3, 5)
+#define CADDX_ZS_INTERIOR	CADDX_BIT(3, 6)
+#define CADDX_ZS_LOCAL_ONLY	CADDX_BIT(3, 7)
+#define CADDX_ZS_KEYPAD_SOUNDER	CADDX_BIT(4, 0)
+#define CADDX_ZS_YELPING_SIREN	CADDX_BIT(4, 1)
+#define CADDX_ZS_STEADY_SIREN	CADDX_BIT(4, 2)
+#define CADDX_ZS_CHIME		CADDX_BIT(4, 3)
+#define CADDX_ZS_BYPASSABLE	CADDX_BIT(4, 4)
+#define CADDX_ZS_GROUP_BYPASSABLE CADDX_BIT(4, 5)
+#define CADDX_ZS_FORCE_ARMABLE	CADDX_BIT(4, 6)
+#define CADDX_ZS_ENTRY_GUARD	CADDX_BIT(4, 7)
+#define CADDX_ZS_FAST_LOOP	CADDX_BIT(5, 0)
+#define CADDX_ZS_DOUBLE_EOL	CADDX_BIT(5, 1)
+#define CADDX_ZS_TROUBLE_TYPE	CADDX_BIT(5, 2)
+#define CADDX_ZS_CROSS_ZONE	CADDX_BIT(5, 3)
+#define CADDX_ZS_DIALER_DELAY	CADDX_BIT(5, 4)
+#define CADDX_ZS_SWINGER_SHUTDOWN CADDX_BIT(5, 5)
+#define CADDX_ZS_RESTORABLE	CADDX_BIT(5, 6)
+#define CADDX_ZS_LISTEN_IN	CADDX_BIT(5, 7)
+#define CADDX_ZS_FAULTED	CADDX_BIT(6, 0)
+#define CADDX_ZS_TAMPERED	CADDX_BIT(6, 1)
+#define CADDX_ZS_TROUBLE	CADDX_BIT(6, 2)
+#define CADDX_ZS_BYPASSED	CADDX_BIT(6, 3)
+#define CADDX_ZS_INHIBITED	CADDX_BIT(6, 4)
+#define CADDX_ZS_LOW_BATTERY	CADDX_BIT(6, 5)
+#define CADDX_ZS_LOST_SUPERVISION CADDX_BIT(6, 6)
+#define CADDX_ZS_ALARM_MEMORY	CADDX_BIT(7, 0)
+#define CADDX_ZS_BYPASS_MEMORY	CADDX_BIT(7, 1)
 
 #define CADDX_PART_STATUS_REQ	0x26
 struct caddx_part_status_req {
@@ -97,68 +188,54 @@ struct caddx_zone_status_req {
 };
 
 #define CADDX_PART_STATUS	0x06
-struct caddx_part_status {
-	struct caddx_msg msg;
-
-	uint8_t part;
-
-	bool bypass_code_required:1;
-	bool fire_trouble:1;
-	bool fire:1;
-	bool pulsing_buzzer:1;
-	bool tlm_fault_memory:1;
-	bool reserved25:1;
-	bool armed:1;
-	bool instant:1;
-
-	bool previous_alarm:1;
-	bool siren_on:1;
-	bool steady_siren_on:1;
-	bool alarm_memory:1;
-	bool tamper:1;
-	bool cancel_command_entered:1;
-	bool code_entered:1;
-	bool cancel_pending:1;
-
-	bool reserved40:1;
-	bool silent_exit_enabled:1;
-	bool entryguard:1;
-	bool chime_mode_on:1;
-	bool entry:1;
-	bool delay_expiration_warning:1;
-	bool exit1:1;
-	bool exit2:1;
-
-	bool led_extinguish:1;
-	bool cross_timing:1;
-	bool recent_closing_being_timed:1;
-	bool reserved53:1;
-	bool exit_error_triggered:1;
-	bool auto_home_inhibited:1;
-	bool sensor_low_battery:1;
-	bool sensor_lost_supervision:1;
-
-	uint8_t last_user_number;
-
-	bool zone_bypassed:1;
-	bool force_arm_triggered_by_auto_arm:1;
-	bool ready_to_arm:1;
-	bool ready_to_force_arm:1;
-	bool valid_pin_accepted:1;
-	bool chime_on:1;
-	bool error_beep:1;
-	bool tone_on:1;
-
-	bool entry1:1;
-	bool open_period:1;
-	bool alarm_sent_using_phone_1:1;
-	bool alarm_sent_using_phone_2:1;
-	bool alarm_sent_using_phone_3:1;
-	bool cancel_report_is_in_stack:1;
-	bool keyswitch_armed:1;
-	bool delay_trip_in_progress:1;
-} __packed;
-
+#define CADDX_PART_STATUS_LEN	9
+#define CADDX_PS_PART		1
+#define CADDX_PS_BYPASS_CODE_REQUIRED CADDX_BIT(2, 0)
+#define CADDX_PS_FIRE_TROUBLE	CADDX_BIT(2, 1)
+#define CADDX_PS_FIRE		CADDX_BIT(2, 2)
+#define CADDX_PS_PULSING_BUZZER	CADDX_BIT(2, 3)
+#define CADDX_PS_TLM_FAULT_MEMORY CADDX_BIT(2, 4)
+#define CADDX_PS_ARMED		CADDX_BIT(2, 6)
+#define CADDX_PS_INSTANT	CADDX_BIT(2, 7)
+#define CADDX_PS_PREVIOUS_ALARM	CADDX_BIT(3, 0)
+#define CADDX_PS_SIREN_ON	CADDX_BIT(3, 1)
+#define CADDX_PS_STEADY_SIREN_ON CADDX_BIT(3, 2)
+#define CADDX_PS_ALARM_MEMORY	CADDX_BIT(3, 3)
+#define CADDX_PS_TAMPER		CADDX_BIT(3, 4)
+#define CADDX_PS_CANCEL_ENTERED	CADDX_BIT(3, 5)
+#define CADDX_PS_CODE_ENTERED	CADDX_BIT(3, 6)
+#define CADDX_PS_CANCEL_PENDING	CADDX_BIT(3, 7)
+#define CADDX_PS_SILENT_EXIT	CADDX_BIT(4, 1)
+#define CADDX_PS_ENTRYGUARD	CADDX_BIT(4, 2)
+#define CADDX_PS_CHIME_MODE	CADDX_BIT(4, 3)
+#define CADDX_PS_ENTRY		CADDX_BIT(4, 4)
+#define CADDX_PS_DELAY_WARNING	CADDX_BIT(4, 5)
+#define CADDX_PS_EXIT1		CADDX_BIT(4, 6)
+#define CADDX_PS_EXIT2		CADDX_BIT(4, 7)
+#define CADDX_PS_LED_EXTINGUISH	CADDX_BIT(5, 0)
+#define CADDX_PS_CROSS_TIMING	CADDX_BIT(5, 1)
+#define CADDX_PS_RECENT_CLOSING	CADDX_BIT(5, 2)
+#define CADDX_PS_EXIT_ERROR	CADDX_BIT(5, 4)
+#define CADDX_PS_AUTO_HOME_INHIBITED CADDX_BIT(5, 5)
+#define CADDX_PS_SENSOR_LOW_BATTERY CADDX_BIT(5, 6)
+#define CADDX_PS_SENSOR_LOST_SUPERVISION CADDX_BIT(5, 7)
+#define CADDX_PS_LAST_USER	6
+#define CADDX_PS_ZONE_BYPASSED	CADDX_BIT(7, 0)
+#define CADDX_PS_AUTO_FORCE_ARM	CADDX_BIT(7, 1)
+#define CADDX_PS_READY_TO_ARM	CADDX_BIT(7, 2)
+#define CADDX_PS_READY_TO_FORCE_ARM CADDX_BIT(7, 3)
+#define CADDX_PS_VALID_PIN	CADDX_BIT(7, 4)
+#define CADDX_PS_CHIME_ON	CADDX_BIT(7, 5)
+#define CADDX_PS_ERROR_BEEP	CADDX_BIT(7, 6)
+#define CADDX_PS_TONE_ON	CADDX_BIT(7, 7)
+#define CADDX_PS_ENTRY1		CADDX_BIT(8, 0)
+#define CADDX_PS_OPEN_PERIOD	CADDX_BIT(8, 1)
+#define CADDX_PS_ALARM_PHONE_1	CADDX_BIT(8, 2)
+#define CADDX_PS_ALARM_PHONE_2	CADDX_BIT(8, 3)
+#define CADDX_PS_ALARM_PHONE_3	CADDX_BIT(8, 4)
+#define CADDX_PS_CANCEL_IN_STACK CADDX_BIT(8, 5)
+#define CADDX_PS_KEYSWITCH_ARMED CADDX_BIT(8, 6)
+#define CADDX_PS_DELAY_TRIP	CADDX_BIT(8, 7)
 #define CADDX_KEYPAD_FUNC0	0x3c
 struct caddx_keypad_func0 {
 	struct caddx_msg msg;
@@ -255,10 +332,128 @@ struct caddx_keypad_func1 {
 	};
 };
 
+#define CADDX_ZONE_NAME		0x03
+#define CADDX_ZONE_NAME_LEN	18
+#define CADDX_ZN_ZONE		1
+#define CADDX_ZN_NAME		2	/* padded with spaces */
+#define CADDX_ZN_NAME_LEN	16
+
+#define CADDX_ZONE_NAME_REQ	0x23
+struct caddx_zone_name_req {
+	struct caddx_msg msg;
+	uint8_t zone;
+} __packed;
+
+#define CADDX_LOG_EVENT		0x0a
+#define CADDX_LOG_EVENT_LEN	10
+#define CADDX_LE_EVENT		1	/* slot in the panel's log */
+#define CADDX_LE_LOG_SIZE	2
+#define CADDX_LE_TYPE		3	/* low 7 bits */
+#define CADDX_LE_NON_REPORTING	CADDX_BIT(3, 7)
+#define CADDX_LE_NUMBER		4	/* zone, user or device */
+#define CADDX_LE_PART		5
+#define CADDX_LE_MONTH		6
+#define CADDX_LE_DAY		7
+#define CADDX_LE_HOUR		8
+#define CADDX_LE_MINUTE		9
+
+#define CADDX_ZONES_SNAPSHOT	0x05
+#define CADDX_PARTS_SNAPSHOT	0x07
+#define CADDX_X10_RECEIVED	0x09
+#define CADDX_KEYPAD_MSG	0x0b
+#define CADDX_PROGRAM_DATA	0x10
+#define CADDX_USER_INFO		0x12
+#define CADDX_ZONES_SNAPSHOT_REQ	0x25
+#define CADDX_PARTS_SNAPSHOT_REQ	0x27
+#define CADDX_SYSTEM_STATUS	0x08
+#define CADDX_SYSTEM_STATUS_LEN	12
+#define CADDX_SS_PANEL_ID	1
+#define CADDX_SS_GROUND_FAULT	CADDX_BIT(3, 0)
+#define CADDX_SS_PHONE_FAULT	CADDX_BIT(3, 1)
+#define CADDX_SS_FAIL_TO_COMM	CADDX_BIT(3, 2)
+#define CADDX_SS_FUSE_FAULT	CADDX_BIT(3, 3)
+#define CADDX_SS_BOX_TAMPER	CADDX_BIT(3, 4)
+#define CADDX_SS_SIREN_TAMPER	CADDX_BIT(3, 5)
+#define CADDX_SS_LOW_BATTERY	CADDX_BIT(3, 6)
+#define CADDX_SS_AC_FAIL	CADDX_BIT(3, 7)
+#define CADDX_SYSTEM_STATUS_REQ	0x28
+#define CADDX_SEND_X10		0x29
+#define CADDX_LOG_EVENT_REQ	0x2a
+#define CADDX_KEYPAD_TEXT	0x2b
+#define CADDX_KEYPAD_TERMINAL	0x2c
+#define CADDX_PROGRAM_DATA_REQ	0x30
+#define CADDX_PROGRAM_DATA_CMD	0x31
+#define CADDX_USER_INFO_REQ_PIN	0x32
+#define CADDX_USER_INFO_REQ	0x33
+#define CADDX_SET_USER_CODE_PIN	0x34
+#define CADDX_SET_USER_CODE	0x35
+#define CADDX_SET_USER_AUTH_PIN	0x36
+#define CADDX_SET_USER_AUTH	0x37
+#define CADDX_STORE_EVENT	0x3a
+#define CADDX_SET_CLOCK		0x3b
+
 #define CADDX_BYPASS_TOGGLE	0x3f
 struct caddx_bypass_toggle {
 	struct caddx_msg msg;
 	uint8_t zone;
 };
 
+/* libcaddx: the codec both programs share */
+
+uint16_t fletcher_cksum(const uint8_t *data, uint32_t len);
+
+/* Room a message of len bytes takes framed, with every byte escaped */
+#define CADDX_FRAME_MAX(len)	(1 + 2 * (1 + (len) + 2))
+int caddx_frame(uint8_t *out, uint32_t outlen, const uint8_t *msg, uint8_t len);
+int caddx_unframe(const uint8_t *raw, uint32_t rawlen, uint8_t *buf,
+		  uint32_t maxlen, uint32_t *used);
+
+/* What the registry knows about a message type.  Lengths count the
+ * type byte; check, if there is one, vets the fields once the length
+ * is known to be right.
+ */
+struct caddx_msg_info {
+	const char *name;
+	uint8_t min, max;
+	uint8_t reply;		/* what the panel answers a request with */
+	int (*check)(const uint8_t *msg, uint32_t len);
+};
+
+/* A message that passed caddx_decode(), pointing into the buffer it was
+ * decoded from.  Every offset the accessors take for its type is
+ * within info->min, so they need no checks of their own.
+ */
+struct caddx_view {
+	const struct caddx_msg_info *info;
+	const uint8_t *msg;
+	uint32_t len;
+};
+
+const struct caddx_msg_info *caddx_msg_info(uint8_t type);
+int caddx_decode(struct caddx_view *v, const uint8_t *msg, uint32_t len);
+
+static inline uint8_t
+caddx_type(const struct caddx_view *v)
+{
+	return v->msg[0] & (CADDX_LOCAL | CADDX_MSG_MASK);
+}
+
+static inline uint8_t
+caddx_byte(const struct caddx_view *v, int off)
+{
+	return v->msg[off];
+}
+
+static inline int
+caddx_bit(const struct caddx_view *v, int bit)
+{
+	return (v->msg[bit >> 3] >> (bit & 7)) & 1;
+}
+
+static inline uint32_t
+caddx_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
 #endif /* __CADDX_H__ */
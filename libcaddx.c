@@ -0,0 +1,260 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "caddx.h"
+
+uint16_t
+fletcher_cksum(const uint8_t *data, uint32_t len)
+{
+	uint8_t sum1 = 0, sum2 = 0;
+	uint32_t i;
+	for (i = 0; i < len; i++) {
+		if (255 - sum1 < data[i])
+			sum1++;
+		sum1 += data[i];
+		if (sum1 == 255)
+			sum1 = 0;
+		if (255 - sum2 < sum1)
+			sum2++;
+		sum2 += sum1;
+		if (sum2 == 255)
+			sum2 = 0;
+	}
+	return (sum1 << 8) | sum2;
+}
+
+/* CADDX Binary Protocol:
+ * Byte: Description
+ *  Bit: Description
+ *
+ * 0: Start character (CADDX_START)
+ * 1: Length (not incl. escaped bytes and checksum)
+ * 2:
+ *  7: Ack required
+ *  6: Reserved
+ *  0-5: Message type
+ * ... Message
+ * N-1: Fletcher sum1
+ * N: Fletcher sum2
+ */
+
+static uint32_t
+caddx_stuff(uint8_t *out, uint8_t val)
+{
+	if (val == CADDX_START || val == CADDX_START - 1) {
+		out[0] = CADDX_START - 1;
+		out[1] = val ^ CADDX_START_ESC;
+		return 2;
+	}
+	out[0] = val;
+	return 1;
+}
+
+/* Frame msg for the serial link into out.  Returns the framed length,
+ * or -1 with ENOBUFS if it does not fit.
+ */
+int
+caddx_frame(uint8_t *out, uint32_t outlen, const uint8_t *msg, uint8_t len)
+{
+	uint8_t raw[1 + 255 + 2];
+	uint16_t cksum;
+	uint32_t i, n = 1 + len + 3;
+
+	raw[0] = len;
+	memcpy(raw + 1, msg, len);
+	cksum = fletcher_cksum(raw, len + 1);
+	raw[1 + len] = cksum >> 8;
+	raw[2 + len] = cksum & 0xff;
+
+	if (outlen < CADDX_FRAME_MAX(len)) {
+		for (i = 0; i < len + 3U; i++)
+			if (raw[i] == CADDX_START || raw[i] == CADDX_START - 1)
+				n++;
+		if (outlen < n) {
+			errno = ENOBUFS;
+			return -1;
+		}
+	}
+
+	out[0] = CADDX_START;
+	for (i = 0, n = 1; i < len + 3U; i++)
+		n += caddx_stuff(out + n, raw[i]);
+	return n;
+}
+
+/* Unstuff the frame at the start of raw into buf as [len][msg][cksum],
+ * the checksum is left to the caller.  Returns 1 for a frame, 0 if it
+ * is not all there yet and -1 if it is bad: EINVAL for a length over
+ * maxlen and EPROTO for one cut short.  *used is set to the raw bytes
+ * the frame, good or bad, took up.
+ *
+ * CADDX_START is always escaped inside a frame, so one showing up there
+ * means noise ate the rest of the frame or garbled its length.  The
+ * frame ends right before it then, so the next one is not swallowed as
+ * the tail of the bad one.
+ */
+int
+caddx_unframe(const uint8_t *raw, uint32_t rawlen, uint8_t *buf,
+	      uint32_t maxlen, uint32_t *used)
+{
+	uint32_t i, done = 0, want = 1;
+	uint8_t b;
+
+	*used = 0;
+	for (i = 1; done < want; buf[done++] = b) {
+		if (i >= rawlen)
+			return 0;
+		if (raw[i] == CADDX_START)
+			goto cut;
+		b = raw[i++];
+		if (b == CADDX_START - 1) {
+			if (i >= rawlen)
+				return 0;
+			if (raw[i] == CADDX_START)
+				goto cut;
+			b = raw[i++] ^ CADDX_START_ESC;
+		}
+		if (!done) {
+			if (b > maxlen - 3) {
+				*used = i;
+				errno = EINVAL;
+				return -1;
+			}
+			want = 1 + b + 2;
+		}
+	}
+	*used = i;
+	return 1;
+
+ cut:
+	*used = i;
+	errno = EPROTO;
+	return -1;
+}
+
+static int
+check_part_status(const uint8_t *msg, uint32_t len)
+{
+	return msg[CADDX_PS_PART] < 8 ? 0 : -1;
+}
+
+static int
+check_log_event(const uint8_t *msg, uint32_t len)
+{
+	uint8_t size = msg[CADDX_LE_LOG_SIZE];
+
+	/* An empty log has no slots to speak of */
+	return !size || msg[CADDX_LE_EVENT] < size ? 0 : -1;
+}
+
+static int
+check_history_event(const uint8_t *msg, uint32_t len)
+{
+	struct caddx_view v;
+
+	/* One zone or partition status behind the time */
+	msg += sizeof(struct caddx_history_event);
+	len -= sizeof(struct caddx_history_event);
+	if ((msg[0] & CADDX_MSG_MASK) != CADDX_ZONE_STATUS &&
+	    (msg[0] & CADDX_MSG_MASK) != CADDX_PART_STATUS)
+		return -1;
+	return caddx_decode(&v, msg, len);
+}
+
+#define MSG(type, name, min, max, reply, check) \
+	[type] = { name, min, max, reply, check }
+
+/* Every message of the NX584 protocol and the bridge's own, by type
+ * (ack request bit off).  Of requests that are answered with more than
+ * an acknowledge, reply is the answer's type.
+ */
+static const struct caddx_msg_info caddx_msgs[CADDX_LOCAL + CADDX_MSG_MASK + 1] = {
+	MSG(CADDX_IFACE_CFG, "interface configuration", 11, 11, 0, NULL),
+	MSG(CADDX_ZONE_NAME, "zone name", CADDX_ZONE_NAME_LEN, CADDX_ZONE_NAME_LEN, 0, NULL),
+	MSG(CADDX_ZONE_STATUS, "zone status", CADDX_ZONE_STATUS_LEN, CADDX_ZONE_STATUS_LEN, 0, NULL),
+	MSG(CADDX_ZONES_SNAPSHOT, "zones snapshot", 10, 10, 0, NULL),
+	MSG(CADDX_PART_STATUS, "partition status", CADDX_PART_STATUS_LEN, CADDX_PART_STATUS_LEN, 0, check_part_status),
+	MSG(CADDX_PARTS_SNAPSHOT, "partitions snapshot", 9, 9, 0, NULL),
+	MSG(CADDX_SYSTEM_STATUS, "system status", CADDX_SYSTEM_STATUS_LEN, CADDX_SYSTEM_STATUS_LEN, 0, NULL),
+	MSG(CADDX_X10_RECEIVED, "X-10 message received", 4, 4, 0, NULL),
+	MSG(CADDX_LOG_EVENT, "log event", CADDX_LOG_EVENT_LEN, CADDX_LOG_EVENT_LEN, 0, check_log_event),
+	MSG(CADDX_KEYPAD_MSG, "keypad message received", 3, 3, 0, NULL),
+	MSG(CADDX_PROGRAM_DATA, "program data reply", 13, 13, 0, NULL),
+	MSG(CADDX_USER_INFO, "user information reply", 7, 7, 0, NULL),
+	MSG(CADDX_FAILED, "command failed", 1, 1, 0, NULL),
+	MSG(CADDX_ACK, "acknowledge", 1, 1, 0, NULL),
+	MSG(CADDX_NAK, "negative acknowledge", 1, 1, 0, NULL),
+	MSG(CADDX_REJECTED, "rejected", 1, 1, 0, NULL),
+
+	MSG(CADDX_IFACE_CFG_REQ, "interface configuration request", 1, 1, CADDX_IFACE_CFG, NULL),
+	MSG(CADDX_ZONE_NAME_REQ, "zone name request", 2, 2, CADDX_ZONE_NAME, NULL),
+	MSG(CADDX_ZONE_STATUS_REQ, "zone status request", 2, 2, CADDX_ZONE_STATUS, NULL),
+	MSG(CADDX_ZONES_SNAPSHOT_REQ, "zones snapshot request", 2, 2, CADDX_ZONES_SNAPSHOT, NULL),
+	MSG(CADDX_PART_STATUS_REQ, "partition status request", 2, 2, CADDX_PART_STATUS, NULL),
+	MSG(CADDX_PARTS_SNAPSHOT_REQ, "partitions snapshot request", 1, 1, CADDX_PARTS_SNAPSHOT, NULL),
+	MSG(CADDX_SYSTEM_STATUS_REQ, "system status request", 1, 1, CADDX_SYSTEM_STATUS, NULL),
+	MSG(CADDX_SEND_X10, "send X-10 message", 4, 4, 0, NULL),
+	MSG(CADDX_LOG_EVENT_REQ, "log event request", 2, 2, CADDX_LOG_EVENT, NULL),
+	MSG(CADDX_KEYPAD_TEXT, "send keypad text message", 12, 12, 0, NULL),
+	MSG(CADDX_KEYPAD_TERMINAL, "keypad terminal mode request", 3, 3, 0, NULL),
+	MSG(CADDX_PROGRAM_DATA_REQ, "program data request", 4, 4, CADDX_PROGRAM_DATA, NULL),
+	MSG(CADDX_PROGRAM_DATA_CMD, "program data command", 13, 13, 0, NULL),
+	MSG(CADDX_USER_INFO_REQ_PIN, "user information request with pin", 5, 5, CADDX_USER_INFO, NULL),
+	MSG(CADDX_USER_INFO_REQ, "user information request", 2, 2, CADDX_USER_INFO, NULL),
+	MSG(CADDX_SET_USER_CODE_PIN, "set user code with pin", 8, 8, 0, NULL),
+	MSG(CADDX_SET_USER_CODE, "set user code", 5, 5, 0, NULL),
+	MSG(CADDX_SET_USER_AUTH_PIN, "set user authorization with pin", 7, 7, 0, NULL),
+	MSG(CADDX_SET_USER_AUTH, "set user authorization", 4, 4, 0, NULL),
+	MSG(CADDX_STORE_EVENT, "store communication event", 6, 6, 0, NULL),
+	MSG(CADDX_SET_CLOCK, "set clock/calendar", 7, 7, 0, NULL),
+	MSG(CADDX_KEYPAD_FUNC0, "primary keypad function with pin", 6, 6, 0, NULL),
+	MSG(CADDX_KEYPAD_FUNC0_NOPIN, "primary keypad function", 3, 4, 0, NULL),
+	MSG(CADDX_KEYPAD_FUNC1, "secondary keypad function", 3, 3, 0, NULL),
+	MSG(CADDX_BYPASS_TOGGLE, "zone bypass toggle", 2, 2, 0, NULL),
+
+	/* Both take an optional panel */
+	MSG(CADDX_HELLO, "hello", sizeof(struct caddx_hello) - 1, sizeof(struct caddx_hello), 0, NULL),
+	MSG(CADDX_SUBSCRIBE, "subscribe", sizeof(struct caddx_subscribe) - 1, sizeof(struct caddx_subscribe), 0, NULL),
+	/* The request is the type alone */
+	MSG(CADDX_SNAPSHOT, "snapshot", 1, sizeof(struct caddx_snapshot_end), 0, NULL),
+	MSG(CADDX_HISTORY, "history", sizeof(struct caddx_history), sizeof(struct caddx_history), 0, NULL),
+	MSG(CADDX_HISTORY_EVENT, "history event",
+	    sizeof(struct caddx_history_event) + CADDX_ZONE_STATUS_LEN,
+	    sizeof(struct caddx_history_event) + CADDX_PART_STATUS_LEN, 0, check_history_event),
+	MSG(CADDX_NAMES_RESET, "names reset", 1, 1, 0, NULL),
+};
+
+/* NULL for types the registry does not know */
+const struct caddx_msg_info *
+caddx_msg_info(uint8_t type)
+{
+	const struct caddx_msg_info *info;
+
+	info = &caddx_msgs[type & (CADDX_LOCAL | CADDX_MSG_MASK)];
+	return info->name ? info : NULL;
+}
+
+/* Check msg against the registry and point v at it.  Returns -1 with
+ * ENOMSG for an unknown type and EBADMSG for a length or field that
+ * is off; v is left alone then.
+ */
+int
+caddx_decode(struct caddx_view *v, const uint8_t *msg, uint32_t len)
+{
+	const struct caddx_msg_info *info;
+
+	if (!len || !(info = caddx_msg_info(msg[0]))) {
+		errno = ENOMSG;
+		return -1;
+	}
+	if (len < info->min || len > info->max ||
+	    (info->check && info->check(msg, len) < 0)) {
+		errno = EBADMSG;
+		return -1;
+	}
+	v->info = info;
+	v->msg = msg;
+	v->len = len;
+	return 0;
+}
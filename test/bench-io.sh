@@ -0,0 +1,38 @@
+#!/bin/sh
+# Compare the select() and io_uring engines of caddx: the same load from
+# caddx-sim through each, counting the I/O system calls caddx makes per
+# zone change and timing the changes to the clients.  caddx has to be
+# built with CONFIG_IO_URING=y for the second run to use io_uring.
+#
+# RATE changes a second for SECS seconds, to CLIENTS clients.
+
+RATE=${RATE:-2000}
+SECS=${SECS:-5}
+CLIENTS=${CLIENTS:-8}
+PORT=${PORT:-15871}
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf $dir' EXIT
+
+for flag in "" -u; do
+	rm -f $dir/count $dir/tty
+	COUNT_OUT=$dir/count LD_PRELOAD=./test/count.so \
+		./caddx -f -vv $flag -t pty:$dir/tty -l 127.0.0.1:$PORT > $dir/log 2>&1 &
+	pid=$!
+	while [ ! -e $dir/tty ]; do sleep 0.1; done
+	sleep 0.5
+
+	kill -USR2 $pid
+	./test/caddx-sim -c 127.0.0.1:$PORT -n $CLIENTS -r $RATE -d $SECS $dir/tty > $dir/sim
+	kill -USR2 $pid
+	sleep 0.2
+	kill $pid
+	wait $pid
+
+	engine=$(sed -n 's/.*I\/O engine: //p' $dir/log)
+	sent=$(sed -n 's/^sent \([0-9]*\).*/\1/p' $dir/sim)
+	echo "$engine:"
+	sed 's/^/  /' $dir/sim
+	awk -v sent=$sent 'NR == 1 { a = $2 } NR == 2 { b = $2 }
+		END { printf "  %d syscalls, %.2f per change\n", b - a, sent ? (b - a) / sent : 0 }' $dir/count
+done
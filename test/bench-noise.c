@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include "caddx.h"
+
+/* Line noise against the receive path: a stream of zone status frames
+ * with bits flipped at a given bit error rate, cut into frames the way
+ * caddx does.  For each rate it reports how many frames noise hit, how
+ * many were lost and how many of those noise never touched (lost to a
+ * resync going wrong), how many damaged frames still passed the
+ * checksum, and how long after a damaged frame the next good one came
+ * in, in bytes and at 38400 baud.
+ *
+ * Frames carry their index in the zone type flags, bytes 3-5, so a
+ * frame that makes it through can be matched up with what was sent.
+ */
+#define NOISE_BAUD		38400
+#define NOISE_BYTES_MS(n)	((n) * 10.0 * 1000 / NOISE_BAUD)
+
+struct noise_stream {
+	uint8_t *data;
+	uint32_t len;
+	uint32_t *off;		/* where each frame starts, plus the end */
+	uint32_t *hit;		/* first byte noise hit, ~0 if none */
+	uint8_t *got;
+	uint32_t nframes;
+};
+
+static void
+usage(void)
+{
+	printf("\
+Usage: bench-noise [flags] [BER...]\n\
+Feed frames with bit errors at each BER (default 1e-5 to 1e-2) through\n\
+the receive path\n\
+-n ...: Frames (default 100000)\n\
+-s ...: Random seed (default 1)\n\
+");
+}
+
+static void
+noise_msg(uint8_t *msg, uint32_t i)
+{
+	memset(msg, 0, CADDX_ZONE_STATUS_LEN);
+	msg[0] = CADDX_ZONE_STATUS;
+	msg[CADDX_ZS_ZONE] = i % 192;
+	msg[CADDX_ZS_PARTS] = 1;
+	msg[3] = i >> 16;
+	msg[4] = i >> 8;
+	msg[5] = i;
+	msg[6] = i & 1;
+}
+
+static int
+noise_build(struct noise_stream *s, uint32_t nframes)
+{
+	uint8_t msg[CADDX_ZONE_STATUS_LEN];
+	uint32_t i, len = 0;
+	int n;
+
+	s->nframes = nframes;
+	s->data = malloc((size_t)nframes * CADDX_FRAME_MAX(sizeof(msg)));
+	s->off = calloc(nframes + 1, sizeof(*s->off));
+	s->hit = calloc(nframes, sizeof(*s->hit));
+	s->got = calloc(nframes, 1);
+	if (!s->data || !s->off || !s->hit || !s->got) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < nframes; i++) {
+		noise_msg(msg, i);
+		s->off[i] = len;
+		n = caddx_frame(s->data + len, CADDX_FRAME_MAX(sizeof(msg)), msg, sizeof(msg));
+		if (n < 0)
+			return -1;
+		len += n;
+	}
+	s->off[nframes] = s->len = len;
+	return 0;
+}
+
+/* Flip each bit with probability ber, noting the first byte of each
+ * frame that was hit.  Returns the number of frames hit.
+ */
+static uint32_t
+noise_inject(struct noise_stream *s, uint8_t *out, double ber)
+{
+	uint32_t i, f = 0, hit = 0;
+	int bit;
+
+	memcpy(out, s->data, s->len);
+	memset(s->got, 0, s->nframes);
+	for (i = 0; i < s->nframes; i++)
+		s->hit[i] = ~0U;
+	for (i = 0; i < s->len; i++) {
+		while (i >= s->off[f + 1])
+			f++;
+		for (bit = 0; bit < 8; bit++) {
+			if (drand48() >= ber)
+				continue;
+			out[i] ^= 1 << bit;
+			if (s->hit[f] == ~0U) {
+				s->hit[f] = i;
+				hit++;
+			}
+		}
+	}
+	return hit;
+}
+
+/* Cut raw into frames like caddx_rx_frame() and caddx_rx_pkt() do.
+ * Returns the frames that passed the checksum but were not what was
+ * sent.
+ */
+static uint32_t
+noise_receive(struct noise_stream *s, const uint8_t *raw)
+{
+	uint8_t buf[1 + 255 + 2], msg[CADDX_ZONE_STATUS_LEN];
+	uint32_t off = 0, used, idx, bad = 0;
+	uint16_t cksum;
+	int ret;
+
+	while (off < s->len) {
+		if (raw[off] != CADDX_START) {
+			off++;
+			continue;
+		}
+		ret = caddx_unframe(raw + off, s->len - off, buf, sizeof(buf), &used);
+		if (!ret)
+			break;
+		off += used;
+		if (ret < 0 || !buf[0])
+			continue;
+		cksum = fletcher_cksum(buf, buf[0] + 1);
+		if (cksum >> 8 != buf[1 + buf[0]] || (cksum & 0xff) != buf[2 + buf[0]])
+			continue;
+
+		idx = buf[4] << 16 | buf[5] << 8 | buf[6];
+		if (idx < s->nframes)
+			noise_msg(msg, idx);
+		if (buf[0] != sizeof(msg) || idx >= s->nframes ||
+		    memcmp(buf + 1, msg, sizeof(msg)))
+			bad++;
+		else
+			s->got[idx] = 1;
+	}
+	return bad;
+}
+
+static void
+noise_report(struct noise_stream *s, double ber, uint32_t hit, uint32_t bad)
+{
+	uint32_t i, j, lost = 0, extra = 0, gaps = 0, gap, gap_max = 0;
+	uint64_t gap_sum = 0;
+
+	for (i = 0; i < s->nframes; i++) {
+		lost += !s->got[i];
+		extra += !s->got[i] && s->hit[i] == ~0U;
+	}
+	/* From the end of a damaged frame to the start of the next one
+	 * that made it through.
+	 */
+	for (i = 0; i < s->nframes; i++) {
+		if (s->hit[i] == ~0U || s->got[i])
+			continue;
+		for (j = i + 1; j < s->nframes && !s->got[j]; j++)
+			;
+		if (j == s->nframes)
+			break;
+		gap = s->off[j] - s->off[i + 1];
+		gap_sum += gap;
+		if (gap > gap_max)
+			gap_max = gap;
+		gaps++;
+		i = j - 1;
+	}
+	printf("%-8g %8u %8u %8u %8u %8u %8.1f %8u %8.2f %8.2f\n", ber, s->nframes,
+	       hit, lost, extra, bad,
+	       gaps ? (double)gap_sum / gaps : 0.0, gap_max,
+	       gaps ? NOISE_BYTES_MS((double)gap_sum / gaps) : 0.0,
+	       NOISE_BYTES_MS(gap_max));
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const double bers[] = { 1e-5, 1e-4, 1e-3, 1e-2 };
+	struct noise_stream s = { 0 };
+	uint32_t nframes = 100000, hit, bad;
+	uint8_t *raw = NULL;
+	long seed = 1;
+	double ber;
+	int i, n, ret = 1;
+
+	while ((n = getopt(argc, argv, "n:s:")) != -1) {
+		switch (n) {
+		case 'n': nframes = strtoul(optarg, NULL, 0); break;
+		case 's': seed = strtol(optarg, NULL, 0); break;
+		default: usage(); return 1;
+		}
+	}
+	if (!nframes || nframes > 1 << 24) {
+		usage();
+		return 1;
+	}
+
+	srand48(seed);
+	if (noise_build(&s, nframes) < 0 || !(raw = malloc(s.len))) {
+		fprintf(stderr, "bench-noise: %s\n", strerror(errno ? errno : ENOMEM));
+		goto out;
+	}
+
+	printf("%-8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "ber", "frames",
+	       "hit", "lost", "extra", "bad-ok", "resync", "max", "ms", "max-ms");
+	n = optind < argc ? argc - optind : sizeof(bers) / sizeof(bers[0]);
+	for (i = 0; i < n; i++) {
+		ber = optind < argc ? strtod(argv[optind + i], NULL) : bers[i];
+		hit = noise_inject(&s, raw, ber);
+		bad = noise_receive(&s, raw);
+		noise_report(&s, ber, hit, bad);
+	}
+	ret = 0;
+ out:
+	free(raw);
+	free(s.data);
+	free(s.off);
+	free(s.hit);
+	free(s.got);
+	return ret;
+}
@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <termios.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "caddx.h"
+#include "util.h"
+
+/* A panel for caddx to talk to on its pty: (or a tty) link, and a load
+ * generator.  It answers what the bridge asks with canned replies and
+ * sends RATE zone status changes a second.  With -c, clients connected
+ * to the bridge time each change from the moment it went on the link.
+ *
+ * Changes carry their sequence number in the zone type flags (bytes 3-5
+ * of the zone status), the sim's replies carry SIM_NOSEQ there, so the
+ * clients can tell them apart.
+ */
+#define SIM_NOSEQ	0xffffff
+#define SIM_MAX_CLIENTS	64
+#define SIM_ZONES	192
+
+int errline = 0;
+
+static uint64_t *sent_at;	/* mono_us() of each change */
+static uint32_t nsent, max_events;
+static uint32_t *lat;		/* us, one per change a client got */
+static uint32_t nlat;
+
+struct sim_client {
+	int fd;
+	uint8_t buf[512];
+	uint32_t len;
+	uint32_t got;
+};
+
+static void
+caddx_signal(int signum)
+{
+	quit = 1;
+}
+
+static int
+sim_send(int fd, const uint8_t *msg, uint8_t len)
+{
+	uint8_t out[CADDX_FRAME_MAX(255)];
+	int n;
+
+	if ((n = caddx_frame(out, sizeof(out), msg, len)) < 0)
+		return -1;
+	return full_write(fd, out, n, 0) < 0 ? -1 : 0;
+}
+
+static int
+sim_zone(int fd, uint8_t zone, uint32_t seq, int faulted)
+{
+	uint8_t msg[CADDX_ZONE_STATUS_LEN] = { CADDX_ZONE_STATUS, zone, 1,
+		seq >> 16, seq >> 8, seq, faulted, 0 };
+
+	return sim_send(fd, msg, sizeof(msg));
+}
+
+/* Answer one request from the bridge */
+static int
+sim_answer(int fd, const uint8_t *msg, uint32_t len)
+{
+	uint8_t iface[11] = { CADDX_IFACE_CFG, 'S', 'I', 'M', '1' };
+	uint8_t part[CADDX_PART_STATUS_LEN] = { CADDX_PART_STATUS };
+	uint8_t sys[CADDX_SYSTEM_STATUS_LEN] = { CADDX_SYSTEM_STATUS };
+	uint8_t type = msg[0] & CADDX_MSG_MASK, reply;
+
+	switch (type) {
+	case CADDX_ACK:
+	case CADDX_NAK:
+	case CADDX_FAILED:
+	case CADDX_REJECTED:
+		return 0;
+	case CADDX_IFACE_CFG_REQ:
+		return sim_send(fd, iface, sizeof(iface));
+	case CADDX_ZONE_STATUS_REQ:
+		return sim_zone(fd, len > 1 ? msg[1] : 0, SIM_NOSEQ, 0);
+	case CADDX_PART_STATUS_REQ:
+		part[CADDX_PS_PART] = len > 1 ? msg[1] & 7 : 0;
+		return sim_send(fd, part, sizeof(part));
+	case CADDX_SYSTEM_STATUS_REQ:
+		return sim_send(fd, sys, sizeof(sys));
+	case CADDX_KEYPAD_FUNC0:
+	case CADDX_KEYPAD_FUNC0_NOPIN:
+	case CADDX_KEYPAD_FUNC1:
+	case CADDX_BYPASS_TOGGLE:
+		reply = CADDX_ACK;
+		break;
+	default:
+		/* Names, the log and the rest: this panel has none */
+		reply = CADDX_FAILED;
+		break;
+	}
+	return sim_send(fd, &reply, 1);
+}
+
+/* Take what the bridge sent off raw, answering every good frame */
+static int
+sim_link_rx(int fd, uint8_t *raw, uint32_t *rawlen)
+{
+	uint8_t buf[1 + 255 + 2];
+	uint16_t cksum;
+	uint32_t i = 0, used;
+	int ret;
+
+	while (1) {
+		while (i < *rawlen && raw[i] != CADDX_START)
+			i++;
+		memmove(raw, raw + i, *rawlen - i);
+		*rawlen -= i;
+		i = 0;
+		if (!(ret = caddx_unframe(raw, *rawlen, buf, sizeof(buf), &used)))
+			return 0;
+		memmove(raw, raw + used, *rawlen - used);
+		*rawlen -= used;
+		if (ret < 0 || !buf[0])
+			continue;
+		cksum = fletcher_cksum(buf, buf[0] + 1);
+		if (cksum >> 8 != buf[1 + buf[0]] || (cksum & 0xff) != buf[2 + buf[0]]) {
+			uint8_t nak = CADDX_NAK;
+			if (sim_send(fd, &nak, 1) < 0)
+				return -1;
+			continue;
+		}
+		if (sim_answer(fd, buf + 1, buf[0]) < 0)
+			return -1;
+	}
+}
+
+/* Time the changes in what a client read, legacy framing */
+static void
+sim_client_rx(struct sim_client *c)
+{
+	uint64_t now = mono_us();
+	uint8_t *msg;
+	uint32_t off = 0, seq;
+
+	while (off < c->len && off + 1 + c->buf[off] <= c->len) {
+		msg = c->buf + off + 1;
+		if (c->buf[off] == CADDX_ZONE_STATUS_LEN &&
+		    (msg[0] & CADDX_MSG_MASK) == CADDX_ZONE_STATUS) {
+			seq = msg[3] << 16 | msg[4] << 8 | msg[5];
+			if (seq < nsent && c->got < max_events) {
+				lat[nlat++] = now - sent_at[seq];
+				c->got++;
+			}
+		}
+		off += 1 + c->buf[off];
+	}
+	memmove(c->buf, c->buf + off, c->len - off);
+	c->len -= off;
+}
+
+static int
+sim_connect(char *hostport)
+{
+	struct addrinfo gai = { 0 }, *ai, *pai;
+	char *host = strdup(hostport), *port;
+	int fd = -1, i;
+
+	errno = 0;
+	if (!host)
+		ERR(ENOMEM);
+	if (!(port = rindex(host, ':')))
+		ERR(EINVAL);
+	*(port++) = 0;
+	gai.ai_family = AF_UNSPEC;
+	gai.ai_socktype = SOCK_STREAM;
+	if ((i = getaddrinfo(host, port, &gai, &ai)) != 0)
+		ERR(EHOSTUNREACH);
+	for (pai = ai; pai; pai = pai->ai_next) {
+		if ((fd = socket(pai->ai_family, pai->ai_socktype, pai->ai_protocol)) < 0)
+			continue;
+		if (connect(fd, pai->ai_addr, pai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	if (fd < 0)
+		ERR(errno ? errno : ECONNREFUSED);
+
+ error:
+	free(host);
+	return fd;
+}
+
+static int
+lat_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+usage(void)
+{
+	printf("\
+Usage: caddx-sim [flags] LINK\n\
+Be the panel on LINK, e.g. the PATH of caddx -t pty:PATH\n\
+-c ...: Connect clients to the bridge at HOST:PORT and time the changes\n\
+-d ...: Seconds of load (default 10)\n\
+-n ...: Clients for -c (default 1)\n\
+-r ...: Zone status changes a second (default 100)\n\
+-v    : Increase verbosity\n\
+");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sim_client clients[SIM_MAX_CLIENTS];
+	struct pollfd pfd[1 + SIM_MAX_CLIENTS];
+	uint8_t raw[1024], zone_faulted[SIM_ZONES] = { 0 };
+	uint32_t rawlen = 0, rate = 100, secs = 10, nclients = 1, i, got;
+	uint64_t start, end, now;
+	char *bridge = NULL;
+	struct sigaction action;
+	struct termios tio;
+	int fd = -1, n;
+
+	while ((n = getopt(argc, argv, "c:d:n:r:v")) != -1) {
+		switch (n) {
+		case 'c': bridge = optarg; break;
+		case 'd': secs = strtoul(optarg, NULL, 0); break;
+		case 'n': nclients = strtoul(optarg, NULL, 0); break;
+		case 'r': rate = strtoul(optarg, NULL, 0); break;
+		case 'v': loglevel++; break;
+		default: usage(); return -1;
+		}
+	}
+	if (optind != argc - 1 || !rate || !nclients || nclients > SIM_MAX_CLIENTS) {
+		usage();
+		return -1;
+	}
+
+	for (i = 0; i < SIM_MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = caddx_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	errno = 0;
+	max_events = rate * secs;
+	if (max_events >= SIM_NOSEQ)
+		ERR(E2BIG);
+	if (!(sent_at = calloc(max_events, sizeof(*sent_at))) ||
+	    !(lat = calloc((size_t)max_events * nclients, sizeof(*lat))))
+		ERR(ENOMEM);
+
+	if ((fd = open(argv[optind], O_RDWR | O_NOCTTY)) < 0)
+		ERR(errno);
+	if (isatty(fd) && tcgetattr(fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+
+	for (i = 0; bridge && i < nclients; i++) {
+		memset(&clients[i], 0, sizeof(clients[i]));
+		clients[i].fd = -1;
+		if ((clients[i].fd = sim_connect(bridge)) < 0)
+			ERR(errno);
+		pfd[1 + i].fd = clients[i].fd;
+		pfd[1 + i].events = POLLIN;
+	}
+	if (!bridge)
+		nclients = 0;
+
+	/* Let the bridge sync before the load starts */
+	start = mono_us() + 1000000;
+	end = start + secs * 1000000ULL;
+	while (!quit && (now = mono_us()) < end + 1000000) {
+		/* Catch up with where the rate says we should be */
+		while (now >= start && now < end && nsent < max_events &&
+		       nsent < (now - start) * rate / 1000000) {
+			uint8_t z = nsent % SIM_ZONES;
+			zone_faulted[z] ^= 1;
+			sent_at[nsent] = mono_us();
+			if (sim_zone(fd, z, nsent, zone_faulted[z]) < 0)
+				ERR(errno);
+			nsent++;
+		}
+
+		if ((n = poll(pfd, 1 + nclients, 1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			ERR(errno);
+		}
+		if (pfd[0].revents & POLLIN) {
+			if ((n = read(fd, raw + rawlen, sizeof(raw) - rawlen)) <= 0)
+				ERR(n ? errno : EPIPE);
+			rawlen += n;
+			if (sim_link_rx(fd, raw, &rawlen) < 0)
+				ERR(errno);
+			/* Nothing in there resembles a frame, start over */
+			if (rawlen == sizeof(raw))
+				rawlen = 0;
+		}
+		for (i = 0; i < nclients; i++) {
+			struct sim_client *c = &clients[i];
+			if (!(pfd[1 + i].revents & (POLLIN | POLLHUP)))
+				continue;
+			if ((n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len)) <= 0)
+				ERR(n ? errno : EPIPE);
+			c->len += n;
+			sim_client_rx(c);
+		}
+	}
+
+	printf("sent %u changes in %u s\n", nsent, secs);
+	for (i = 0, got = 0; i < nclients; i++)
+		got += clients[i].got;
+	if (nclients && nlat) {
+		qsort(lat, nlat, sizeof(*lat), lat_cmp);
+		printf("clients got %u of %u, latency us: p50 %u p99 %u max %u\n",
+		       got, nsent * nclients, lat[nlat / 2], lat[nlat * 99 / 100],
+		       lat[nlat - 1]);
+	} else if (nclients)
+		printf("clients got 0 of %u\n", nsent * nclients);
+	errno = (nclients && got < nsent * nclients) ? EIO : 0;
+
+ error:
+	for (i = 0; i < SIM_MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			close(clients[i].fd);
+	if (fd >= 0)
+		close(fd);
+	free(sent_at);
+	free(lat);
+	if (errno && errline) {
+		err("%s: error: %s @%d\n", __func__, strerror(errno), errline);
+		return -1;
+	}
+	return errno ? -1 : 0;
+}
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "caddx.h"
+
+/* Fuzz target for the link codec: the input is taken as bytes off the
+ * serial link and cut into frames the way caddx does, skipping to a
+ * start byte, unframing and checking the sum.  Frames that pass go
+ * through caddx_decode() and, if it takes them, are framed again and
+ * must come back the same.
+ *
+ * Built with -DCONFIG_LIBFUZZER it is a libFuzzer target, otherwise a
+ * program that runs the files named on its command line, or stdin, for
+ * AFL and for replaying what a fuzzer found.
+ */
+
+static void
+fuzz_check(const uint8_t *buf)
+{
+	uint8_t raw[CADDX_FRAME_MAX(255)], again[1 + 255 + 2];
+	const struct caddx_msg_info *info;
+	struct caddx_view v;
+	volatile uint8_t sink = 0;
+	uint32_t used, i;
+	uint16_t cksum;
+	int n;
+
+	cksum = fletcher_cksum(buf, buf[0] + 1);
+	if (!buf[0] || cksum >> 8 != buf[1 + buf[0]] || (cksum & 0xff) != buf[2 + buf[0]])
+		return;
+	if (caddx_decode(&v, buf + 1, buf[0]) < 0)
+		return;
+
+	/* Everything up to info->min is fair game for the accessors */
+	info = v.info;
+	if (v.len < info->min || v.len > info->max)
+		abort();
+	for (i = 0; i < info->min; i++)
+		sink ^= caddx_byte(&v, i);
+
+	if ((n = caddx_frame(raw, sizeof(raw), v.msg, v.len)) < 0)
+		abort();
+	if (caddx_unframe(raw, n, again, sizeof(again), &used) != 1 ||
+	    used != (uint32_t)n || memcmp(again, buf, 1 + buf[0] + 2))
+		abort();
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	uint8_t buf[1 + 255 + 2];
+	uint32_t off = 0, used;
+	int ret;
+
+	while (off < size) {
+		if (data[off] != CADDX_START) {
+			off++;
+			continue;
+		}
+		ret = caddx_unframe(data + off, size - off, buf, sizeof(buf), &used);
+		if (!ret)
+			break;
+		/* A frame, good or bad, has to move things along */
+		if (!used || used > size - off)
+			abort();
+		off += used;
+		if (ret > 0)
+			fuzz_check(buf);
+	}
+	return 0;
+}
+
+#ifndef CONFIG_LIBFUZZER
+static int
+fuzz_file(FILE *f)
+{
+	static uint8_t data[1 << 20];
+	size_t len = fread(data, 1, sizeof(data), f);
+
+	if (ferror(f))
+		return -1;
+	LLVMFuzzerTestOneInput(data, len);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *f;
+	int i;
+
+	if (argc < 2)
+		return fuzz_file(stdin) < 0 ? 1 : 0;
+	for (i = 1; i < argc; i++) {
+		if (!(f = fopen(argv[i], "rb"))) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			return 1;
+		}
+		if (fuzz_file(f) < 0) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			fclose(f);
+			return 1;
+		}
+		fclose(f);
+	}
+	return 0;
+}
+#endif
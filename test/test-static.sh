@@ -0,0 +1,70 @@
+#!/bin/bash
+# caddx built with CONFIG_STATIC_MEM under a steady load from caddx-sim:
+# once it is up, with the clients connected and the stats scraped once,
+# it must not allocate any more, and its peak RSS must stay under
+# RSS_MAX KiB.
+#
+# RATE changes a second for SECS seconds, to CLIENTS clients.
+
+RATE=${RATE:-1000}
+SECS=${SECS:-10}
+CLIENTS=${CLIENTS:-16}
+PORT=${PORT:-15872}
+RSS_MAX=${RSS_MAX:-4096}
+CADDX=${CADDX:-./test/caddx-static}
+
+dir=$(mktemp -d) || exit 1
+trap 'kill $pid $sim 2>/dev/null; rm -rf $dir' EXIT
+
+scrape() {
+	exec 3<>/dev/tcp/127.0.0.1/$((PORT + 1)) || return 1
+	printf 'GET /metrics HTTP/1.0\r\n\r\n' >&3
+	cat <&3 > /dev/null
+	exec 3<&-
+}
+
+allocs() {
+	kill -USR2 $pid
+	sleep 0.2
+	sed -n '$s/.* allocs \([0-9]*\)/\1/p' $dir/count
+}
+
+COUNT_OUT=$dir/count LD_PRELOAD=./test/count.so \
+	$CADDX -f -t pty:$dir/tty -l 127.0.0.1:$PORT -w 127.0.0.1:$((PORT + 1)) > $dir/log 2>&1 &
+pid=$!
+while [ ! -e $dir/tty ]; do sleep 0.1; done
+
+./test/caddx-sim -c 127.0.0.1:$PORT -n $CLIENTS -r $RATE -d $SECS $dir/tty > $dir/sim &
+sim=$!
+# The load starts a second after the sim
+sleep 1.5
+scrape
+before=$(allocs)
+
+for i in $(seq 1 $((SECS - 1))); do
+	sleep 1
+	scrape
+done
+wait $sim
+sim_ret=$?
+after=$(allocs)
+rss=$(sed -n 's/^VmHWM:[^0-9]*\([0-9]*\).*/\1/p' /proc/$pid/status)
+kill $pid
+wait $pid 2>/dev/null
+
+cat $dir/sim
+echo "allocs after startup: $((after - before)), peak RSS: $rss KiB"
+ret=0
+if [ $sim_ret -ne 0 ]; then
+	echo "FAIL: clients missed changes"
+	ret=1
+fi
+if [ -z "$before" ] || [ "$after" != "$before" ]; then
+	echo "FAIL: caddx allocated after startup"
+	ret=1
+fi
+if [ "$rss" -gt $RSS_MAX ]; then
+	echo "FAIL: peak RSS over $RSS_MAX KiB"
+	ret=1
+fi
+exit $ret
@@ -1,35 +1,208 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#ifdef CONFIG_IO_URING
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "util.h"
 
 int loglevel = 0;
 int log_syslog = 0;
 int quit = 0;
 
+/* Log messages go into a ring of fixed records and a thread of their
+ * own writes them out, so neither stdio nor the syslog round trip holds
+ * up the main loop.  Only the main thread logs; a full ring drops the
+ * message and counts it in log_dropped.  Until log_start() and in forked
+ * children, messages go out right away as before.
+ */
+#define LOG_RING	1024
+#define LOG_REC_LEN	128
+
+struct log_rec {
+	uint8_t level;
+	uint8_t len;
+	char text[LOG_REC_LEN - 2];
+};
+
+static struct log_rec log_ring[LOG_RING];
+static uint32_t log_head, log_tail;
+static int log_async = 0, log_sleeping = 0, log_quit = 0, log_efd = -1;
+static pthread_t log_tid;
+uint64_t log_dropped = 0;
+
+static int
+log_syslog_level(int level)
+{
+	switch (level) {
+	case 0: return LOG_ERR;
+	case 1: return LOG_WARNING;
+	case 2: return LOG_INFO;
+	default: return LOG_DEBUG;
+	}
+}
+
+static void
+log_put(int level, const char *fmt, va_list ap)
+{
+	uint32_t head = log_head;
+	struct log_rec *r;
+	int n;
+
+	if (head - __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) == LOG_RING) {
+		__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	r = &log_ring[head % LOG_RING];
+	if ((n = vsnprintf(r->text, sizeof(r->text), fmt, ap)) < 0)
+		n = 0;
+	if (n >= (int)sizeof(r->text)) {
+		n = sizeof(r->text) - 1;
+		r->text[n - 1] = '\n';
+	}
+	r->level = level;
+	r->len = n;
+	__atomic_store_n(&log_head, head + 1, __ATOMIC_SEQ_CST);
+	/* One wakeup per burst, the thread goes through all of it */
+	if (__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&log_sleeping, 0, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (write(log_efd, &one, sizeof(one)) < 0) {}
+	}
+}
+
+static void *
+log_thread(void *arg)
+{
+	uint64_t dropped = 0, n;
+	uint32_t tail;
+	struct log_rec *r;
+
+	for (;;) {
+		tail = log_tail;
+		if (tail != __atomic_load_n(&log_head, __ATOMIC_ACQUIRE)) {
+			r = &log_ring[tail % LOG_RING];
+			if (log_syslog)
+				syslog(log_syslog_level(r->level), "%.*s", r->len, r->text);
+			else
+				fwrite(r->text, 1, r->len, stdout);
+			__atomic_store_n(&log_tail, tail + 1, __ATOMIC_RELEASE);
+			continue;
+		}
+		if ((n = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED)) != dropped) {
+			if (log_syslog)
+				syslog(LOG_WARNING, "%llu log messages dropped\n",
+				       (unsigned long long)(n - dropped));
+			else
+				printf("%llu log messages dropped\n", (unsigned long long)(n - dropped));
+			dropped = n;
+		}
+		if (!log_syslog)
+			fflush(stdout);
+		if (__atomic_load_n(&log_quit, __ATOMIC_ACQUIRE))
+			break;
+
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (tail != __atomic_load_n(&log_head, __ATOMIC_SEQ_CST) ||
+		    __atomic_load_n(&log_quit, __ATOMIC_SEQ_CST)) {
+			__atomic_store_n(&log_sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if (read(log_efd, &n, sizeof(n)) < 0 && errno != EINTR)
+			break;
+	}
+	return NULL;
+}
+
+/* A child has no log thread, what it says goes out right away */
+static void
+log_child(void)
+{
+	log_async = 0;
+}
+
+int
+log_start(void)
+{
+	static int atfork = 0;
+	sigset_t all, old;
+	int e;
+
+	if (log_async)
+		return 0;
+	if (!atfork && pthread_atfork(NULL, NULL, log_child) != 0)
+		return -1;
+	atfork = 1;
+	if ((log_efd = eventfd(0, EFD_CLOEXEC)) < 0)
+		return -1;
+	log_quit = 0;
+	fflush(stdout);
+	/* Signals are for the main loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	e = pthread_create(&log_tid, NULL, log_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (e) {
+		close(log_efd);
+		log_efd = -1;
+		errno = e;
+		return -1;
+	}
+	log_async = 1;
+	return 0;
+}
+
+/* Write out what is left and go back to logging right away */
+void
+log_stop(void)
+{
+	uint64_t one = 1;
+	int e = errno;
+
+	if (!log_async)
+		return;
+	__atomic_store_n(&log_quit, 1, __ATOMIC_SEQ_CST);
+	if (write(log_efd, &one, sizeof(one)) < 0) {}
+	pthread_join(log_tid, NULL);
+	close(log_efd);
+	log_efd = -1;
+	log_async = 0;
+	errno = e;
+}
+
 void
 message(int level, const char *fmt, ...)
 {
-	char buf[128];
 	va_list ap;
-	int syslog_level = 0;
 
 	if (level > loglevel)
 		return;
 
-	switch (level) {
-	case 0: syslog_level = LOG_ERR; break;
-	case 1: syslog_level = LOG_WARNING; break;
-	case 2: syslog_level = LOG_INFO; break;
-	default: syslog_level = LOG_DEBUG; break;
-	}
-
-	buf[sizeof(buf) - 1] = 0;
 	va_start(ap, fmt);
-	if (log_syslog)
-		vsyslog(syslog_level, fmt, ap);
+	if (log_async)
+		log_put(level, fmt, ap);
+	else if (log_syslog)
+		vsyslog(log_syslog_level(level), fmt, ap);
 	else vprintf(fmt, ap);
 	va_end(ap);
 }
@@ -74,22 +247,816 @@ full_read(int fd, uint8_t *buf, uint32_t len, int eagain_quit)
 	return done;
 }
 
-uint16_t
-fletcher_cksum(uint8_t *data, uint32_t len)
+uint64_t
+mono_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t
+mono_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Listen to HOST:PORT, listen_to is cut at the ':' */
+int
+listen_open(char *listen_to)
+{
+	struct addrinfo gai = { 0 }, *ai, *pai;
+	char *port;
+	int sfd = -1, i;
+
+	errno = 0;
+	if ((port = rindex(listen_to, ':')) == NULL)
+		ERR(EINVAL);
+	*(port++) = 0;
+
+	gai.ai_family = AF_UNSPEC;
+	gai.ai_socktype = SOCK_STREAM;
+	if ((i = getaddrinfo(listen_to, port, (const struct addrinfo *)&gai, &ai)) != 0)
+		ERR(i);
+
+	for (pai = ai; pai; pai = pai->ai_next) {
+		if ((sfd = socket(pai->ai_family, pai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				  pai->ai_protocol)) < 0)
+			continue;
+
+		i = 1;
+		setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+
+		if (bind(sfd, pai->ai_addr, pai->ai_addrlen) < 0) {
+ sock_error:
+			close(sfd);
+			continue;
+		}
+
+		if (listen(sfd, 64) < 0)
+			goto sock_error;
+		break;
+	}
+	freeaddrinfo(ai);
+	if (!pai) {
+		if (!errno)
+			errno = EINVAL;
+		ERR(errno);
+	}
+	return sfd;
+
+ error:
+	return -1;
+}
+
+/* Statistics.  Both programs run on a single thread, so counters are
+ * plain integers bumped in place and only formatted when somebody asks,
+ * in the Prometheus text format.  Histogram buckets are powers of two.
+ */
+void
+stat_hist_add(struct stat_hist *h, uint64_t v)
+{
+	uint32_t i = 0;
+
+	while (i < STAT_HIST_LEN - 1 && v > (1ULL << i))
+		i++;
+	h->bucket[i]++;
+	h->sum += v;
+	h->count++;
+}
+
+#define STATS_TEXT_LEN	32768
+
+/* The text is made in one buffer that is kept for the next time.  It
+ * grows as needed, or with CONFIG_STATIC_MEM is there from the start
+ * and a text that does not fit is ENOBUFS.
+ */
+#ifdef CONFIG_STATIC_MEM
+static char stats_static[STATS_TEXT_LEN];
+static char *stats_buf = stats_static;
+static size_t stats_size = sizeof(stats_static);
+#else
+static char *stats_buf = NULL;
+static size_t stats_size = 0;
+#endif
+
+static int
+stats_put(size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+#ifndef CONFIG_STATIC_MEM
+	char *p;
+#endif
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(stats_buf + *len, stats_size - *len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return -1;
+		if (*len + n < stats_size) {
+			*len += n;
+			return 0;
+		}
+#ifdef CONFIG_STATIC_MEM
+		errno = ENOBUFS;
+		return -1;
+#else
+		if (!(p = realloc(stats_buf, stats_size + STATS_TEXT_LEN))) {
+			errno = ENOMEM;
+			return -1;
+		}
+		stats_buf = p;
+		stats_size += STATS_TEXT_LEN;
+#endif
+	}
+}
+
+/* Returns the text, good until the next call, or NULL on error */
+char *
+stats_text(const struct stat_def *defs, uint32_t n, size_t *len)
+{
+	static const char *types[] = { "counter", "gauge", "histogram" };
+	const struct stat_def *d;
+	struct stat_hist *h;
+	uint64_t sum;
+	uint32_t i;
+
+	*len = 0;
+	for (d = defs; d < defs + n; d++) {
+		if (stats_put(len, "# HELP %s %s\n# TYPE %s %s\n", d->name, d->help,
+			      d->name, types[d->type]) < 0)
+			return NULL;
+		if (d->type != STAT_HIST) {
+			if (stats_put(len, "%s %llu\n", d->name,
+				      (unsigned long long)*(uint64_t *)d->val) < 0)
+				return NULL;
+			continue;
+		}
+		h = d->val;
+		for (sum = 0, i = 0; i < STAT_HIST_LEN - 1; i++) {
+			sum += h->bucket[i];
+			if (stats_put(len, "%s_bucket{le=\"%llu\"} %llu\n", d->name,
+				      1ULL << i, (unsigned long long)sum) < 0)
+				return NULL;
+		}
+		if (stats_put(len, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %llu\n%s_count %llu\n",
+			      d->name, (unsigned long long)h->count,
+			      d->name, (unsigned long long)h->sum,
+			      d->name, (unsigned long long)h->count) < 0)
+			return NULL;
+	}
+	return stats_buf;
+}
+
+/* Answer a scrape on fd, which has sent its request */
+int
+stats_serve(int fd, const struct stat_def *defs, uint32_t n)
+{
+	char hdr[128], *text;
+	size_t len;
+	int i, ret = -1;
+
+	if (!(text = stats_text(defs, n, &len)))
+		return -1;
+	i = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+		     "Content-Type: text/plain; version=0.0.4\r\n"
+		     "Content-Length: %zu\r\n\r\n", len);
+	if (full_write(fd, (uint8_t *)hdr, i, 1) == i &&
+	    full_write(fd, (uint8_t *)text, len, 1) == (int)len)
+		ret = 0;
+	return ret;
+}
+
+/* Dump everything to the log, e.g. on SIGUSR1 */
+void
+stats_log(const struct stat_def *defs, uint32_t n)
+{
+	char *text, *line, *next;
+	size_t len;
+
+	if (!(text = stats_text(defs, n, &len)))
+		return;
+	for (line = text; *line; line = next) {
+		next = strchr(line, '\n');
+		*(next++) = 0;
+		if (*line != '#')
+			err("%s\n", line);
+	}
+}
+
+/* Fixed-size objects carved out of one allocation at startup.  Free
+ * ones are chained through their first word, so getting and putting one
+ * is a pointer swap; running out is ENOBUFS.
+ */
+int
+pool_init(struct pool *p, size_t size, uint32_t n)
 {
-	uint8_t sum1 = 0, sum2 = 0;
 	uint32_t i;
-	for (i = 0; i < len; i++) {
-		if (255 - sum1 < data[i])
-			sum1++;
-		sum1 += data[i];
-		if (sum1 == 255)
-			sum1 = 0;
-		if (255 - sum2 < sum1)
-			sum2++;
-		sum2 += sum1;
-		if (sum2 == 255)
-			sum2 = 0;
-	}
-	return (sum1 << 8) | sum2;
+
+	/* Room for the chain and aligned like malloc() would */
+	size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+	if (!(p->mem = calloc(n, size))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	p->free = NULL;
+	for (i = n; i--; ) {
+		*(void **)(p->mem + i * size) = p->free;
+		p->free = p->mem + i * size;
+	}
+	p->avail = n;
+	return 0;
+}
+
+void *
+pool_get(struct pool *p)
+{
+	void *obj;
+
+	if (!(obj = p->free)) {
+		errno = ENOBUFS;
+		return NULL;
+	}
+	p->free = *(void **)obj;
+	p->avail--;
+	return obj;
+}
+
+void
+pool_put(struct pool *p, void *obj)
+{
+	*(void **)obj = p->free;
+	p->free = obj;
+	p->avail++;
+}
+
+/* I/O engine.  Reads and accepts stay armed on their fds and complete
+ * into buffers owned by the engine, so a buffer can never outlive its
+ * op.  The select() engine emulates that with read()/accept4() once an
+ * fd is readable; the io_uring engine keeps the ops queued in the kernel,
+ * reads into registered buffers and submits all client writes of a round
+ * with one io_uring_enter().
+ */
+enum {
+	IO_OP_FREE,
+	IO_OP_ARMED,		/* waiting for data / connections */
+	IO_OP_REARM,		/* completed, arm again on the next io_wait() */
+	IO_OP_IDLE,		/* hit EOF or an error, wait for io_cancel() */
+	IO_OP_DONE,		/* one-shot op completed, freed on the next io_wait() */
+	IO_OP_DEAD,		/* cancelled, freed once io_uring lets go of it */
+};
+
+struct io_op {
+	int fd;
+	int type;
+	int state;
+	int queued;		/* io_uring still holds it */
+	void *data;
+};
+
+static struct io_op io_ops[IO_MAX_OPS];
+static uint8_t io_bufs[IO_MAX_OPS][IO_BUF_LEN];
+/* Every op completes at most once per round, except that the select()
+ * engine drains up to IO_ACCEPT_BATCH more connections from listeners.
+ */
+static struct io_event io_evs[IO_MAX_OPS + IO_ACCEPT_BATCH];
+static uint32_t io_nevs, io_cur;
+static int io_uring_on = 0;
+
+static int
+io_op_new(int fd, int type, void *data)
+{
+	int i;
+
+	for (i = 0; i < IO_MAX_OPS; i++)
+		if (io_ops[i].state == IO_OP_FREE)
+			break;
+	if (i == IO_MAX_OPS) {
+		errno = EMFILE;
+		return -1;
+	}
+	io_ops[i].fd = fd;
+	io_ops[i].type = type;
+	io_ops[i].state = IO_OP_REARM;
+	io_ops[i].queued = 0;
+	io_ops[i].data = data;
+	return i;
+}
+
+static struct io_event *
+io_ev_new(int op, int res)
+{
+	struct io_event *ev = &io_evs[io_nevs++];
+
+	ev->fd = io_ops[op].fd;
+	ev->type = io_ops[op].type;
+	ev->res = res;
+	ev->buf = io_bufs[op];
+	ev->data = io_ops[op].data;
+	ev->op = op;
+	return ev;
+}
+
+#ifdef CONFIG_IO_URING
+#define IO_RING_ENTRIES	256
+#define IO_TAG_CANCEL	(~0ULL)
+#define IO_TAG_WRITE	(1ULL << 32)
+
+static struct {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned queued;
+	void *ring;
+	size_t ring_len;
+} ring = { .fd = -1 };
+
+/* Completions that arrived while waiting for writes.  A read or poll
+ * op has at most one outstanding, see uring_shed() for the rest.
+ */
+static struct io_uring_cqe io_backlog[IO_MAX_OPS + IO_ACCEPT_BATCH];
+static uint32_t io_nbacklog;
+static struct msghdr io_msgs[IO_MAX_OPS];
+
+static int
+uring_enter(unsigned submit, unsigned wait, int timeout)
+{
+	struct io_uring_getevents_arg arg = { 0 };
+	struct __kernel_timespec ts = { timeout / 1000, (timeout % 1000) * 1000000 };
+	int flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, i;
+
+	if (timeout >= 0)
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	if (!wait)
+		flags = 0;
+	i = syscall(__NR_io_uring_enter, ring.fd, submit, wait, flags,
+		    flags ? &arg : NULL, flags ? sizeof(arg) : 0);
+	if (i < 0 && errno != ETIME && errno != EINTR)
+		return -1;
+	ring.queued -= (i > 0) ? (unsigned)i : 0;
+	return 0;
+}
+
+static struct io_uring_sqe *
+uring_sqe(void)
+{
+	unsigned tail = *ring.sq_tail, head;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head == ring.entries) {
+		if (uring_enter(ring.queued, 0, 0) < 0)
+			return NULL;
+		head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head == ring.entries)
+			return NULL;
+	}
+	sqe = &ring.sqes[tail & *ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.queued++;
+	return sqe;
+}
+
+static int
+uring_arm(int op)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = uring_sqe()))
+		return -1;
+	sqe->fd = io_ops[op].fd;
+	sqe->user_data = op;
+	if (io_ops[op].type == IO_EV_READ) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t)io_bufs[op];
+		sqe->len = IO_BUF_LEN;
+		sqe->buf_index = 0;
+		/* A tty has no file position */
+		sqe->off = -1;
+	} else if (io_ops[op].type == IO_EV_ACCEPT) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	} else {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLOUT;
+	}
+	io_ops[op].state = IO_OP_ARMED;
+	io_ops[op].queued = 1;
+	return 0;
+}
+
+static void
+uring_complete(struct io_uring_cqe *cqe)
+{
+	struct io_op *op;
+
+	if (cqe->user_data == IO_TAG_CANCEL || cqe->user_data >= IO_MAX_OPS)
+		return;
+	op = &io_ops[cqe->user_data];
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		op->queued = 0;
+
+	if (op->state == IO_OP_DEAD)
+		return;
+	if (op->type == IO_EV_ACCEPT) {
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			op->state = IO_OP_REARM;
+	} else if (op->type == IO_EV_WRITABLE) {
+		op->state = IO_OP_DONE;
+	} else op->state = (cqe->res > 0) ? IO_OP_REARM : IO_OP_IDLE;
+
+	if (cqe->res == -ECANCELED) {
+		/* Taken back by io_stop(), the next io_wait() arms it again */
+		op->state = IO_OP_REARM;
+		return;
+	}
+	io_ev_new(cqe->user_data, cqe->res);
+}
+
+/* Deal with cqe here rather than put it in io_backlog: cancellations
+ * need nothing, and connections beyond IO_ACCEPT_BATCH are turned away
+ * so that a flood of them cannot fill it.  Returns 1 if cqe is done.
+ */
+static int
+uring_shed(struct io_uring_cqe *cqe)
+{
+	struct io_op *op;
+
+	if (cqe->user_data == IO_TAG_CANCEL || cqe->user_data >= IO_MAX_OPS)
+		return 1;
+	op = &io_ops[cqe->user_data];
+	if (op->type != IO_EV_ACCEPT || io_nbacklog < IO_ACCEPT_BATCH)
+		return 0;
+	if (cqe->res >= 0)
+		close(cqe->res);
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		op->queued = 0;
+		if (op->state != IO_OP_DEAD)
+			op->state = IO_OP_REARM;
+	}
+	return 1;
+}
+
+/* Take completions off the ring.  While writes are outstanding (w is
+ * set) their results go to w and everything else waits in io_backlog,
+ * which always has room for what uring_shed() leaves.
+ */
+static void
+uring_reap(struct io_wr *w, uint32_t *done)
+{
+	unsigned head = *ring.cq_head, tail;
+
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		if (cqe->user_data != IO_TAG_CANCEL && (cqe->user_data & IO_TAG_WRITE)) {
+			if (w) {
+				w[cqe->user_data & ~IO_TAG_WRITE].res = cqe->res;
+				(*done)++;
+			}
+		} else if (w || io_nevs == IO_MAX_OPS) {
+			if (!uring_shed(cqe))
+				io_backlog[io_nbacklog++] = *cqe;
+		} else uring_complete(cqe);
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Hand out completions that were put aside earlier */
+static void
+uring_backlog(void)
+{
+	uint32_t n = io_nbacklog, i;
+
+	io_nbacklog = 0;
+	for (i = 0; i < n && io_nevs < IO_MAX_OPS; i++)
+		uring_complete(&io_backlog[i]);
+	memmove(io_backlog, io_backlog + i, (n - i) * sizeof(*io_backlog));
+	io_nbacklog = n - i;
+}
+
+static int
+uring_init(void)
+{
+	struct io_uring_params p;
+	struct iovec iov = { io_bufs, sizeof(io_bufs) };
+	size_t sq_len, cq_len;
+	uint8_t *sq;
+
+	memset(&p, 0, sizeof(p));
+	if ((ring.fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &p)) < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOSYS;
+		goto error;
+	}
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.ring_len = sq_len > cq_len ? sq_len : cq_len;
+	ring.ring = mmap(NULL, ring.ring_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.ring == MAP_FAILED)
+		goto error;
+	sq = ring.ring;
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto error;
+
+	ring.entries = p.sq_entries;
+	ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.cq_head = (unsigned *)(sq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(sq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+		goto error;
+	return 0;
+
+ error:
+	if (ring.ring && ring.ring != MAP_FAILED)
+		munmap(ring.ring, ring.ring_len);
+	close(ring.fd);
+	ring.fd = -1;
+	return -1;
+}
+#endif /* CONFIG_IO_URING */
+
+int
+io_init(int uring)
+{
+	memset(io_ops, 0, sizeof(io_ops));
+	io_nevs = io_cur = 0;
+#ifdef CONFIG_IO_URING
+	if (uring) {
+		if (uring_init() == 0) {
+			io_uring_on = 1;
+			return 0;
+		}
+		warn("io_uring unavailable (%s), using select\n", strerror(errno));
+	}
+#else
+	if (uring)
+		warn("built without io_uring, using select\n");
+#endif
+	return 0;
+}
+
+const char *
+io_engine(void)
+{
+	return io_uring_on ? "io_uring" : "select";
+}
+
+int
+io_watch(int fd, int type, void *data)
+{
+	int op = io_op_new(fd, type, data);
+
+	if (op < 0)
+		return -1;
+#ifdef CONFIG_IO_URING
+	if (io_uring_on && uring_arm(op) < 0) {
+		io_ops[op].state = IO_OP_FREE;
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+void
+io_cancel(int fd)
+{
+	int i;
+
+	for (i = 0; i < IO_MAX_OPS; i++) {
+		struct io_op *op = &io_ops[i];
+		if (op->state == IO_OP_FREE || op->state == IO_OP_DEAD || op->fd != fd)
+			continue;
+#ifdef CONFIG_IO_URING
+		if (io_uring_on && op->state == IO_OP_ARMED) {
+			struct io_uring_sqe *sqe = uring_sqe();
+			if (sqe) {
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->addr = i;
+				sqe->user_data = IO_TAG_CANCEL;
+			}
+			op->state = IO_OP_DEAD;
+			continue;
+		}
+#endif
+		/* Not reused before the next io_wait(), io_next() skips its events */
+		op->state = IO_OP_DEAD;
+	}
+#ifdef CONFIG_IO_URING
+	/* The cancellations must reach the kernel before fd is closed */
+	if (io_uring_on && ring.queued)
+		uring_enter(ring.queued, 0, 0);
+#endif
+}
+
+/* Wait up to timeout ms for events, then fetch them with io_next() */
+int
+io_wait(int timeout)
+{
+	int i;
+
+	io_nevs = io_cur = 0;
+	for (i = 0; i < IO_MAX_OPS; i++) {
+		struct io_op *op = &io_ops[i];
+		if (op->state == IO_OP_DONE ||
+		    (op->state == IO_OP_DEAD && !op->queued))
+			op->state = IO_OP_FREE;
+	}
+#ifdef CONFIG_IO_URING
+	if (io_uring_on) {
+		for (i = 0; i < IO_MAX_OPS; i++)
+			if (io_ops[i].state == IO_OP_REARM && uring_arm(i) < 0)
+				return -1;
+		uring_backlog();
+		if (uring_enter(ring.queued, io_nevs ? 0 : 1, timeout) < 0)
+			return -1;
+		uring_reap(NULL, NULL);
+		return io_nevs;
+	}
+#endif
+	{
+		fd_set rfds, wfds;
+		struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+		int max_fd = -1, fd, extra = 0;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		for (i = 0; i < IO_MAX_OPS; i++) {
+			struct io_op *op = &io_ops[i];
+			if (op->state == IO_OP_REARM)
+				op->state = IO_OP_ARMED;
+			if (op->state != IO_OP_ARMED)
+				continue;
+			FD_SET(op->fd, op->type == IO_EV_WRITABLE ? &wfds : &rfds);
+			if (op->fd > max_fd)
+				max_fd = op->fd;
+		}
+		if ((i = select(max_fd + 1, &rfds, &wfds, NULL, &tv)) <= 0)
+			return (i < 0 && errno != EINTR) ? -1 : 0;
+
+		for (i = 0; i < IO_MAX_OPS; i++) {
+			struct io_op *op = &io_ops[i];
+			if (op->state != IO_OP_ARMED)
+				continue;
+			if (op->type == IO_EV_WRITABLE) {
+				if (FD_ISSET(op->fd, &wfds)) {
+					io_ev_new(i, 0);
+					op->state = IO_OP_DONE;
+				}
+				continue;
+			}
+			if (!FD_ISSET(op->fd, &rfds))
+				continue;
+			if (op->type == IO_EV_ACCEPT) {
+				/* Listeners are non-blocking, take all that is pending */
+				do {
+					fd = accept4(op->fd, NULL, NULL,
+						     SOCK_NONBLOCK | SOCK_CLOEXEC);
+					if (fd < 0 && (errno == EAGAIN || errno == EINTR))
+						break;
+					io_ev_new(i, fd < 0 ? -errno : fd);
+				} while (fd >= 0 && extra++ < IO_ACCEPT_BATCH);
+				continue;
+			}
+			fd = read(op->fd, io_bufs[i], IO_BUF_LEN);
+			if (fd < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			if (op->type == IO_EV_READ && fd <= 0)
+				op->state = IO_OP_IDLE;
+			io_ev_new(i, fd < 0 ? -errno : fd);
+		}
+	}
+	return io_nevs;
+}
+
+/* Take back whatever ops the kernel holds, so that nothing reads from
+ * or accepts on the fds behind our back any more.  What they completed
+ * with meanwhile comes out of io_next() as usual and the next io_wait()
+ * arms them again.  Returns the number of events; call it until that is
+ * 0, handling the events in between.
+ */
+int
+io_stop(void)
+{
+	io_nevs = io_cur = 0;
+#ifdef CONFIG_IO_URING
+	if (io_uring_on) {
+		int i, busy, tries = 50;
+
+		for (i = 0; i < IO_MAX_OPS; i++) {
+			struct io_uring_sqe *sqe;
+			if (!io_ops[i].queued || io_ops[i].state == IO_OP_DEAD)
+				continue;
+			if (!(sqe = uring_sqe()))
+				return -1;
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = i;
+			sqe->user_data = IO_TAG_CANCEL;
+		}
+		do {
+			uring_backlog();
+			if (io_nevs == IO_MAX_OPS)
+				break;
+			for (busy = 0, i = 0; i < IO_MAX_OPS; i++)
+				busy |= io_ops[i].queued;
+			if (busy && !tries--) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			if (busy && uring_enter(ring.queued, 1, 100) < 0)
+				return -1;
+			uring_reap(NULL, NULL);
+		} while (busy);
+	}
+#endif
+	return io_nevs;
+}
+
+struct io_event *
+io_next(void)
+{
+	while (io_cur < io_nevs) {
+		struct io_event *ev = &io_evs[io_cur++];
+		/* Skip what was cancelled while handling earlier events */
+		if (io_ops[ev->op].state == IO_OP_DEAD)
+			continue;
+		return ev;
+	}
+	return NULL;
+}
+
+/* Write to several fds at once.  Each w->res is set to what writev()
+ * would have returned, or -errno.
+ */
+int
+io_writev(struct io_wr *w, int n)
+{
+	int i;
+
+#ifdef CONFIG_IO_URING
+	if (io_uring_on && n > 0) {
+		uint32_t done = 0, sent = 0;
+
+		for (i = 0; i < n; i++) {
+			struct io_uring_sqe *sqe;
+			/* A full ring gets flushed, the writes on it can finish first */
+			while (!(sqe = uring_sqe()) && done < sent) {
+				if (uring_enter(ring.queued, 1, -1) < 0)
+					return -1;
+				uring_reap(w, &done);
+			}
+			if (!sqe)
+				break;
+			memset(&io_msgs[i], 0, sizeof(io_msgs[i]));
+			io_msgs[i].msg_iov = w[i].iov;
+			io_msgs[i].msg_iovlen = w[i].iovcnt;
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = w[i].fd;
+			sqe->addr = (uintptr_t)&io_msgs[i];
+			/* Never wait for socket space, report it like writev() */
+			sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+			sqe->user_data = IO_TAG_WRITE | i;
+			w[i].res = -EAGAIN;
+			sent++;
+		}
+		/* What did not make it onto the ring is tried next round */
+		for (; i < n; i++)
+			w[i].res = -EAGAIN;
+		while (done < sent) {
+			if (uring_enter(ring.queued, 1, -1) < 0)
+				return -1;
+			uring_reap(w, &done);
+		}
+		return 0;
+	}
+#endif
+	for (i = 0; i < n; i++)
+		if ((w[i].res = writev(w[i].fd, w[i].iov, w[i].iovcnt)) < 0)
+			w[i].res = -errno;
+	return 0;
 }
@@ -4,6 +4,7 @@
 extern int log_syslog;
 extern int loglevel;
 extern int quit;
+extern int errline;
 
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -16,14 +17,108 @@ extern int quit;
 
 #define BIT(x) (1 << (x))
 
+/* Messages above CONFIG_LOG_LEVEL are compiled out; the rest cost a
+ * compare unless -v asks for them.
+ */
+#ifndef CONFIG_LOG_LEVEL
+#define CONFIG_LOG_LEVEL	3
+#endif
+#define LOG_ON(level)	((level) <= CONFIG_LOG_LEVEL && (level) <= loglevel)
+
+extern uint64_t log_dropped;
+
 void message(int level, const char *fmt, ...);
-#define err(fmt...)	message(0, fmt)
-#define warn(fmt...)	message(1, fmt)
-#define info(fmt...)	message(2, fmt)
-#define debug(fmt...)	message(3, fmt)
+int log_start(void);
+void log_stop(void);
+#define err(fmt...)	do { if (LOG_ON(0)) message(0, fmt); } while (0)
+#define warn(fmt...)	do { if (LOG_ON(1)) message(1, fmt); } while (0)
+#define info(fmt...)	do { if (LOG_ON(2)) message(2, fmt); } while (0)
+#define debug(fmt...)	do { if (LOG_ON(3)) message(3, fmt); } while (0)
 
 int full_write(int fd, uint8_t *buf, uint32_t len, int eagain_quit);
 int full_read(int fd, uint8_t *buf, uint32_t len, int eagain_quit);
-uint16_t fletcher_cksum(uint8_t *data, uint32_t len);
+uint64_t mono_ms(void);
+uint64_t mono_us(void);
+int listen_open(char *listen_to);
+
+/* USDT probes for perf and bpftrace at the stages a frame goes
+ * through.  Built with CONFIG_SDT (needs sys/sdt.h) they are a nop
+ * until something attaches; without it they are not there at all.
+ */
+#ifdef CONFIG_SDT
+#include <sys/sdt.h>
+#define PROBE(name, ...)	STAP_PROBEV(caddx, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...)	do { } while (0)
+#endif
+
+/* Statistics, see util.c */
+#define STAT_COUNTER	0
+#define STAT_GAUGE	1
+#define STAT_HIST	2
+
+#define STAT_HIST_LEN	24	/* buckets up to 2^22, then +Inf */
+
+struct stat_hist {
+	uint64_t bucket[STAT_HIST_LEN];
+	uint64_t sum, count;
+};
+
+struct stat_def {
+	const char *name;
+	int type;
+	void *val;		/* uint64_t, or struct stat_hist for STAT_HIST */
+	const char *help;
+};
+
+void stat_hist_add(struct stat_hist *h, uint64_t v);
+char *stats_text(const struct stat_def *defs, uint32_t n, size_t *len);
+int stats_serve(int fd, const struct stat_def *defs, uint32_t n);
+void stats_log(const struct stat_def *defs, uint32_t n);
+
+/* Object pools, see util.c */
+struct pool {
+	void *free;
+	uint8_t *mem;		/* free() it when done */
+	uint32_t avail;
+};
+
+int pool_init(struct pool *p, size_t size, uint32_t n);
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *obj);
+
+/* I/O engine, see util.c */
+#define IO_MAX_OPS	256
+#define IO_BUF_LEN	256
+#define IO_ACCEPT_BATCH	32	/* extra connections taken per io_wait() */
+
+#define IO_EV_READ	0	/* res: bytes read into buf, 0 on EOF */
+#define IO_EV_ACCEPT	1	/* res: the new (non-blocking) fd */
+#define IO_EV_WRITABLE	2	/* one-shot */
+
+struct io_event {
+	int fd;
+	int type;
+	int res;		/* -errno on failure */
+	uint8_t *buf;		/* valid until the next io_wait() */
+	void *data;
+	int op;
+};
+
+struct io_wr {
+	int fd;
+	struct iovec *iov;
+	int iovcnt;
+	ssize_t res;
+};
+
+int io_init(int uring);
+const char *io_engine(void);
+int io_watch(int fd, int type, void *data);
+void io_cancel(int fd);
+int io_wait(int timeout);
+int io_stop(void);
+struct io_event *io_next(void);
+int io_writev(struct io_wr *w, int n);
 
 #endif /* __CADDX_UTIL_H_ */